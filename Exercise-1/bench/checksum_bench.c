@@ -0,0 +1,84 @@
+#include "../fs/crc32c.h"
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Measures the cost of block checksums (tfs_params.checksums) on the write
+ * and read paths, and the raw speed of the CRC32C implementation.
+ *
+ * Build without sanitizers for meaningful numbers: make DEBUG=no bench
+ */
+
+#define ITERATIONS (20000)
+#define SMALL_WRITE (64)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Rewrite a file (whole block, then a small in-place update) and read it
+ * back, over and over.
+ *
+ * Returns the throughput, in MiB/s of file data written and read.
+ */
+static double run_workload(bool checksums) {
+    tfs_params params = tfs_default_params();
+    params.checksums = checksums;
+    assert(tfs_init(&params) != -1);
+
+    size_t block_size = params.block_size;
+    char data[block_size];
+    memset(data, 'x', block_size);
+    char buffer[block_size];
+
+    int fd = tfs_open("/bench", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+
+    double start = now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        fd = tfs_open("/bench", 0);
+        assert(fd != -1);
+        assert(tfs_write(fd, data, block_size) == block_size);
+        assert(tfs_close(fd) != -1);
+
+        fd = tfs_open("/bench", 0);
+        assert(fd != -1);
+        assert(tfs_write(fd, data, SMALL_WRITE) == SMALL_WRITE);
+        assert(tfs_read(fd, buffer, block_size) == block_size - SMALL_WRITE);
+        assert(tfs_close(fd) != -1);
+    }
+    double elapsed = now() - start;
+
+    assert(tfs_destroy() != -1);
+
+    double bytes =
+        (double)ITERATIONS * (double)(2 * block_size); // written + read
+    return bytes / elapsed / (1024 * 1024);
+}
+
+int main() {
+    char block[1 << 16];
+    memset(block, 'y', sizeof(block));
+    uint32_t crc = 0;
+    double start = now();
+    for (int i = 0; i < 4096; i++) {
+        crc = crc32c(crc, block, sizeof(block));
+    }
+    double gib_per_s = 4096.0 * sizeof(block) / (now() - start) / (1 << 30);
+    printf("crc32c (%s): %.2f GiB/s [%08x]\n", crc32c_impl(), gib_per_s, crc);
+
+    double plain = run_workload(false);
+    double checked = run_workload(true);
+    printf("write/read without checksums: %.2f MiB/s\n", plain);
+    printf("write/read with checksums:    %.2f MiB/s\n", checked);
+    printf("overhead: %.2f%%\n", (plain - checked) / plain * 100);
+
+    return 0;
+}
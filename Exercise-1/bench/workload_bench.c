@@ -0,0 +1,642 @@
+#include "../fs/operations.h"
+#include "../fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Multi-threaded workloads over TécnicoFS: throughput (ops/s) and latency
+ * percentiles of mixes of file operations.
+ *
+ * Build without sanitizers for meaningful numbers: make DEBUG=no bench
+ *
+ * Usage: bench/workload_bench [-o report.json] [-f job file] [workload ...]
+ *
+ * Each workload is a list of key=value settings (a job file holds one per
+ * line, with # comments); without any, a default set is run:
+ *   - name=<label>
+ *   - mix=<op>:<weight>,... with ops open (open and close a file), read and
+ *     write (open, read or write size bytes, close), create, link and unlink
+ *   - threads=<n>,... and size=<bytes>,...: each combination is a separate
+ *     run (size is both the file size and the size of each read and write)
+ *   - files=<n>: files shared by all threads
+ *   - ops=<n>, warmup=<n>: operations per thread, timed or not
+ *   - seed=<n>
+ * e.g. "name=readers mix=read:90,write:10 threads=1,4 size=64,1024"
+ *
+ * A table goes to stdout, and with -o a JSON report to the given file (- for
+ * stdout, which moves the table to stderr).
+ */
+
+#define MAX_SWEEP (8)
+#define MAX_THREADS (64)
+#define SCRATCH (8) // files each thread creates, links and unlinks
+
+static FILE *table; // stdout, unless the JSON report goes there
+
+typedef enum {
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_CREATE,
+    OP_LINK,
+    OP_UNLINK,
+    OP_KINDS
+} op_kind_t;
+
+static char const *const op_names[OP_KINDS] = {
+    "open", "read", "write", "create", "link", "unlink",
+};
+
+typedef struct {
+    char name[32];
+    unsigned weights[OP_KINDS];
+    unsigned total_weight;
+    size_t threads[MAX_SWEEP];
+    size_t thread_runs;
+    size_t sizes[MAX_SWEEP];
+    size_t size_runs;
+    size_t files;
+    size_t ops;
+    size_t warmup;
+    unsigned seed;
+} workload_t;
+
+typedef struct {
+    uint64_t ns;
+    op_kind_t kind;
+} sample_t;
+
+/**
+ * A run of a workload, with one of its thread counts and sizes.
+ */
+typedef struct {
+    workload_t const *workload;
+    size_t threads;
+    size_t size;
+    pthread_barrier_t warm; // every thread has warmed up
+    sample_t *samples;      // ops per thread, in thread order
+} run_t;
+
+/**
+ * A worker thread, with the files of its own that it creates, links and
+ * unlinks (each either present or not).
+ */
+typedef struct {
+    run_t *run;
+    size_t id;
+    uint64_t random;
+    bool present[SCRATCH];
+    size_t next_fill;
+    size_t next_empty;
+    char *buffer;
+    uint64_t start; // of the timed operations
+    uint64_t end;
+} worker_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(worker_t *worker) {
+    // xorshift64
+    uint64_t x = worker->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return worker->random = x;
+}
+
+static void shared_name(char *name, size_t size, size_t file) {
+    snprintf(name, size, "/f%zu", file);
+}
+
+static void scratch_name(char *name, size_t size, size_t thread, size_t i) {
+    snprintf(name, size, "/t%zu_%zu", thread, i);
+}
+
+static void create_file(char const *name) {
+    int fd = tfs_open(name, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+}
+
+/**
+ * Do an operation of the workload.
+ * Scratch files are created or removed first (untimed) when the operation
+ * needs them to be.
+ *
+ * Returns how long the operation took, in ns.
+ */
+static uint64_t do_op(worker_t *worker, op_kind_t kind) {
+    workload_t const *workload = worker->run->workload;
+    size_t size = worker->run->size;
+    char shared[MAX_FILE_NAME];
+    shared_name(shared, sizeof(shared),
+                (size_t)(next_random(worker) % workload->files));
+    char scratch[MAX_FILE_NAME];
+    size_t slot = kind == OP_UNLINK ? worker->next_empty : worker->next_fill;
+    scratch_name(scratch, sizeof(scratch), worker->id, slot);
+    if (kind == OP_CREATE || kind == OP_LINK) {
+        worker->next_fill = (slot + 1) % SCRATCH;
+        if (worker->present[slot]) {
+            assert(tfs_unlink(scratch) != -1);
+        }
+        worker->present[slot] = true;
+    } else if (kind == OP_UNLINK) {
+        worker->next_empty = (slot + 1) % SCRATCH;
+        if (!worker->present[slot]) {
+            create_file(scratch);
+        }
+        worker->present[slot] = false;
+    }
+
+    uint64_t start = now_ns();
+    int fd;
+    switch (kind) {
+    case OP_OPEN:
+        fd = tfs_open(shared, 0);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+        break;
+    case OP_READ:
+        fd = tfs_open(shared, 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, worker->buffer, size) == size);
+        assert(tfs_close(fd) != -1);
+        break;
+    case OP_WRITE:
+        fd = tfs_open(shared, 0);
+        assert(fd != -1);
+        assert(tfs_write(fd, worker->buffer, size) == size);
+        assert(tfs_close(fd) != -1);
+        break;
+    case OP_CREATE:
+        create_file(scratch);
+        break;
+    case OP_LINK:
+        assert(tfs_link(shared, scratch) != -1);
+        break;
+    case OP_UNLINK:
+        assert(tfs_unlink(scratch) != -1);
+        break;
+    case OP_KINDS:
+    default:
+        assert(false);
+    }
+    return now_ns() - start;
+}
+
+static op_kind_t pick_op(worker_t *worker) {
+    workload_t const *workload = worker->run->workload;
+    unsigned pick = (unsigned)(next_random(worker) % workload->total_weight);
+    op_kind_t kind = OP_OPEN;
+    while (pick >= workload->weights[kind]) {
+        pick -= workload->weights[kind];
+        kind++;
+    }
+    return kind;
+}
+
+static void *worker_run(void *arg) {
+    worker_t *worker = arg;
+    run_t *run = worker->run;
+    for (size_t i = 0; i < run->workload->warmup; i++) {
+        do_op(worker, pick_op(worker));
+    }
+    pthread_barrier_wait(&run->warm);
+
+    sample_t *samples = &run->samples[worker->id * run->workload->ops];
+    worker->start = now_ns();
+    for (size_t i = 0; i < run->workload->ops; i++) {
+        samples[i].kind = pick_op(worker);
+        samples[i].ns = do_op(worker, samples[i].kind);
+    }
+    worker->end = now_ns();
+    return NULL;
+}
+
+/**
+ * Run a workload on a fresh TécnicoFS, with its shared files already
+ * holding size bytes each.
+ *
+ * Returns the time the timed operations took, in seconds.
+ */
+static double run_workload(run_t *run) {
+    workload_t const *workload = run->workload;
+    tfs_params params = tfs_default_params();
+    size_t files = 1 + workload->files + run->threads * SCRATCH;
+    params.max_inode_count = files;
+    params.max_block_count = files;
+    params.max_open_files_count = run->threads + 1;
+    // Blocks hold a whole file, and the root directory (all the files)
+    while (params.block_size < run->size ||
+           params.block_size < files * sizeof(dir_entry_t)) {
+        params.block_size *= 2;
+    }
+    assert(tfs_init(&params) != -1);
+
+    char *contents = malloc(run->size);
+    assert(contents != NULL);
+    memset(contents, 'w', run->size);
+    for (size_t i = 0; i < workload->files; i++) {
+        char name[MAX_FILE_NAME];
+        shared_name(name, sizeof(name), i);
+        int fd = tfs_open(name, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, contents, run->size) == run->size);
+        assert(tfs_close(fd) != -1);
+    }
+
+    worker_t workers[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    assert(pthread_barrier_init(&run->warm, NULL, (unsigned)run->threads) ==
+           0);
+    for (size_t i = 0; i < run->threads; i++) {
+        workers[i] = (worker_t){
+            .run = run,
+            .id = i,
+            .random = (workload->seed + 1) * 0x9e3779b97f4a7c15 + i + 1,
+            .buffer = malloc(run->size),
+        };
+        assert(workers[i].buffer != NULL);
+        memset(workers[i].buffer, 'a' + (int)(i % 26), run->size);
+        assert(pthread_create(&tid[i], NULL, worker_run, &workers[i]) == 0);
+    }
+    // From the first thread to start its timed operations to the last one
+    // to finish them
+    uint64_t start = UINT64_MAX, end = 0;
+    for (size_t i = 0; i < run->threads; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+        start = workers[i].start < start ? workers[i].start : start;
+        end = workers[i].end > end ? workers[i].end : end;
+        free(workers[i].buffer);
+    }
+    uint64_t elapsed = end - start;
+
+    pthread_barrier_destroy(&run->warm);
+    free(contents);
+    assert(tfs_destroy() != -1);
+    return (double)elapsed / 1e9;
+}
+
+static int sample_cmp(void const *a, void const *b) {
+    uint64_t x = ((sample_t const *)a)->ns;
+    uint64_t y = ((sample_t const *)b)->ns;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Latency percentiles of some operations.
+ */
+typedef struct {
+    size_t ops;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+} latency_t;
+
+static uint64_t percentile(uint64_t const *sorted, size_t count,
+                           unsigned per_mille) {
+    // nearest rank
+    size_t rank = (count * per_mille + 999) / 1000;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * Latencies of the operations of a kind (OP_KINDS for all of them), from
+ * samples sorted by latency.
+ */
+static latency_t latency_of(sample_t const *samples, size_t count,
+                            op_kind_t kind, uint64_t *scratch) {
+    latency_t latency = {0};
+    for (size_t i = 0; i < count; i++) {
+        if (kind == OP_KINDS || samples[i].kind == kind) {
+            scratch[latency.ops++] = samples[i].ns;
+        }
+    }
+    if (latency.ops > 0) {
+        latency.p50 = percentile(scratch, latency.ops, 500);
+        latency.p99 = percentile(scratch, latency.ops, 990);
+        latency.p999 = percentile(scratch, latency.ops, 999);
+    }
+    return latency;
+}
+
+static void print_row(char const *label, size_t threads, size_t size,
+                      double ops_per_s, latency_t latency) {
+    char threads_col[24] = "", size_col[24] = "";
+    if (threads > 0) {
+        snprintf(threads_col, sizeof(threads_col), "%zu", threads);
+        snprintf(size_col, sizeof(size_col), "%zu", size);
+    }
+    fprintf(table, "%-20s %7s %6s %8zu %11.0f %9.1f %9.1f %9.1f\n", label,
+           threads_col, size_col, latency.ops, ops_per_s,
+           (double)latency.p50 / 1e3, (double)latency.p99 / 1e3,
+           (double)latency.p999 / 1e3);
+}
+
+static void json_latency(FILE *json, latency_t latency, double seconds) {
+    fprintf(json,
+            "\"ops\": %zu, \"ops_per_sec\": %.1f, \"latency_ns\": "
+            "{\"p50\": %llu, \"p99\": %llu, \"p999\": %llu}",
+            latency.ops, (double)latency.ops / seconds,
+            (unsigned long long)latency.p50, (unsigned long long)latency.p99,
+            (unsigned long long)latency.p999);
+}
+
+/**
+ * Run a workload at each of its thread counts and sizes, reporting each run
+ * as a table row per kind of operation and as a JSON object.
+ *
+ * Input:
+ *   - workload: the workload
+ *   - json: where to write the JSON objects (NULL for none)
+ *   - first: whether no run was reported to json yet (updated)
+ */
+static void bench(workload_t const *workload, FILE *json, bool *first) {
+    for (size_t t = 0; t < workload->thread_runs; t++) {
+        for (size_t s = 0; s < workload->size_runs; s++) {
+            run_t run = {
+                .workload = workload,
+                .threads = workload->threads[t],
+                .size = workload->sizes[s],
+            };
+            size_t count = run.threads * workload->ops;
+            run.samples = malloc(count * sizeof(sample_t));
+            uint64_t *scratch = malloc(count * sizeof(uint64_t));
+            assert(run.samples != NULL && scratch != NULL);
+
+            double seconds = run_workload(&run);
+            qsort(run.samples, count, sizeof(sample_t), sample_cmp);
+
+            latency_t all = latency_of(run.samples, count, OP_KINDS, scratch);
+            print_row(workload->name, run.threads, run.size,
+                      (double)count / seconds, all);
+            if (json != NULL) {
+                fprintf(json,
+                        "%s    {\"workload\": \"%s\", \"threads\": %zu, "
+                        "\"size\": %zu, \"warmup\": %zu, \"seconds\": %.6f, ",
+                        *first ? "" : ",\n", workload->name, run.threads,
+                        run.size, workload->warmup, seconds);
+                json_latency(json, all, seconds);
+                fprintf(json, ", \"by_op\": {");
+                *first = false;
+            }
+            char const *separator = "";
+            for (op_kind_t kind = 0; kind < OP_KINDS; kind++) {
+                latency_t latency =
+                    latency_of(run.samples, count, kind, scratch);
+                if (latency.ops == 0) {
+                    continue;
+                }
+                char label[32];
+                snprintf(label, sizeof(label), "  %s", op_names[kind]);
+                print_row(label, 0, 0, (double)latency.ops / seconds, latency);
+                if (json != NULL) {
+                    fprintf(json, "%s\"%s\": {", separator, op_names[kind]);
+                    json_latency(json, latency, seconds);
+                    fprintf(json, "}");
+                    separator = ", ";
+                }
+            }
+            if (json != NULL) {
+                fprintf(json, "}}");
+            }
+            free(scratch);
+            free(run.samples);
+        }
+    }
+}
+
+/**
+ * Parse a comma separated list of numbers.
+ *
+ * Returns how many there were, or 0 if the list is invalid.
+ */
+static size_t parse_list(char const *value, size_t *list, size_t max) {
+    size_t count = 0;
+    char const *p = value;
+    while (count < max) {
+        char *end;
+        unsigned long n = strtoul(p, &end, 10);
+        if (end == p || *p == '-') {
+            return 0;
+        }
+        list[count++] = n;
+        if (*end == '\0') {
+            return count;
+        } else if (*end != ',') {
+            return 0;
+        }
+        p = end + 1;
+    }
+    return 0;
+}
+
+static bool parse_mix(char *value, workload_t *workload) {
+    memset(workload->weights, 0, sizeof(workload->weights));
+    workload->total_weight = 0;
+    char *save;
+    for (char *op = strtok_r(value, ",", &save); op != NULL;
+         op = strtok_r(NULL, ",", &save)) {
+        char *weight = strchr(op, ':');
+        if (weight == NULL) {
+            return false;
+        }
+        *weight++ = '\0';
+        op_kind_t kind = 0;
+        while (kind < OP_KINDS && strcmp(op, op_names[kind]) != 0) {
+            kind++;
+        }
+        size_t w;
+        if (kind == OP_KINDS || parse_list(weight, &w, 1) != 1) {
+            return false;
+        }
+        workload->weights[kind] += (unsigned)w;
+        workload->total_weight += (unsigned)w;
+    }
+    return workload->total_weight > 0;
+}
+
+/**
+ * Parse a workload (see the top of this file).
+ *
+ * Returns 0 if successful, -1 if the workload is invalid.
+ */
+static int parse_workload(char const *spec, workload_t *workload) {
+    *workload = (workload_t){
+        .name = "workload",
+        .weights = {[OP_READ] = 1},
+        .total_weight = 1,
+        .threads = {1},
+        .thread_runs = 1,
+        .sizes = {1024},
+        .size_runs = 1,
+        .files = 16,
+        .ops = 2000,
+        .warmup = 200,
+    };
+    char copy[512];
+    if (strlen(spec) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    char *save;
+    for (char *setting = strtok_r(copy, " \t\n", &save); setting != NULL;
+         setting = strtok_r(NULL, " \t\n", &save)) {
+        char *value = strchr(setting, '=');
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        size_t n = 0;
+        bool ok = true;
+        if (strcmp(setting, "name") == 0) {
+            ok = strlen(value) < sizeof(workload->name) &&
+                 strpbrk(value, "\"\\") == NULL;
+            if (ok) {
+                strcpy(workload->name, value);
+            }
+        } else if (strcmp(setting, "mix") == 0) {
+            ok = parse_mix(value, workload);
+        } else if (strcmp(setting, "threads") == 0) {
+            workload->thread_runs =
+                parse_list(value, workload->threads, MAX_SWEEP);
+            ok = workload->thread_runs > 0;
+            for (size_t i = 0; i < workload->thread_runs; i++) {
+                ok = ok && workload->threads[i] > 0 &&
+                     workload->threads[i] <= MAX_THREADS;
+            }
+        } else if (strcmp(setting, "size") == 0) {
+            workload->size_runs = parse_list(value, workload->sizes, MAX_SWEEP);
+            ok = workload->size_runs > 0;
+            for (size_t i = 0; i < workload->size_runs; i++) {
+                ok = ok && workload->sizes[i] > 0;
+            }
+        } else if (strcmp(setting, "files") == 0) {
+            ok = parse_list(value, &workload->files, 1) == 1 &&
+                 workload->files > 0;
+        } else if (strcmp(setting, "ops") == 0) {
+            ok = parse_list(value, &workload->ops, 1) == 1 && workload->ops > 0;
+        } else if (strcmp(setting, "warmup") == 0) {
+            ok = parse_list(value, &workload->warmup, 1) == 1;
+        } else if (strcmp(setting, "seed") == 0) {
+            ok = parse_list(value, &n, 1) == 1;
+            workload->seed = (unsigned)n;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static char const *const default_workloads[] = {
+    "name=read-mostly mix=read:90,write:10 threads=1,4 size=64,1024",
+    "name=write-mostly mix=read:10,write:90 threads=1,4 size=1024",
+    "name=size-sweep mix=read:50,write:50 threads=2 size=64,512,4096",
+    "name=metadata mix=open:40,create:20,link:10,unlink:30 threads=1,2,4",
+};
+
+int main(int argc, char **argv) {
+    char const *json_path = NULL;
+    char const *job_path = NULL;
+    int first_spec = 1;
+    while (first_spec + 1 < argc && argv[first_spec][0] == '-') {
+        if (strcmp(argv[first_spec], "-o") == 0) {
+            json_path = argv[first_spec + 1];
+        } else if (strcmp(argv[first_spec], "-f") == 0) {
+            job_path = argv[first_spec + 1];
+        } else {
+            break;
+        }
+        first_spec += 2;
+    }
+
+    // Gather the workloads (all parsed up front, so that a typo does not
+    // show up after a long run)
+    size_t capacity = sizeof(default_workloads) / sizeof(default_workloads[0]);
+    capacity += (size_t)(argc - first_spec);
+    FILE *jobs = NULL;
+    char line[512];
+    if (job_path != NULL) {
+        jobs = fopen(job_path, "r");
+        if (jobs == NULL) {
+            fprintf(stderr, "%s: cannot open %s\n", argv[0], job_path);
+            return EXIT_FAILURE;
+        }
+        while (fgets(line, sizeof(line), jobs) != NULL) {
+            capacity++;
+        }
+        rewind(jobs);
+    }
+    workload_t *workloads = malloc(capacity * sizeof(workload_t));
+    assert(workloads != NULL);
+    size_t count = 0;
+    while (jobs != NULL && fgets(line, sizeof(line), jobs) != NULL) {
+        char const *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+        if (parse_workload(start, &workloads[count++]) == -1) {
+            fprintf(stderr, "%s: invalid workload: %s", argv[0], line);
+            return EXIT_FAILURE;
+        }
+    }
+    if (jobs != NULL) {
+        fclose(jobs);
+    }
+    for (int i = first_spec; i < argc; i++) {
+        if (parse_workload(argv[i], &workloads[count++]) == -1) {
+            fprintf(stderr, "%s: invalid workload: %s\n", argv[0], argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (count == 0) {
+        count = sizeof(default_workloads) / sizeof(default_workloads[0]);
+        for (size_t i = 0; i < count; i++) {
+            if (parse_workload(default_workloads[i], &workloads[i]) == -1) {
+                fprintf(stderr, "%s: invalid workload: %s\n", argv[0],
+                        default_workloads[i]);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    FILE *json = NULL;
+    if (json_path != NULL) {
+        json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (json == NULL) {
+            fprintf(stderr, "%s: cannot open %s\n", argv[0], json_path);
+            return EXIT_FAILURE;
+        }
+        fprintf(json, "{\"runs\": [\n");
+    }
+
+    table = json == stdout ? stderr : stdout;
+    fprintf(table, "%-20s %7s %6s %8s %11s %9s %9s %9s\n", "workload",
+            "threads", "size", "ops", "ops/s", "p50 us", "p99 us", "p999 us");
+    bool first = true;
+    for (size_t i = 0; i < count; i++) {
+        bench(&workloads[i], json, &first);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n]}\n");
+        if (json != stdout && fclose(json) != 0) {
+            fprintf(stderr, "%s: cannot write %s\n", argv[0], json_path);
+            return EXIT_FAILURE;
+        }
+    }
+    free(workloads);
+    return 0;
+}
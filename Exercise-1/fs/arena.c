@@ -0,0 +1,85 @@
+#define _DEFAULT_SOURCE // madvise
+#include "arena.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static size_t page_size(void) { return (size_t)sysconf(_SC_PAGESIZE); }
+
+static size_t round_up(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+/**
+ * Allocate a zero-filled arena.
+ *
+ * Memory is only taken as the arena is written, so arenas can be reserved at
+ * the largest size they may need.
+ *
+ * Arenas of at least a huge page are aligned to huge pages and backed by them
+ * when the system allows it, cutting TLB misses on sequential accesses.
+ *
+ * Input:
+ *   - size: size of the arena
+ *
+ * Returns the arena, or NULL if it could not be allocated.
+ */
+void *arena_alloc(size_t size) {
+    size = round_up(size > 0 ? size : 1, page_size());
+    size_t align = size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : page_size();
+
+    // Map extra room and trim it, so that the arena starts aligned
+    size_t mapped = size + align - page_size();
+    char *map = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    char *arena = (char *)round_up((uintptr_t)map, align);
+    size_t head = (size_t)(arena - map);
+    if (head > 0) {
+        munmap(map, head);
+    }
+    if (mapped - head > size) {
+        munmap(arena + size, mapped - head - size);
+    }
+
+    if (align == HUGE_PAGE_SIZE) {
+        madvise(arena, size, MADV_HUGEPAGE); // best effort
+    }
+    return arena;
+}
+
+/**
+ * Free an arena allocated with arena_alloc.
+ *
+ * Input:
+ *   - arena: the arena
+ *   - size: size it was allocated with
+ */
+void arena_free(void *arena, size_t size) {
+    if (arena != NULL) {
+        munmap(arena, round_up(size > 0 ? size : 1, page_size()));
+    }
+}
+
+/**
+ * Hand the memory of an unused range back to the OS. The range reads as zeros
+ * afterwards, and memory is only taken again when it is written.
+ * Only the pages that lie entirely inside the range are released.
+ *
+ * Input:
+ *   - arena: the arena
+ *   - offset: start of the unused range
+ *   - len: length of the unused range
+ */
+void arena_release(void *arena, size_t offset, size_t len) {
+    size_t page = page_size();
+    size_t start = round_up(offset, page);
+    size_t end = (offset + len) / page * page;
+    if (end > start) {
+        madvise((char *)arena + start, end - start, MADV_DONTNEED);
+    }
+}
@@ -0,0 +1,385 @@
+#include "blockstore.h"
+#include "betterassert.h"
+#include "lz.h"
+#include "state.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Allocation unit of the arena
+#define CHUNK_SIZE (64)
+#define FREE_CHUNK (UINT32_MAX)
+
+/**
+ * Where a block is stored in the arena.
+ * A size of 0 means the block is all zeros (and takes no space), and a size
+ * of block_size means it is stored uncompressed.
+ */
+typedef struct {
+    size_t start; // first chunk
+    size_t chunks;
+    size_t size; // bytes
+} extent_t;
+
+/**
+ * Cache slot, holding the uncompressed contents of a block.
+ */
+typedef struct {
+    bool valid;
+    bool dirty; // newer than the stored extent
+    size_t block;
+    int pins;
+    uint64_t last_use;
+    char *data;
+} slot_t;
+
+static char *arena;
+static size_t chunk_count;
+static uint32_t *chunk_owner; // block stored in each chunk, or FREE_CHUNK
+static size_t free_chunks;
+
+static extent_t *extents;
+static size_t block_count;
+static size_t block_size;
+static size_t block_chunks; // chunks taken by an uncompressed block
+
+static slot_t *slots;
+static size_t slot_count;
+static size_t dirty_count;
+static uint64_t use_clock;
+static char *scratch; // compression buffer
+
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unpinned_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Initialize the block store. Every block starts out as all zeros.
+ *
+ * Input:
+ *   - arena: memory where compressed blocks are kept
+ *   - arena_size: size of the arena
+ *   - count: number of blocks
+ *   - size: size of a block
+ *   - cache_blocks: number of blocks kept uncompressed
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int blockstore_init(void *arena_base, size_t arena_size, size_t count,
+                    size_t size, size_t cache_blocks) {
+    if (count >= FREE_CHUNK || cache_blocks == 0) {
+        return -1;
+    }
+
+    arena = arena_base;
+    chunk_count = arena_size / CHUNK_SIZE;
+    free_chunks = chunk_count;
+    block_count = count;
+    block_size = size;
+    block_chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    slot_count = cache_blocks;
+    dirty_count = 0;
+    use_clock = 0;
+
+    chunk_owner = malloc(chunk_count * sizeof(uint32_t));
+    extents = calloc(block_count, sizeof(extent_t));
+    slots = calloc(slot_count, sizeof(slot_t));
+    scratch = malloc(block_size);
+    if (!chunk_owner || !extents || !slots || !scratch) {
+        blockstore_destroy();
+        return -1;
+    }
+    for (size_t i = 0; i < chunk_count; i++) {
+        chunk_owner[i] = FREE_CHUNK;
+    }
+    for (size_t i = 0; i < slot_count; i++) {
+        slots[i].data = malloc(block_size);
+        if (slots[i].data == NULL) {
+            blockstore_destroy();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Release the cache and the extent table.
+ */
+void blockstore_destroy(void) {
+    for (size_t i = 0; slots != NULL && i < slot_count; i++) {
+        free(slots[i].data);
+    }
+    free(slots);
+    free(chunk_owner);
+    free(extents);
+    free(scratch);
+    slots = NULL;
+    chunk_owner = NULL;
+    extents = NULL;
+    scratch = NULL;
+    arena = NULL;
+}
+
+/**
+ * Release the chunks of a block's extent, leaving the block as all zeros.
+ * Must be called with the store locked.
+ */
+static void extent_free(size_t block) {
+    extent_t *extent = &extents[block];
+    for (size_t i = 0; i < extent->chunks; i++) {
+        chunk_owner[extent->start + i] = FREE_CHUNK;
+    }
+    free_chunks += extent->chunks;
+    *extent = (extent_t){0};
+}
+
+/**
+ * Slide every extent to the start of the arena, so that all free chunks end
+ * up contiguous.
+ * Must be called with the store locked.
+ */
+static void arena_compact(void) {
+    size_t to = 0;
+    size_t from = 0;
+    while (from < chunk_count) {
+        if (chunk_owner[from] == FREE_CHUNK) {
+            from++;
+            continue;
+        }
+        extent_t *extent = &extents[chunk_owner[from]];
+        size_t chunks = extent->chunks;
+        if (from != to) {
+            memmove(arena + to * CHUNK_SIZE, arena + from * CHUNK_SIZE,
+                    chunks * CHUNK_SIZE);
+            for (size_t i = 0; i < chunks; i++) {
+                chunk_owner[to + i] = chunk_owner[from];
+            }
+            extent->start = to;
+        }
+        to += chunks;
+        from += chunks;
+    }
+    for (size_t i = to; i < chunk_count; i++) {
+        chunk_owner[i] = FREE_CHUNK;
+    }
+}
+
+/**
+ * Find a run of free chunks, compacting the arena if they are all scattered.
+ * Must be called with the store locked.
+ *
+ * Returns the first chunk of the run.
+ */
+static size_t chunks_alloc(size_t chunks) {
+    ALWAYS_ASSERT(free_chunks >= chunks, "chunks_alloc: arena overcommitted");
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t run = 0;
+        for (size_t i = 0; i < chunk_count; i++) {
+            run = chunk_owner[i] == FREE_CHUNK ? run + 1 : 0;
+            if (run == chunks) {
+                return i + 1 - chunks;
+            }
+        }
+        arena_compact();
+    }
+    PANIC("chunks_alloc: no run of free chunks after compaction");
+}
+
+static bool all_zeros(char const *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Compress a dirty cached block back into the arena.
+ * Must be called with the store locked.
+ */
+static void slot_store(slot_t *slot) {
+    char const *data = slot->data;
+    size_t size = 0;
+    if (!all_zeros(data, block_size)) {
+        size = lz_compress(data, block_size, scratch, block_size - 1);
+        if (size == 0) {
+            size = block_size; // does not compress, keep it as is
+        } else {
+            data = scratch;
+        }
+    }
+
+    extent_free(slot->block);
+    extent_t *extent = &extents[slot->block];
+    extent->size = size;
+    extent->chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (extent->chunks > 0) {
+        extent->start = chunks_alloc(extent->chunks);
+        for (size_t i = 0; i < extent->chunks; i++) {
+            chunk_owner[extent->start + i] = (uint32_t)slot->block;
+        }
+        free_chunks -= extent->chunks;
+        memcpy(arena + extent->start * CHUNK_SIZE, data, size);
+    }
+
+    slot->dirty = false;
+    dirty_count--;
+}
+
+/**
+ * Decompress a block into a cache slot.
+ * Must be called with the store locked.
+ */
+static void slot_load(slot_t *slot, size_t block) {
+    extent_t const *extent = &extents[block];
+    char const *stored = arena + extent->start * CHUNK_SIZE;
+    if (extent->size == 0) {
+        memset(slot->data, 0, block_size);
+    } else if (extent->size == block_size) {
+        memcpy(slot->data, stored, block_size);
+    } else {
+        ssize_t size =
+            lz_decompress(stored, extent->size, slot->data, block_size);
+        ALWAYS_ASSERT(size == (ssize_t)block_size,
+                      "slot_load: corrupted compressed block");
+    }
+    slot->valid = true;
+    slot->dirty = false;
+    slot->block = block;
+}
+
+static slot_t *slot_find(size_t block) {
+    for (size_t i = 0; i < slot_count; i++) {
+        if (slots[i].valid && slots[i].block == block) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Pick the slot to reuse: an empty one, or else the least recently used one
+ * that is not pinned.
+ * Must be called with the store locked.
+ *
+ * Returns the slot, or NULL if all of them are pinned.
+ */
+static slot_t *slot_victim(void) {
+    slot_t *victim = NULL;
+    for (size_t i = 0; i < slot_count; i++) {
+        if (!slots[i].valid) {
+            return &slots[i];
+        }
+        if (slots[i].pins == 0 &&
+            (victim == NULL || slots[i].last_use < victim->last_use)) {
+            victim = &slots[i];
+        }
+    }
+    return victim;
+}
+
+/**
+ * Pin a block in the cache, decompressing it if needed.
+ * Waits if every cache slot is pinned, so a thread must not pin more than
+ * one block at a time.
+ *
+ * Input:
+ *   - block: the block number
+ *
+ * Returns a pointer to the uncompressed contents of the block, valid until
+ * the block is unpinned (see blockstore_put).
+ */
+void *blockstore_get(size_t block) {
+    ALWAYS_ASSERT(block < block_count, "blockstore_get: invalid block");
+
+    mutex_lock(&store_mutex);
+    slot_t *slot = slot_find(block);
+    while (slot == NULL) {
+        slot_t *victim = slot_victim();
+        if (victim == NULL) {
+            pthread_cond_wait(&unpinned_cond, &store_mutex);
+            slot = slot_find(block); // may have been loaded meanwhile
+            continue;
+        }
+        if (victim->valid && victim->dirty) {
+            slot_store(victim);
+        }
+        slot_load(victim, block);
+        slot = victim;
+    }
+    slot->pins++;
+    slot->last_use = ++use_clock;
+    mutex_unlock(&store_mutex);
+    return slot->data;
+}
+
+/**
+ * Unpin a block pinned by blockstore_get.
+ *
+ * Input:
+ *   - block: the block number
+ */
+void blockstore_put(size_t block) {
+    mutex_lock(&store_mutex);
+    slot_t *slot = slot_find(block);
+    ALWAYS_ASSERT(slot != NULL && slot->pins > 0,
+                  "blockstore_put: block is not pinned");
+    if (--slot->pins == 0) {
+        pthread_cond_broadcast(&unpinned_cond);
+    }
+    mutex_unlock(&store_mutex);
+}
+
+/**
+ * Declare that a pinned block is about to be modified.
+ *
+ * Space for the block to be stored uncompressed is set aside, so that
+ * evicting it never fails.
+ *
+ * Input:
+ *   - block: the block number
+ *
+ * Returns 0 if successful, -1 if the arena is full.
+ */
+int blockstore_dirty(size_t block) {
+    mutex_lock(&store_mutex);
+    slot_t *slot = slot_find(block);
+    ALWAYS_ASSERT(slot != NULL && slot->pins > 0,
+                  "blockstore_dirty: block is not pinned");
+    if (!slot->dirty) {
+        if (free_chunks < (dirty_count + 1) * block_chunks) {
+            mutex_unlock(&store_mutex);
+            return -1;
+        }
+        slot->dirty = true;
+        dirty_count++;
+    }
+    mutex_unlock(&store_mutex);
+    return 0;
+}
+
+/**
+ * Reset a block to all zeros, releasing its space (e.g. when it is freed).
+ * The block must not be pinned.
+ *
+ * Input:
+ *   - block: the block number
+ */
+void blockstore_clear(size_t block) {
+    ALWAYS_ASSERT(block < block_count, "blockstore_clear: invalid block");
+
+    mutex_lock(&store_mutex);
+    slot_t *slot = slot_find(block);
+    if (slot != NULL) {
+        ALWAYS_ASSERT(slot->pins == 0, "blockstore_clear: block is pinned");
+        if (slot->dirty) {
+            dirty_count--;
+        }
+        slot->valid = false;
+    }
+    extent_free(block);
+    mutex_unlock(&store_mutex);
+}
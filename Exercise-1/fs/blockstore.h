@@ -0,0 +1,25 @@
+#ifndef BLOCKSTORE_H
+#define BLOCKSTORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Compressed data block store.
+ *
+ * Blocks are kept compressed, as variable-size extents of an arena, and are
+ * decompressed into a small cache of hot blocks when used. Blocks must be
+ * pinned while their cached contents are accessed, and are compressed back
+ * when they are evicted from the cache.
+ */
+
+int blockstore_init(void *arena, size_t arena_size, size_t block_count,
+                    size_t block_size, size_t cache_blocks);
+void blockstore_destroy(void);
+
+void *blockstore_get(size_t block);
+void blockstore_put(size_t block);
+int blockstore_dirty(size_t block);
+void blockstore_clear(size_t block);
+
+#endif // BLOCKSTORE_H
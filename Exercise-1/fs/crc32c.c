@@ -0,0 +1,195 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// Castagnoli polynomial, bit-reflected
+#define CRC32C_POLY (0x82f63b78u)
+
+// Tables for the software (slicing-by-8) implementation
+static uint32_t crc_table[8][256];
+// x^(2^n) modulo the polynomial, used to skip over runs of zeros
+static uint32_t x2n_table[32];
+
+/**
+ * Update a raw CRC state (no initial or final inversion) with some data.
+ */
+typedef uint32_t (*crc_update_fn)(uint32_t state, unsigned char const *data,
+                                  size_t len);
+
+static crc_update_fn crc_update;
+static char const *crc_impl_name;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_update_sw(uint32_t state, unsigned char const *data,
+                              size_t len) {
+    while (len >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, data, sizeof(lo));
+        memcpy(&hi, data + 4, sizeof(hi));
+        lo ^= state;
+        state = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+                crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+                crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+                crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        state = crc_table[0][(state ^ *data++) & 0xff] ^ (state >> 8);
+    }
+    return state;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc_update_hw(uint32_t state, unsigned char const *data, size_t len) {
+    uint64_t state64 = state;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        state64 = _mm_crc32_u64(state64, word);
+        data += 8;
+        len -= 8;
+    }
+    state = (uint32_t)state64;
+    while (len-- > 0) {
+        state = _mm_crc32_u8(state, *data++);
+    }
+    return state;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc_update_hw(uint32_t state, unsigned char const *data,
+                              size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        state = __crc32cd(state, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        state = __crc32cb(state, *data++);
+    }
+    return state;
+}
+#endif
+
+/**
+ * Multiply two polynomials modulo the CRC polynomial (bit-reflected).
+ */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/**
+ * Return x^(8 * len) modulo the CRC polynomial: multiplying a raw CRC by it
+ * appends len zero bytes to the message.
+ */
+static uint32_t zeros_operator(size_t len) {
+    uint32_t p = 1u << 31; // x^0
+    for (unsigned k = 3; len > 0; len >>= 1, k++) {
+        if (len & 1) {
+            p = multmodp(x2n_table[k & 31], p);
+        }
+    }
+    return p;
+}
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc_table[t - 1][i];
+            crc_table[t][i] = crc_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    uint32_t p = 1u << 30; // x^1
+    x2n_table[0] = p;
+    for (int n = 1; n < 32; n++) {
+        x2n_table[n] = p = multmodp(p, p);
+    }
+
+    crc_update = crc_update_sw;
+    crc_impl_name = "table";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_update = crc_update_hw;
+        crc_impl_name = "sse4.2";
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc_update = crc_update_hw;
+    crc_impl_name = "armv8-crc";
+#endif
+}
+
+/**
+ * Compute the CRC32C of some data.
+ *
+ * Input:
+ *   - crc: CRC of the data that precedes this chunk (0 for the first chunk)
+ *   - data: the chunk
+ *   - len: length of the chunk
+ *
+ * Returns the CRC of all the data seen so far.
+ */
+uint32_t crc32c(uint32_t crc, void const *data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    return ~crc_update(~crc, data, len);
+}
+
+/**
+ * Update the CRC32C of a message after a range of it was overwritten, without
+ * reading the rest of the message.
+ *
+ * CRCs are linear, so the change to the CRC only depends on the bytes that
+ * changed and on how far they are from the end of the message.
+ *
+ * Input:
+ *   - crc: CRC of the whole message before the change
+ *   - old_data: previous contents of the range
+ *   - new_data: new contents of the range
+ *   - len: length of the range
+ *   - tail: number of bytes in the message after the range
+ *
+ * Returns the CRC of the whole message after the change.
+ */
+uint32_t crc32c_patch(uint32_t crc, void const *old_data,
+                      void const *new_data, size_t len, size_t tail) {
+    pthread_once(&crc_once, crc_init);
+    uint32_t delta = crc_update(0, old_data, len) ^ crc_update(0, new_data, len);
+    return crc ^ multmodp(zeros_operator(tail), delta);
+}
+
+/**
+ * Return the name of the CRC32C implementation in use.
+ */
+char const *crc32c_impl(void) {
+    pthread_once(&crc_once, crc_init);
+    return crc_impl_name;
+}
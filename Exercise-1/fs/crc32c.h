@@ -0,0 +1,17 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC32C (Castagnoli), computed with the CPU's CRC instructions when they are
+ * available, and with a table otherwise.
+ */
+
+uint32_t crc32c(uint32_t crc, void const *data, size_t len);
+uint32_t crc32c_patch(uint32_t crc, void const *old_data,
+                      void const *new_data, size_t len, size_t tail);
+char const *crc32c_impl(void);
+
+#endif // CRC32C_H
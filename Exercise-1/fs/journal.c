@@ -0,0 +1,380 @@
+#include "journal.h"
+#include "betterassert.h"
+#include "state.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_MAGIC (0x4a534654) // "TFSJ"
+
+// Journal size after which a commit triggers a checkpoint
+#define CHECKPOINT_SIZE (1 << 20)
+
+// Replay in parallel only when there are enough records to pay for it
+#define PARALLEL_REPLAY_RECORDS (4096)
+#define REPLAY_THREADS (4)
+// Records are split at these boundaries, each piece replayed by the thread
+// owning its chunk of the section
+#define REPLAY_CHUNK (4096)
+
+/**
+ * On-disk record header, followed by len bytes of payload.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t section;
+    uint64_t offset;
+    uint64_t len;
+    uint64_t lsn;
+    uint32_t checksum; // of the payload
+    uint32_t pad;
+} record_header_t;
+
+static int journal_fd = -1;
+static int (*sync_state)(void);
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+// Records appended but not yet written
+static char *pending;
+static size_t pending_len;
+static size_t pending_cap;
+
+static uint64_t next_lsn;    // last lsn handed out
+static uint64_t durable_lsn; // last lsn known to be on disk
+static bool flushing;        // a committer is writing the journal
+static size_t journal_size;  // bytes in the journal file
+
+// Last record logged by the calling thread
+static _Thread_local uint64_t thread_lsn;
+
+static uint32_t checksum(void const *data, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    unsigned char const *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Open the journal file, creating it if needed.
+ *
+ * Input:
+ *   - path: path of the journal file (in the OS' file system)
+ *   - checkpoint_sync: function that makes the FS state durable, called
+ *     before the journal is truncated by a checkpoint
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_open(char const *path, int (*checkpoint_sync)(void)) {
+    journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0640);
+    if (journal_fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(journal_fd, &st) == -1) {
+        journal_close();
+        return -1;
+    }
+
+    sync_state = checkpoint_sync;
+    journal_size = (size_t)st.st_size;
+    // lsns keep growing across sessions, as threads remember the last one
+    // they logged
+    durable_lsn = next_lsn;
+    return 0;
+}
+
+/**
+ * Close the journal, dropping records that were never committed.
+ */
+void journal_close(void) {
+    if (journal_fd != -1) {
+        close(journal_fd);
+    }
+    journal_fd = -1;
+    free(pending);
+    pending = NULL;
+    pending_len = 0;
+    pending_cap = 0;
+}
+
+bool journal_enabled(void) { return journal_fd != -1; }
+
+/**
+ * Log the current contents of a byte range of a persistent section.
+ *
+ * The bytes are copied while holding the journal lock, so records for the
+ * same range are ordered the same way as the values they hold.
+ *
+ * Input:
+ *   - section: index of the persistent section
+ *   - offset: offset of the range inside the section
+ *   - live: pointer to the range in primary memory
+ *   - len: length of the range
+ */
+void journal_log(uint32_t section, size_t offset, void const *live,
+                 size_t len) {
+    if (journal_fd == -1) {
+        return;
+    }
+
+    mutex_lock(&journal_mutex);
+    size_t needed = pending_len + sizeof(record_header_t) + len;
+    if (needed > pending_cap) {
+        size_t cap = pending_cap ? pending_cap : 4096;
+        while (cap < needed) {
+            cap *= 2;
+        }
+        pending = realloc(pending, cap);
+        ALWAYS_ASSERT(pending != NULL, "journal_log: out of memory");
+        pending_cap = cap;
+    }
+
+    record_header_t header = {
+        .magic = RECORD_MAGIC,
+        .section = section,
+        .offset = offset,
+        .len = len,
+        .lsn = ++next_lsn,
+        .checksum = checksum(live, len),
+    };
+    memcpy(pending + pending_len, &header, sizeof(header));
+    memcpy(pending + pending_len + sizeof(header), live, len);
+    pending_len = needed;
+    thread_lsn = header.lsn;
+    mutex_unlock(&journal_mutex);
+}
+
+/**
+ * Write and flush the pending records.
+ * Must be called with the journal lock held and no other flush running;
+ * the lock is released during the I/O.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int flush_pending(void) {
+    char *batch = pending;
+    size_t batch_len = pending_len;
+    uint64_t batch_lsn = next_lsn;
+
+    pending = NULL;
+    pending_len = 0;
+    pending_cap = 0;
+    flushing = true;
+    mutex_unlock(&journal_mutex);
+
+    int ret = 0;
+    size_t written = 0;
+    while (written < batch_len) {
+        ssize_t w = write(journal_fd, batch + written, batch_len - written);
+        if (w == -1) {
+            ret = -1;
+            break;
+        }
+        written += (size_t)w;
+    }
+    if (ret == 0 && fdatasync(journal_fd) == -1) {
+        ret = -1;
+    }
+    free(batch);
+
+    mutex_lock(&journal_mutex);
+    flushing = false;
+    journal_size += written;
+    if (ret == 0) {
+        durable_lsn = batch_lsn;
+    }
+    pthread_cond_broadcast(&journal_cond);
+    return ret;
+}
+
+/**
+ * Make every record logged by the calling thread durable.
+ *
+ * Concurrent callers are grouped: one of them writes and flushes the records
+ * of all of them, while the others wait for it.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_commit(void) {
+    if (journal_fd == -1) {
+        return 0;
+    }
+
+    uint64_t lsn = thread_lsn;
+    int ret = 0;
+    mutex_lock(&journal_mutex);
+    while (durable_lsn < lsn && ret == 0) {
+        if (flushing) {
+            pthread_cond_wait(&journal_cond, &journal_mutex);
+        } else {
+            ret = flush_pending();
+        }
+    }
+    mutex_unlock(&journal_mutex);
+    return ret;
+}
+
+/**
+ * Whether the journal grew large enough to be checkpointed.
+ */
+bool journal_checkpoint_due(void) {
+    if (journal_fd == -1) {
+        return false;
+    }
+    mutex_lock(&journal_mutex);
+    bool due = journal_size > CHECKPOINT_SIZE;
+    mutex_unlock(&journal_mutex);
+    return due;
+}
+
+/**
+ * Make the FS state durable and empty the journal file.
+ * Must be called while no update is half applied to the FS state, as the
+ * synced image must be consistent; records not yet written are kept, and
+ * written by their committers after the journal is emptied.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_checkpoint(void) {
+    if (journal_fd == -1) {
+        return 0;
+    }
+
+    mutex_lock(&journal_mutex);
+    while (flushing) {
+        pthread_cond_wait(&journal_cond, &journal_mutex);
+    }
+
+    int ret = sync_state();
+    if (ret == 0) {
+        ret = ftruncate(journal_fd, 0);
+    }
+    if (ret == 0) {
+        journal_size = 0;
+    }
+    mutex_unlock(&journal_mutex);
+    return ret;
+}
+
+typedef struct {
+    char const *const *records;
+    size_t count;
+    void *const *sections;
+    size_t id;
+    size_t threads;
+} replay_args_t;
+
+static size_t replay_partition(uint32_t section, uint64_t chunk,
+                               size_t threads) {
+    return (size_t)((section * 31 + chunk) % threads);
+}
+
+/**
+ * Apply, in journal order, the pieces of the records that fall in the chunks
+ * of one partition.
+ * Every byte of a section belongs to a single chunk, so overlapping records
+ * (e.g. a whole directory block and one of its entries) are applied to it
+ * by a single thread, in order.
+ */
+static void *replay_worker(void *arg) {
+    replay_args_t const *args = arg;
+    for (size_t i = 0; i < args->count; i++) {
+        record_header_t header;
+        memcpy(&header, args->records[i], sizeof(header));
+        char const *payload = args->records[i] + sizeof(header);
+        uint64_t end = header.offset + header.len;
+        for (uint64_t start = header.offset; start < end;) {
+            uint64_t chunk = start / REPLAY_CHUNK;
+            uint64_t chunk_end = (chunk + 1) * REPLAY_CHUNK;
+            uint64_t piece_end = chunk_end < end ? chunk_end : end;
+            if (replay_partition(header.section, chunk, args->threads) ==
+                args->id) {
+                memcpy((char *)args->sections[header.section] + start,
+                       payload + (start - header.offset), piece_end - start);
+            }
+            start = piece_end;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Redo the records in the journal file over the persistent sections.
+ *
+ * Records are validated in order and replay stops at the first torn or
+ * corrupted one. Large journals are replayed by several threads, each one
+ * owning a disjoint set of REPLAY_CHUNK-aligned chunks of the sections.
+ *
+ * Input:
+ *   - sections: base address of each persistent section
+ *   - section_sizes: size of each persistent section
+ *   - section_count: number of persistent sections
+ *
+ * Returns the number of records applied, or -1 in case of error.
+ */
+int journal_replay(void *const *sections, size_t const *section_sizes,
+                   size_t section_count) {
+    if (journal_fd == -1 || journal_size == 0) {
+        return 0;
+    }
+
+    char *log = malloc(journal_size);
+    char const **records = malloc(
+        (journal_size / sizeof(record_header_t) + 1) * sizeof(char *));
+    if (log == NULL || records == NULL ||
+        pread(journal_fd, log, journal_size, 0) != (ssize_t)journal_size) {
+        free(log);
+        free(records);
+        return -1;
+    }
+
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos + sizeof(record_header_t) <= journal_size) {
+        record_header_t header;
+        memcpy(&header, log + pos, sizeof(header));
+        if (header.magic != RECORD_MAGIC || header.section >= section_count ||
+            header.len > journal_size - pos - sizeof(header) ||
+            header.offset + header.len > section_sizes[header.section] ||
+            checksum(log + pos + sizeof(header), header.len) !=
+                header.checksum) {
+            break; // torn tail
+        }
+        records[count++] = log + pos;
+        pos += sizeof(header) + header.len;
+    }
+
+    size_t threads = count >= PARALLEL_REPLAY_RECORDS ? REPLAY_THREADS : 1;
+    pthread_t tids[REPLAY_THREADS];
+    replay_args_t args[REPLAY_THREADS];
+    for (size_t i = 0; i < threads; i++) {
+        args[i] = (replay_args_t){records, count, sections, i, threads};
+        if (threads > 1) {
+            if (pthread_create(&tids[i], NULL, replay_worker, &args[i]) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        } else {
+            replay_worker(&args[i]);
+        }
+    }
+    for (size_t i = 0; threads > 1 && i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    free(records);
+    free(log);
+    return (int)count;
+}
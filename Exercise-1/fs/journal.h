@@ -0,0 +1,29 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Metadata redo journal.
+ *
+ * Every record holds the after-image of a byte range of one of the persistent
+ * FS arrays (a section). Records are appended to an in-memory buffer and
+ * written to the journal file by journal_commit, which coalesces the records
+ * of all concurrent committers into a single write and flush.
+ */
+
+int journal_open(char const *path, int (*checkpoint_sync)(void));
+void journal_close(void);
+bool journal_enabled(void);
+
+void journal_log(uint32_t section, size_t offset, void const *live,
+                 size_t len);
+int journal_commit(void);
+bool journal_checkpoint_due(void);
+int journal_checkpoint(void);
+int journal_replay(void *const *sections, size_t const *section_sizes,
+                   size_t section_count);
+
+#endif // JOURNAL_H
@@ -0,0 +1,247 @@
+#include "lockprof.h"
+#include "state.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Locks a thread can hold at once and still have their hold time measured
+#define MAX_HELD (16)
+// Distinct call sites recorded (the rest are left out of the breakdown)
+#define MAX_SITES (512)
+
+#ifdef TFS_LOCK_PROFILE_SITES
+#define SITES_ENABLED (true)
+#else
+#define SITES_ENABLED (false)
+#endif
+
+static char const *const class_names[LOCK_CLASSES] = {
+    [LOCK_INODE_TABLE] = "inode_table",
+    [LOCK_DATA_BLOCK_TABLE] = "data_block_table",
+    [LOCK_DIR_ENTRIES] = "dir_entries",
+    [LOCK_OPEN_FILE_TABLE] = "open_file_table",
+    [LOCK_INODE] = "inode",
+    [LOCK_LINK] = "link",
+    [LOCK_OPEN_FILE_ENTRY] = "open_file_entry",
+    [LOCK_OTHER] = "other",
+};
+
+/**
+ * Counters of a lock class or call site, updated with relaxed atomics.
+ */
+typedef struct {
+    uint64_t shared;    // acquisitions for reading
+    uint64_t exclusive; // acquisitions for writing
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t hold_ns;
+} lock_counters_t;
+
+/**
+ * A call site: published by a release store of func, once the rest is set.
+ */
+typedef struct {
+    char const *func;
+    int line;
+    lock_class_t lock_class;
+    lock_counters_t counters;
+} site_t;
+
+/**
+ * A lock held by the current thread.
+ */
+typedef struct {
+    void const *lock;
+    lock_counters_t *class_counters;
+    lock_counters_t *site_counters; // NULL if not recorded
+    uint64_t since;
+} held_t;
+
+static lock_counters_t classes[LOCK_CLASSES];
+static site_t sites[MAX_SITES];
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local held_t held[MAX_HELD];
+static _Thread_local size_t held_count;
+
+uint64_t lockprof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void counter_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t counter_get(uint64_t const *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void counter_max(uint64_t *counter, uint64_t n) {
+    uint64_t max = counter_get(counter);
+    while (n > max && !__atomic_compare_exchange_n(counter, &max, n, true,
+                                                   __ATOMIC_RELAXED,
+                                                   __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Find the counters of a call site, adding it if it is new.
+ *
+ * Returns them, or NULL if the table of call sites is full.
+ */
+static lock_counters_t *site_find(char const *func, int line,
+                                  lock_class_t lock_class) {
+    size_t hash = ((uintptr_t)func * 31 + (size_t)line) * 8 + lock_class;
+    for (size_t i = 0; i < MAX_SITES; i++) {
+        site_t *site = &sites[(hash + i) % MAX_SITES];
+        char const *f = __atomic_load_n(&site->func, __ATOMIC_ACQUIRE);
+        if (f == NULL) {
+            // Claim the slot, unless another thread got to it first
+            mutex_lock(&sites_lock);
+            if (site->func == NULL) {
+                site->line = line;
+                site->lock_class = lock_class;
+                __atomic_store_n(&site->func, func, __ATOMIC_RELEASE);
+            }
+            f = site->func;
+            mutex_unlock(&sites_lock);
+        }
+        if (f == func && site->line == line &&
+            site->lock_class == lock_class) {
+            return &site->counters;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record the acquisition of a lock by the current thread.
+ *
+ * Input:
+ *   - lock: the lock
+ *   - lock_class: its class
+ *   - exclusive: whether it was locked for writing
+ *   - func, line: where it was locked
+ *   - start: when the thread started waiting for it (see lockprof_now)
+ */
+void lockprof_acquired(void const *lock, lock_class_t lock_class,
+                       bool exclusive, char const *func, int line,
+                       uint64_t start) {
+    uint64_t now = lockprof_now();
+    lock_counters_t *counters[2] = {&classes[lock_class], NULL};
+    if (SITES_ENABLED) {
+        counters[1] = site_find(func, line, lock_class);
+    }
+    for (size_t i = 0; i < 2 && counters[i] != NULL; i++) {
+        counter_add(exclusive ? &counters[i]->exclusive : &counters[i]->shared,
+                    1);
+        counter_add(&counters[i]->wait_ns, now - start);
+        counter_max(&counters[i]->max_wait_ns, now - start);
+    }
+
+    if (held_count < MAX_HELD) {
+        held[held_count++] = (held_t){
+            .lock = lock,
+            .class_counters = counters[0],
+            .site_counters = counters[1],
+            .since = now,
+        };
+    }
+}
+
+/**
+ * Record the release of a lock by the current thread.
+ *
+ * Input:
+ *   - lock: the lock
+ */
+void lockprof_released(void const *lock) {
+    uint64_t now = lockprof_now();
+    for (size_t i = held_count; i > 0; i--) {
+        held_t *h = &held[i - 1];
+        if (h->lock != lock) {
+            continue;
+        }
+        counter_add(&h->class_counters->hold_ns, now - h->since);
+        if (h->site_counters != NULL) {
+            counter_add(&h->site_counters->hold_ns, now - h->since);
+        }
+        memmove(h, h + 1, (held_count - i) * sizeof(held_t));
+        held_count--;
+        return;
+    }
+}
+
+static int by_wait(void const *a, void const *b) {
+    uint64_t wa = counter_get(&(*(lock_counters_t *const *)a)->wait_ns);
+    uint64_t wb = counter_get(&(*(lock_counters_t *const *)b)->wait_ns);
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+static void report_line(FILE *out, char const *name,
+                        lock_counters_t const *c) {
+    fprintf(out, "  %-48s %10llu %10llu %12.3f %12.3f %12.3f\n", name,
+            (unsigned long long)counter_get(&c->shared),
+            (unsigned long long)counter_get(&c->exclusive),
+            (double)counter_get(&c->wait_ns) / 1e6,
+            (double)counter_get(&c->max_wait_ns) / 1e6,
+            (double)counter_get(&c->hold_ns) / 1e6);
+}
+
+static void report_header(FILE *out, char const *title) {
+    fprintf(out, "  %-48s %10s %10s %12s %12s %12s\n", title, "shared",
+            "exclusive", "wait ms", "max wait ms", "hold ms");
+}
+
+/**
+ * Report the counters of each lock class (and call site), most waited for
+ * first, and start counting over.
+ *
+ * Input:
+ *   - out: where to write the report
+ */
+void lockprof_report(FILE *out) {
+    lock_counters_t *sorted[MAX_SITES];
+    size_t count = 0;
+    for (size_t i = 0; i < LOCK_CLASSES; i++) {
+        sorted[count++] = &classes[i];
+    }
+    qsort(sorted, count, sizeof(sorted[0]), by_wait);
+
+    fprintf(out, "Lock profile:\n");
+    report_header(out, "class");
+    for (size_t i = 0; i < count; i++) {
+        if (counter_get(&sorted[i]->shared) +
+                counter_get(&sorted[i]->exclusive) >
+            0) {
+            report_line(out, class_names[sorted[i] - classes], sorted[i]);
+        }
+    }
+    memset(classes, 0, sizeof(classes));
+
+    if (!SITES_ENABLED) {
+        return;
+    }
+    count = 0;
+    for (size_t i = 0; i < MAX_SITES; i++) {
+        if (sites[i].func != NULL) {
+            sorted[count++] = &sites[i].counters;
+        }
+    }
+    qsort(sorted, count, sizeof(sorted[0]), by_wait);
+    report_header(out, "call site");
+    for (size_t i = 0; i < count; i++) {
+        // Get back to the site of the counters
+        site_t const *site = (site_t const *)((char const *)sorted[i] -
+                                              offsetof(site_t, counters));
+        char name[64];
+        snprintf(name, sizeof(name), "%s:%d (%s)", site->func, site->line,
+                 class_names[site->lock_class]);
+        report_line(out, name, sorted[i]);
+    }
+    memset(sites, 0, sizeof(sites));
+}
@@ -0,0 +1,37 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Lock contention profiler, for builds with TFS_LOCK_PROFILE (make
+ * LOCK_PROFILE=yes, or LOCK_PROFILE=sites to also break the numbers down by
+ * call site).
+ *
+ * The rwlock wrappers of state.c report every acquisition, with the time it
+ * waited for, and every release, with the time the lock was held; the totals
+ * of each class of locks are reported at tfs_destroy, most waited for first.
+ */
+
+typedef enum {
+    LOCK_INODE_TABLE,
+    LOCK_DATA_BLOCK_TABLE,
+    LOCK_DIR_ENTRIES,
+    LOCK_OPEN_FILE_TABLE,
+    LOCK_INODE,           // one per inode
+    LOCK_LINK,            // one per inode
+    LOCK_OPEN_FILE_ENTRY, // one per open file table entry
+    LOCK_OTHER,           // e.g. the snapshot lock of operations.c
+    LOCK_CLASSES
+} lock_class_t;
+
+uint64_t lockprof_now(void);
+void lockprof_acquired(void const *lock, lock_class_t lock_class,
+                       bool exclusive, char const *func, int line,
+                       uint64_t start);
+void lockprof_released(void const *lock);
+void lockprof_report(FILE *out);
+
+#endif // LOCKPROF_H
@@ -0,0 +1,217 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A compressed stream is a list of sequences. Each sequence is a token byte,
+ * holding the number of literals (high nibble) and the match length minus
+ * MIN_MATCH (low nibble), followed by the literals, and then by a 2-byte
+ * little-endian offset back into the output. A nibble of 15 means the length
+ * goes on in the following bytes, each one adding up to 255. The last
+ * sequence only holds literals, and ends with the input.
+ */
+
+#define MIN_MATCH (4)
+#define MAX_OFFSET (65535)
+#define HASH_BITS (12)
+
+static uint32_t read32(unsigned char const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static size_t hash32(uint32_t v) {
+    return (size_t)((v * 2654435761u) >> (32 - HASH_BITS));
+}
+
+/**
+ * Append a length that did not fit in its nibble.
+ * Returns the new output position, or 0 if it does not fit.
+ */
+static size_t put_length(unsigned char *out, size_t op, size_t cap,
+                         size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= cap) {
+            return 0;
+        }
+        out[op++] = 255;
+    }
+    if (op >= cap) {
+        return 0;
+    }
+    out[op++] = (unsigned char)len;
+    return op;
+}
+
+/**
+ * Append a sequence. A match_len of 0 makes it the last one.
+ * Returns the new output position, or 0 if it does not fit.
+ */
+static size_t put_sequence(unsigned char *out, size_t op, size_t cap,
+                           unsigned char const *literals, size_t literal_len,
+                           size_t offset, size_t match_len) {
+    if (op >= cap) {
+        return 0;
+    }
+    size_t token_pos = op++;
+    size_t lit_nibble = literal_len < 15 ? literal_len : 15;
+    size_t match_nibble = 0;
+    if (match_len > 0) {
+        match_len -= MIN_MATCH;
+        match_nibble = match_len < 15 ? match_len : 15;
+    }
+    out[token_pos] = (unsigned char)(lit_nibble << 4 | match_nibble);
+
+    if (lit_nibble == 15 &&
+        (op = put_length(out, op, cap, literal_len - 15)) == 0) {
+        return 0;
+    }
+    if (literal_len > cap - op) {
+        return 0;
+    }
+    memcpy(out + op, literals, literal_len);
+    op += literal_len;
+
+    if (offset == 0) {
+        return op; // last sequence
+    }
+    if (cap - op < 2) {
+        return 0;
+    }
+    out[op++] = (unsigned char)(offset & 0xff);
+    out[op++] = (unsigned char)(offset >> 8);
+    if (match_nibble == 15) {
+        return put_length(out, op, cap, match_len - 15);
+    }
+    return op;
+}
+
+/**
+ * Compress a buffer.
+ *
+ * Input:
+ *   - src: data to compress
+ *   - len: length of the data
+ *   - dst: destination buffer
+ *   - cap: capacity of the destination buffer
+ *
+ * Returns the length of the compressed data, or 0 if it does not fit in cap
+ * bytes.
+ */
+size_t lz_compress(void const *src, size_t len, void *dst, size_t cap) {
+    unsigned char const *in = src;
+    unsigned char *out = dst;
+    size_t table[1 << HASH_BITS] = {0}; // position + 1 (0 is empty)
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+    while (len >= MIN_MATCH && ip <= len - MIN_MATCH) {
+        uint32_t seq = read32(in + ip);
+        size_t h = hash32(seq);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > MAX_OFFSET ||
+            read32(in + ref - 1) != seq) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        size_t match_len = MIN_MATCH;
+        while (ip + match_len < len && in[ref + match_len] == in[ip + match_len]) {
+            match_len++;
+        }
+        op = put_sequence(out, op, cap, in + anchor, ip - anchor, ip - ref,
+                          match_len);
+        if (op == 0) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    return put_sequence(out, op, cap, in + anchor, len - anchor, 0, 0);
+}
+
+/**
+ * Read a length that did not fit in its nibble.
+ * Returns the length, or -1 if the input ends first.
+ */
+static ssize_t get_length(unsigned char const *in, size_t *ip, size_t len) {
+    size_t total = 0;
+    unsigned char byte;
+    do {
+        if (*ip >= len) {
+            return -1;
+        }
+        byte = in[(*ip)++];
+        total += byte;
+    } while (byte == 255);
+    return (ssize_t)total;
+}
+
+/**
+ * Decompress a buffer produced by lz_compress.
+ *
+ * Input:
+ *   - src: compressed data
+ *   - len: length of the compressed data
+ *   - dst: destination buffer
+ *   - cap: capacity of the destination buffer
+ *
+ * Returns the length of the decompressed data, or -1 if the input is
+ * malformed or does not fit in cap bytes.
+ */
+ssize_t lz_decompress(void const *src, size_t len, void *dst, size_t cap) {
+    unsigned char const *in = src;
+    unsigned char *out = dst;
+
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < len) {
+        unsigned char token = in[ip++];
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            ssize_t extra = get_length(in, &ip, len);
+            if (extra == -1) {
+                return -1;
+            }
+            literal_len += (size_t)extra;
+        }
+        if (literal_len > len - ip || literal_len > cap - op) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip == len) {
+            break; // last sequence
+        }
+        if (len - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        size_t match_len = (size_t)(token & 0xf);
+        if (match_len == 15) {
+            ssize_t extra = get_length(in, &ip, len);
+            if (extra == -1) {
+                return -1;
+            }
+            match_len += (size_t)extra;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > cap - op) {
+            return -1;
+        }
+        // The match may overlap its own output, so copy byte by byte
+        for (size_t i = 0; i < match_len; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+    return (ssize_t)op;
+}
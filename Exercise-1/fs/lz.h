@@ -0,0 +1,15 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Small LZ77 codec (in the spirit of LZ4) for data blocks: fast, byte
+ * oriented, and with no state kept between calls.
+ */
+
+size_t lz_compress(void const *src, size_t len, void *dst, size_t cap);
+ssize_t lz_decompress(void const *src, size_t len, void *dst, size_t cap);
+
+#endif // LZ_H
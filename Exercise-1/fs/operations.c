@@ -1,13 +1,45 @@
 #include "operations.h"
 #include "config.h"
 #include "state.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include "betterassert.h"
+#include "stats.h"
+#include "trace.h"
 
+// Files imported together by each thread of tfs_import_tree, and the default
+// number of threads
+#define IMPORT_BATCH (16)
+#define IMPORT_THREADS (4)
 
+/*
+ * Operations that update the FS run as readers of this lock, so that
+ * tfs_snapshot (the only writer) sees the FS in between operations.
+ */
+static pthread_rwlock_t snapshot_rw_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Background flusher of the writes buffered by TFS_O_BUFFERED handles (see
+ * tfs_params.write_behind_ms), started along with the first such handle.
+ */
+static size_t write_behind_ms;
+static pthread_t flusher;
+static bool flusher_running;
+static bool flusher_stop;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wakeup = PTHREAD_COND_INITIALIZER;
+
+static void flusher_start(void);
+static void flusher_shutdown(void);
 
 tfs_params tfs_default_params() {
     tfs_params params = {
@@ -15,6 +47,8 @@ tfs_params tfs_default_params() {
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .cache_block_count = 16,
+        .write_behind_ms = 100,
     };
     return params;
 }
@@ -26,10 +60,15 @@ int tfs_init(tfs_params const *params_ptr) {
     } else {
         params = tfs_default_params();
     }
+    write_behind_ms = params.write_behind_ms;
 
-    if (state_init(params) != 0) {
+    int restored = state_init(params);
+    if (restored == -1) {
         return -1;
     }
+    if (restored) {
+        return 0; // root directory was loaded from the image
+    }
 
     // create root inode
     int root = inode_create(T_DIRECTORY);
@@ -41,12 +80,15 @@ int tfs_init(tfs_params const *params_ptr) {
 }
 
 int tfs_destroy() {
+    flusher_shutdown();
     if (state_destroy() != 0) {
         return -1;
     }
     return 0;
 }
 
+int tfs_sync() { return state_sync(); }
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
@@ -54,93 +96,200 @@ static bool valid_pathname(char const *name) {
 /**
  * Looks for a file.
  *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
+ * Note: as a simplification, only a plain directory space is supported: the
+ * root directory, or the directory of a snapshot.
  *
  * Input:
  *   - name: absolute path name
- *   - root_inode: the root directory inode
+ *   - dir_inode: the directory inode (root or snapshot)
  * Returns the inumber of the file, -1 if unsuccessful.
  */
-static int tfs_lookup(char const *name, inode_t const *root_inode) {
+static int tfs_lookup(char const *name, inode_t const *dir_inode) {
     if (!valid_pathname(name)) {
         return -1;
     }
-    if (root_inode != inode_get(ROOT_DIR_INUM)) {
-        return -1;
-    }
+    stats_add(STAT_LOOKUP, 1);
     // skip the initial '/' character
     name++;
-    return find_in_dir(root_inode, name);
+    return find_in_dir(dir_inode, name);
 }
 
+/**
+ * Count a call of an operation that reads or writes, and the bytes it moved.
+ *
+ * Input:
+ *   - calls: counter of the operation's calls
+ *   - bytes: counter of the bytes it read or wrote
+ *   - ret: the operation's return value
+ * Returns ret.
+ */
+static ssize_t count_io(stat_counter_t calls, stat_counter_t bytes,
+                        ssize_t ret) {
+    stats_add(calls, 1);
+    if (ret > 0) {
+        stats_add(bytes, (uint64_t)ret);
+    }
+    return ret;
+}
 
 /**
- * Open file.
+ * Record the span of a TFS call in the trace (see tfs_params.trace_events).
  *
  * Input:
- *  - name: absolute path name
- *  - mode: open flags
- * Returns the file descriptor, -1 if unsuccessful.
+ *   - name: the call
+ *   - start: when it started (trace_now)
+ *   - ret: its return value
+ * Returns ret.
  */
-int tfs_open(char const *name, tfs_file_mode_t mode) {
-    // Checks if the path name is valid
-    if (!valid_pathname(name)) {
+static ssize_t traced(char const *name, uint64_t start, ssize_t ret) {
+    trace_span(name, "tfs", start, trace_now());
+    return ret;
+}
+
+/**
+ * Start an operation that updates the FS.
+ */
+static void begin_update(void) { rdlock(&snapshot_rw_lock); }
+
+/**
+ * Finish an operation that updates the FS, making its metadata updates
+ * durable, and checkpointing the journal once it grew large.
+ *
+ * Input:
+ *   - ret: the operation's return value
+ * Returns ret, or -1 if the updates could not be committed.
+ */
+static ssize_t end_update(ssize_t ret) {
+    rw_unlock(&snapshot_rw_lock);
+    if (state_commit() == -1) {
         return -1;
     }
+    if (state_checkpoint_due()) {
+        // Keep updates out, so that none is half applied in the synced image
+        wrlock(&snapshot_rw_lock);
+        int checkpointed = state_checkpoint_due() ? state_checkpoint() : 0;
+        rw_unlock(&snapshot_rw_lock);
+        if (checkpointed == -1) {
+            return -1;
+        }
+    }
+    return ret;
+}
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_open: root dir inode must exist");
-    size_t offset;
-
-    int inum = tfs_lookup(name, root_dir_inode);
-    if (inum >= 0) {
-        // The file already exists
 
-        // Lock the inode
+/**
+ * Lock a file's inode, following symlinks to the file they point to.
+ *
+ * Input:
+ *  - dir_inode: the directory to look up the targets of symlinks in
+ *  - inum: inumber of the file (or symlink)
+ *  - exclusive: whether to write-lock the inode, rather than read-lock it
+ * Returns the inumber of the file reached, with its inode locked, or -1 if a
+ * symlink leads nowhere.
+ */
+static int lock_following_links(inode_t *dir_inode, int inum, bool exclusive) {
+    // Lock the inode
+    if (exclusive) {
         wrlock(get_lock(inum));
-        inode_t *inode = inode_get(inum);
-        ALWAYS_ASSERT(inode != NULL, "tfs_open: directory files must have an inode");
-
-        // If the file is a symlink, get the file it points to
-        while (inode->i_node_type == T_SYMLINK) {
-            // Get the file it points to
-            char* filename = (char*)data_block_get(inode->i_data_block);
-
-            // Get the inode number of the file points to
-            int newinum = tfs_lookup(filename, root_dir_inode);
-            if (newinum < 0) {
-                rw_unlock(get_lock(inum));
-                return -1;
-            }
+    } else {
+        rdlock(get_lock(inum));
+    }
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_open: directory files must have an inode");
+
+    // If the file is a symlink, get the file it points to
+    while (inode->i_node_type == T_SYMLINK) {
+        // Get the file it points to (longer names cannot match anyway)
+        char filename[MAX_FILE_NAME + 2];
+        strncpy(filename, data_block_get(inode->i_data_block),
+                sizeof(filename) - 1);
+        filename[sizeof(filename) - 1] = '\0';
+        data_block_put(inode->i_data_block);
+
+        // Get the inode number of the file points to
+        int newinum = tfs_lookup(filename, dir_inode);
+        if (newinum < 0) {
+            rw_unlock(get_lock(inum));
+            return -1;
+        }
 
-            // Lock the new inode and unlock the old one
+        // Lock the new inode and unlock the old one
+        if (exclusive) {
             wrlock(get_lock(newinum));
-            rw_unlock(get_lock(inum));
+        } else {
+            rdlock(get_lock(newinum));
+        }
+        rw_unlock(get_lock(inum));
 
-            inum = newinum;
-            // Check if the file exists
-            inode = inode_get(inum);
-            if (inode == NULL) {
-                rw_unlock(get_lock(inum));
-                return -1;
-            }
+        inum = newinum;
+        // Check if the file exists
+        inode = inode_get(inum);
+        if (inode == NULL) {
+            rw_unlock(get_lock(inum));
+            return -1;
         }
-        // Truncate (if requested)
-        if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
+    }
+    return inum;
+}
+
+/**
+ * Open a file, given its write-locked inode, and unlock it.
+ *
+ * Input:
+ *  - inum: inumber of the file
+ *  - mode: open flags (TFS_O_CREAT is ignored)
+ * Returns the file descriptor, -1 if unsuccessful.
+ */
+static int open_locked(int inum, tfs_file_mode_t mode) {
+    inode_t *inode = inode_get(inum);
+
+    // Truncate (if requested)
+    if ((mode & TFS_O_TRUNC) && inode_sealed(inode)) {
+        rw_unlock(get_lock(inum));
+        return -1;
+    }
+    if (mode & TFS_O_TRUNC) {
+        if (inode->i_size > 0) {
+            data_block_free(inode->i_data_block);
+            inode->i_size = 0;
+            inode_dirty(inum);
+            inode_append_sync(inum);
         }
-        // Determine initial offset
-        if (mode & TFS_O_APPEND) {
-            offset = inode->i_size;
-        } else {
-            offset = 0;
+    }
+    // Determine initial offset
+    size_t offset = (mode & TFS_O_APPEND) ? inode->i_size : 0;
+
+    // Add entry to the open file table and return the corresponding handle
+    int added = add_to_open_file_table(inum, offset, mode);
+    if (added != -1 && (mode & TFS_O_BUFFERED) && write_behind_ms > 0) {
+        flusher_start();
+    }
+
+    rw_unlock(get_lock(inum)); // Unlock the inode
+    return added;
+}
+
+/**
+ * Open file in a directory.
+ *
+ * Input:
+ *  - dir_inode: the directory inode (root or snapshot)
+ *  - name: absolute path name
+ *  - mode: open flags
+ * Returns the file descriptor, -1 if unsuccessful.
+ */
+static int open_in_dir(inode_t *dir_inode, char const *name,
+                       tfs_file_mode_t mode) {
+    // Checks if the path name is valid
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    int inum;
+    while ((inum = tfs_lookup(name, dir_inode)) < 0) {
+        if (!(mode & TFS_O_CREAT)) {
+            return -1;
         }
-    } else if (mode & TFS_O_CREAT) {
         // The file does not exist; the mode specified that it should be created
         // Create inode
         inum = inode_create(T_FILE);
@@ -150,28 +299,109 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 
         wrlock(get_lock(inum)); // Lock the inode
 
-        // Add entry in the root directory
-        if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
-            inode_delete(inum); // delete inode if failed to add entry
-            rw_unlock(get_lock(inum)); // unlock the inode
+        // Add entry in the directory
+        if (add_dir_entry(dir_inode, name + 1, inum) != -1) {
+            return open_locked(inum, mode);
+        }
+        inode_delete(inum); // delete inode if failed to add entry
+        rw_unlock(get_lock(inum)); // unlock the inode
+        if (tfs_lookup(name, dir_inode) < 0) {
             return -1; // no space in directory
         }
+        // Another thread created the file meanwhile, open that one
+    }
 
-        offset = 0;
-    } else {
+    // The file already exists (or the file a symlink points to)
+    inum = lock_following_links(dir_inode, inum, true);
+    if (inum < 0) {
         return -1;
     }
-
-    // Add entry to the open file table and return the corresponding handle
-    int added = add_to_open_file_table(inum, offset);
-
-    rw_unlock(get_lock(inum)); // Unlock the inode
-    return added;
+    return open_locked(inum, mode);
     // Note: for simplification, if file was created with TFS_O_CREAT and there
     // is an error adding an entry to the open file table, the file is not
     // opened, but it remains created
 }
 
+/**
+ * Open file.
+ *
+ * Input:
+ *  - name: absolute path name
+ *  - mode: open flags
+ * Returns the file descriptor, -1 if unsuccessful.
+ */
+int tfs_open(char const *name, tfs_file_mode_t mode) {
+    uint64_t start = trace_now();
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    ALWAYS_ASSERT(root_dir_inode != NULL,
+                  "tfs_open: root dir inode must exist");
+
+    stats_add(STAT_OPEN, 1);
+    begin_update();
+    ssize_t ret = end_update(open_in_dir(root_dir_inode, name, mode));
+    return (int)traced("tfs_open", start, ret);
+}
+
+/**
+ * Open a file by its inumber, if the inode was not reused since the
+ * generation was obtained.
+ *
+ * Input:
+ *  - inumber: inumber of the file
+ *  - generation: generation of the inode
+ *  - mode: open flags
+ * Returns the file descriptor, -1 if unsuccessful.
+ */
+static int open_inum(int inumber, uint64_t generation, tfs_file_mode_t mode) {
+    if ((mode & TFS_O_CREAT) || !inode_is_taken(inumber)) {
+        return -1;
+    }
+
+    // Check the inode under its lock, as it is deleted (and reused) under it
+    wrlock(get_lock(inumber));
+    inode_t const *inode = inode_get(inumber);
+    if (!inode_is_taken(inumber) || inode->i_generation != generation ||
+        inode->i_node_type != T_FILE) {
+        rw_unlock(get_lock(inumber));
+        return -1;
+    }
+    return open_locked(inumber, mode);
+}
+
+int tfs_open_inum(int inumber, uint64_t generation, tfs_file_mode_t mode) {
+    uint64_t start = trace_now();
+    stats_add(STAT_OPEN, 1);
+    begin_update();
+    ssize_t ret = end_update(open_inum(inumber, generation, mode));
+    return (int)traced("tfs_open_inum", start, ret);
+}
+
+int tfs_stat(char const *name, tfs_stat_t *stat) {
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    int inum = tfs_lookup(name, root_dir_inode);
+    if (inum < 0) {
+        return -1;
+    }
+    inum = lock_following_links(root_dir_inode, inum, false);
+    if (inum < 0) {
+        return -1;
+    }
+
+    inode_t const *inode = inode_get(inum);
+    stat->inumber = inum;
+    stat->generation = inode->i_generation;
+    stat->type = inode->i_node_type == T_DIRECTORY ? TFS_DT_DIRECTORY
+                                                   : TFS_DT_FILE;
+    stat->size = inode_size(inode);
+    stat->links = (size_t)inode->hard_links;
+    stat->sealed = inode_sealed(inode);
+    rw_unlock(get_lock(inum));
+    return 0;
+}
+
 /**
  * Creates a symlink to a file.
  * Adds an entry for the symlink in the root directory.
@@ -181,7 +411,7 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
  *   - link_name: absolute path name of the symlink
  * Returns 0 if successful, -1 otherwise.
  */
-int tfs_sym_link(char const *target, char const *link_name) {
+static int sym_link(char const *target, char const *link_name) {
     // Checks if the path name is valid
     if (!valid_pathname(link_name) || !valid_pathname(target)) {
         return -1;
@@ -206,13 +436,6 @@ int tfs_sym_link(char const *target, char const *link_name) {
         return -1;
     }
 
-
-    // Check if an equally named file already exists
-    if (tfs_lookup(link_name, root_dir_inode) != -1) {
-        rw_unlock(get_link_lock(target_inumber));
-        return -1;
-    }
-
     // Create inode for the symlink
     int inumber = inode_create(T_SYMLINK);
     if (inumber == -1) {
@@ -231,22 +454,37 @@ int tfs_sym_link(char const *target, char const *link_name) {
     }
 
     // Copy the target file name to the data block of the symlink
-    if (strcpy((char*)data_block_get(inode->i_data_block), target) == NULL) {
+    if (data_block_write(inode->i_data_block, 0, target, strlen(target) + 1) ==
+        -1) {
+        inode_delete(inumber);
         rw_unlock(get_link_lock(inumber));
         rw_unlock(get_link_lock(target_inumber));
         return -1;
     }
     // Set the size of the symlink
     inode->i_size = sizeof(target);
+    data_block_journal(inode->i_data_block, 0, strlen(target) + 1);
+    inode_dirty(inumber);
 
-    // Add entry in the root directory
+    // Add entry in the root directory (fails if link_name already exists)
     int dir_entry = add_dir_entry(root_dir_inode, link_name + 1, inumber);
+    if (dir_entry == -1) {
+        inode_delete(inumber);
+    }
 
     rw_unlock(get_link_lock(inumber));
     rw_unlock(get_link_lock(target_inumber));
     return dir_entry;
 }
 
+int tfs_sym_link(char const *target, char const *link_name) {
+    uint64_t start = trace_now();
+    stats_add(STAT_LINK, 1);
+    begin_update();
+    ssize_t ret = end_update(sym_link(target, link_name));
+    return (int)traced("tfs_sym_link", start, ret);
+}
+
 
 /**
  * Creates a hardlink to a file.
@@ -257,7 +495,7 @@ int tfs_sym_link(char const *target, char const *link_name) {
  *   - link_name: absolute path name of the symlink
  * Returns 0 if successful, -1 otherwise.
  */
-int tfs_link(char const *target, char const *link_name) {
+static int hard_link(char const *target, char const *link_name) {
     // Checks if the path name is valid
     if (!valid_pathname(link_name) || !valid_pathname(target)) {
         return -1;
@@ -269,88 +507,220 @@ int tfs_link(char const *target, char const *link_name) {
 
     // Get the inode number of the target file
     int inumber = tfs_lookup(target, root_dir_inode);
-    wrlock(get_link_lock(inumber));
 
     // Check if the target file exists
     if (inumber < 0) {
-        rw_unlock(get_link_lock(inumber));
         return -1;
     }
 
+    // Lock the inode of the target file, which guards its hard link count
+    // (as in unlink_file)
+    wrlock(get_lock(inumber));
+
     // Check if the inode exists
     inode_t *inode = inode_get(inumber);
     if (inode == NULL){
-        rw_unlock(get_link_lock(inumber));
+        rw_unlock(get_lock(inumber));
         return -1;
     }
 
     // if it is a symlink or directory, unable to hardlink
     if (inode->i_node_type != T_FILE) {
-        rw_unlock(get_link_lock(inumber));
-        return -1;
-    }
-
-    // if the link name already exists, unable to hardlink
-    if (tfs_lookup(link_name, root_dir_inode) != -1) {
-        rw_unlock(get_link_lock(inumber));
+        rw_unlock(get_lock(inumber));
         return -1;
     }
 
-    // Add entry in the root directory
+    // Add entry in the root directory (fails if link_name already exists)
     int dir_entry = add_dir_entry(root_dir_inode, link_name + 1, inumber);
     if (dir_entry < 0) {
-        rw_unlock(get_link_lock(inumber));
+        rw_unlock(get_lock(inumber));
         return -1;
     }
 
     // increment the hardlink count
     inode->hard_links++;
+    inode_dirty(inumber);
 
-    rw_unlock(get_link_lock(inumber));
+    rw_unlock(get_lock(inumber));
     return dir_entry;
 }
 
+int tfs_link(char const *target, char const *link_name) {
+    uint64_t start = trace_now();
+    stats_add(STAT_LINK, 1);
+    begin_update();
+    ssize_t ret = end_update(hard_link(target, link_name));
+    return (int)traced("tfs_link", start, ret);
+}
+
 /**
- * Close file.
+ * Append to a file concurrently with other appenders, holding only the
+ * inode's read lock (see inode_append_reserve).
+ * Must be called with the open file entry write-locked.
  *
  * Input:
- *  - fhandle: file handle of the file to close
- * Returns 0 if successful, -1 otherwise.
+ * - file: open file entry, opened with TFS_O_APPEND
+ * - buffer: buffer containing the data to write
+ * - to_write: number of bytes to write
+ * Returns the number of bytes written, or -1 if the append must be done with
+ * the inode write-locked instead (empty file, shared block, checksums or
+ * compression).
  */
-int tfs_close(int fhandle) {
-    // Lock the open file entry
-    wrlock(get_entry_lock(fhandle));
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        rw_unlock(get_entry_lock(fhandle));
-        return -1; // invalid fd
+static ssize_t file_append(open_file_entry_t *file, void const *buffer,
+                           size_t to_write) {
+    rdlock(get_lock(file->of_inumber));
+    inode_t const *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+
+    if (inode_size(inode) == 0 || data_block_shared(inode->i_data_block) ||
+        inode_sealed(inode)) {
+        rw_unlock(get_lock(file->of_inumber));
+        return -1;
     }
 
-    // Remove the entry from the open file table
-    remove_from_open_file_table(fhandle);
+    size_t start;
+    ssize_t reserved = inode_append_reserve(file->of_inumber, to_write, &start);
+    if (reserved > 0) {
+        data_block_append(inode->i_data_block, start, buffer,
+                          (size_t)reserved);
+        inode_append_publish(file->of_inumber, start,
+                             start + (size_t)reserved);
+        file->of_offset = start + (size_t)reserved;
+    } else if (reserved == 0) {
+        file->of_offset = inode_size(inode);
+    }
+    rw_unlock(get_lock(file->of_inumber));
+    return reserved;
+}
 
-    // Unlock the open file entry
-    rw_unlock(get_entry_lock(fhandle));
+/**
+ * Overwrite bytes inside a file concurrently with writers of other parts of
+ * it, holding only the inode's read lock and an exclusive lock on the range
+ * written (see inode_range_lock).
+ * Must be called with the open file entry write-locked.
+ *
+ * Input:
+ * - file: open file entry
+ * - buffer: buffer containing the data to write
+ * - to_write: number of bytes to write, at the current offset
+ * Returns the number of bytes written, or -1 if the write must be done with
+ * the inode write-locked instead (it extends the file, its block is shared,
+ * or with checksums or compression).
+ */
+static ssize_t file_overwrite(open_file_entry_t *file, void const *buffer,
+                              size_t to_write) {
+    if (to_write == 0 || !inode_range_writes()) {
+        return -1;
+    }
+
+    int inumber = file->of_inumber;
+    rdlock(get_lock(inumber));
+    inode_t const *inode = inode_get(inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+
+    size_t start = file->of_offset;
+    size_t end = start + to_write;
+    if (end > inode_size(inode) || inode_sealed(inode)) {
+        rw_unlock(get_lock(inumber));
+        return -1;
+    }
+    // Check for sharing once the range is locked, as clones wait for it
+    inode_range_lock(inumber, start, end, true);
+    if (data_block_shared(inode->i_data_block)) {
+        inode_range_unlock(inumber, start, end, true);
+        rw_unlock(get_lock(inumber));
+        return -1;
+    }
+    int written = data_block_write(inode->i_data_block, start, buffer,
+                                   to_write);
+    ALWAYS_ASSERT(written != -1, "tfs_write: uncompressed block write failed");
+    inode_range_unlock(inumber, start, end, true);
+    rw_unlock(get_lock(inumber));
+
+    file->of_offset = end;
+    return (ssize_t)to_write;
+}
+
+/**
+ * Give a file a data block of its own to write to: a new one if the file is
+ * empty, or a copy if its block is shared with a clone or snapshot.
+ * Must be called with the inode write-locked.
+ *
+ * Input:
+ * - inumber: the file's inumber
+ * - inode: the file's inode
+ * Returns 0 if successful, -1 otherwise (no space).
+ */
+static int inode_block_own(int inumber, inode_t *inode) {
+    if (inode->i_size == 0) {
+        // If empty file, allocate new block
+        int bnum = data_block_alloc();
+        if (bnum == -1) {
+            return -1;
+        }
+
+        inode->i_data_block = bnum;
+    } else if (data_block_shared(inode->i_data_block)) {
+        // The block is shared with a clone or snapshot, copy it first
+        int bnum = data_block_alloc();
+        if (bnum == -1 ||
+            data_block_copy(bnum, inode->i_data_block, inode->i_size) == -1) {
+            if (bnum != -1) {
+                data_block_free(bnum);
+            }
+            return -1;
+        }
+
+        data_block_free(inode->i_data_block);
+        inode->i_data_block = bnum;
+        inode_dirty(inumber);
+    }
     return 0;
 }
 
+/**
+ * Record that a file was written up to an offset: grow its size if needed,
+ * and share its block if an identical one exists, once it is full.
+ * Must be called with the inode write-locked.
+ *
+ * Input:
+ * - inumber: the file's inumber
+ * - inode: the file's inode
+ * - end: end of the data written
+ */
+static void inode_written(int inumber, inode_t *inode, size_t end) {
+    if (end > inode->i_size) {
+        inode->i_size = end;
+        inode_dirty(inumber);
+        inode_append_sync(inumber);
+    }
+
+    if (inode->i_size == state_block_size()) {
+        int bnum = data_block_dedup(inode->i_data_block);
+        if (bnum != inode->i_data_block) {
+            inode->i_data_block = bnum;
+            inode_dirty(inumber);
+        }
+    }
+}
 
 /**
- * Write to file.
+ * Write to an open file.
+ * Must be called with the open file entry write-locked.
  *
  * Input:
- * - fhandle: file handle of the file to write to
+ * - file: open file entry of the file to write to
  * - buffer: buffer containing the data to write
  * - to_write: number of bytes to write
  * Returns the number of bytes written if successful, -1 otherwise.
  */
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    // Lock the open file entry
-    wrlock(get_entry_lock(fhandle));
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        rw_unlock(get_entry_lock(fhandle));
-        return -1;
+static ssize_t entry_write(open_file_entry_t *file, void const *buffer,
+                           size_t to_write) {
+    ssize_t written = file->of_append
+                          ? file_append(file, buffer, to_write)
+                          : file_overwrite(file, buffer, to_write);
+    if (written != -1) {
+        return written;
     }
 
     // Lock the inode of the file to write to
@@ -359,147 +729,1397 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     // Get the inode of the file to write to
     inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+    if (inode_sealed(inode)) {
+        rw_unlock(get_lock(file->of_inumber));
+        return -1;
+    }
 
     // Determine how many bytes to write
     size_t block_size = state_block_size();
+    if (file->of_append) {
+        file->of_offset = inode->i_size;
+    }
     if (to_write + file->of_offset > block_size) {
         to_write = block_size - file->of_offset;
     }
 
     if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                rw_unlock(get_lock(file->of_inumber));
-                rw_unlock(get_entry_lock(fhandle));
-                return -1; // no space
-            }
-
-            inode->i_data_block = bnum;
+        if (inode_block_own(file->of_inumber, inode) == -1) {
+            rw_unlock(get_lock(file->of_inumber));
+            return -1; // no space
         }
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
-
         // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+        if (data_block_write(inode->i_data_block, file->of_offset, buffer,
+                             to_write) == -1) {
+            if (inode->i_size == 0) {
+                data_block_free(inode->i_data_block); // just allocated
+            }
+            rw_unlock(get_lock(file->of_inumber));
+            return -1; // no space
+        }
 
         // The offset associated with the file handle is incremented accordingly
         file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+        inode_written(file->of_inumber, inode, file->of_offset);
+    }
+    // Unlock the inode
+    rw_unlock(get_lock(file->of_inumber));
+    return (ssize_t)to_write;
+}
+
+/**
+ * Current time, in milliseconds (for write-behind timeouts).
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * Write the data buffered by a TFS_O_BUFFERED handle to its file.
+ * Must be called with the open file entry write-locked.
+ *
+ * Input:
+ * - file: open file entry
+ * Returns 0 if successful, -1 otherwise (the buffered data is dropped).
+ */
+static int write_behind_flush(open_file_entry_t *file) {
+    if (file->of_wb_len == 0) {
+        return 0;
+    }
+
+    size_t len = file->of_wb_len;
+    size_t offset = file->of_offset;
+    file->of_wb_len = 0;
+    file->of_offset = file->of_wb_start;
+    if (entry_write(file, file->of_wb_buffer, len) != (ssize_t)len) {
+        file->of_offset = offset;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Buffer a write to a TFS_O_BUFFERED handle, flushing the buffer first if the
+ * write does not fit, and after it once the buffer fills up, or reaches the
+ * end of the file's block.
+ * As unbuffered writes, writes are cut at the end of the file's block (for
+ * appends, at the end of the file plus what is buffered).
+ * Must be called with the open file entry write-locked.
+ *
+ * Input:
+ * - file: open file entry
+ * - buffer: buffer containing the data to write
+ * - to_write: number of bytes to write
+ * Returns the number of bytes written (or buffered) if successful, -1
+ * otherwise.
+ */
+static ssize_t write_behind(open_file_entry_t *file, void const *buffer,
+                            size_t to_write) {
+    size_t block_size = state_block_size();
+    size_t end = file->of_offset;
+    if (file->of_append) {
+        rdlock(get_lock(file->of_inumber));
+        end = inode_size(inode_get(file->of_inumber)) + file->of_wb_len;
+        rw_unlock(get_lock(file->of_inumber));
+    }
+    if (to_write + end > block_size) {
+        to_write = end < block_size ? block_size - end : 0;
+    }
+    if (file->of_wb_len + to_write > block_size &&
+        write_behind_flush(file) == -1) {
+        return -1;
+    }
+    if (to_write == 0 || to_write == block_size) {
+        return entry_write(file, buffer, to_write); // nothing to gather
+    }
+    if (file->of_wb_buffer == NULL) {
+        file->of_wb_buffer = malloc(block_size);
+        if (file->of_wb_buffer == NULL) {
+            return entry_write(file, buffer, to_write);
         }
     }
-    // Unlock the inode and the open file entry
+
+    if (file->of_wb_len == 0) {
+        file->of_wb_start = file->of_offset;
+        file->of_wb_since = now_ms();
+    }
+    memcpy(file->of_wb_buffer + file->of_wb_len, buffer, to_write);
+    file->of_wb_len += to_write;
+    file->of_offset += to_write;
+    // Write out a full block right away
+    if ((file->of_wb_len == block_size || file->of_offset == block_size) &&
+        write_behind_flush(file) == -1) {
+        return -1;
+    }
+    return (ssize_t)to_write;
+}
+
+/**
+ * Write to file.
+ *
+ * Input:
+ * - fhandle: file handle of the file to write to
+ * - buffer: buffer containing the data to write
+ * - to_write: number of bytes to write
+ * Returns the number of bytes written if successful, -1 otherwise.
+ */
+static ssize_t file_write(int fhandle, void const *buffer, size_t to_write) {
+    // Lock the open file entry
+    wrlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        rw_unlock(get_entry_lock(fhandle));
+        return -1;
+    }
+
+    ssize_t written = file->of_buffered
+                          ? write_behind(file, buffer, to_write)
+                          : entry_write(file, buffer, to_write);
+
+    // Unlock the open file entry
+    rw_unlock(get_entry_lock(fhandle));
+    return written;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    uint64_t start = trace_now();
+    begin_update();
+    ssize_t ret = end_update(file_write(fhandle, buffer, to_write));
+    return traced("tfs_write", start,
+                  count_io(STAT_WRITE, STAT_WRITE_BYTES, ret));
+}
+
+/**
+ * What tfs_recvfile found when it started receiving into a file.
+ */
+typedef struct {
+    int inumber;
+    size_t offset;    // where the data goes in the file
+    size_t size;      // size of the file then
+    int block;        // the file's block then, or -1 if it was empty
+    uint64_t version; // version of that block then
+    int copy;         // private copy of the block, to receive the data into
+    size_t room;      // bytes to receive: up to the end of the block
+    char *buffer;     // the data received, if blocks are compressed
+} receive_t;
+
+/**
+ * Start receiving data into an open file: copy the file's block to a block of
+ * its own, to receive the data into with the file unlocked.
+ * Must be called within an update (see begin_update).
+ *
+ * Input:
+ * - fhandle: file handle of the file to write to
+ * - len: maximum number of bytes to receive
+ * - recv: where to store what was found
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int receive_start(int fhandle, size_t len, receive_t *recv) {
+    wrlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    // Keep the order of the writes buffered before
+    if (file == NULL || write_behind_flush(file) == -1) {
+        rw_unlock(get_entry_lock(fhandle));
+        return -1;
+    }
+    recv->inumber = file->of_inumber;
+    rdlock(get_lock(recv->inumber));
+    inode_t const *inode = inode_get(recv->inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_recvfile: inode of open file deleted");
+    if (inode_sealed(inode)) {
+        rw_unlock(get_lock(recv->inumber));
+        rw_unlock(get_entry_lock(fhandle));
+        return -1;
+    }
+
+    recv->size = inode_size(inode);
+    recv->offset = file->of_append ? recv->size : file->of_offset;
+    size_t block_size = state_block_size();
+    recv->room = recv->offset < block_size ? block_size - recv->offset : 0;
+    if (recv->room > len) {
+        recv->room = len;
+    }
+    recv->block = recv->size > 0 ? inode->i_data_block : -1;
+    recv->version = recv->block != -1 ? data_block_version(recv->block) : 0;
+    recv->copy = -1;
+    recv->buffer = NULL;
+    int ret = 0;
+    if (recv->room > 0) {
+        recv->copy = data_block_alloc();
+        if (recv->copy == -1 ||
+            (recv->block != -1 &&
+             data_block_copy(recv->copy, recv->block, recv->size) == -1)) {
+            ret = -1;
+        }
+    }
+    rw_unlock(get_lock(recv->inumber));
+    rw_unlock(get_entry_lock(fhandle));
+    if (ret == -1 && recv->copy != -1) {
+        data_block_free(recv->copy);
+    }
+    return ret;
+}
+
+/**
+ * Read from a file descriptor of the OS until a buffer is full or the input
+ * ends, resuming partial reads.
+ *
+ * Input:
+ * - fd: file descriptor to read from
+ * - buffer: where to store the data
+ * - len: size of the buffer
+ * Returns the number of bytes read (lower than len if the input ended, or
+ * failed midway), -1 if reading failed before any data was read.
+ */
+static ssize_t read_fd(int fd, char *buffer, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = read(fd, buffer + done, len - done);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        done += (size_t)got;
+    }
+    return (ssize_t)done;
+}
+
+/**
+ * Receive data from a file descriptor of the OS into the private block of
+ * receive_start, holding no lock.
+ *
+ * Input:
+ * - fd: file descriptor to read from
+ * - recv: what receive_start found
+ * Returns the number of bytes received (see read_fd), -1 if reading failed
+ * before any data was read.
+ */
+static ssize_t receive_fill(int fd, receive_t *recv) {
+    if (!state_compressed()) {
+        char *block = data_block_claim(recv->copy);
+        ssize_t got = read_fd(fd, block + recv->offset, recv->room);
+        data_block_filled(recv->copy);
+        return got;
+    }
+
+    // Compressed blocks only live in a cache, so go through a buffer (kept,
+    // as it is pinned in the cache for no longer than a copy)
+    recv->buffer = malloc(recv->room);
+    if (recv->buffer == NULL) {
+        return -1;
+    }
+    ssize_t got = read_fd(fd, recv->buffer, recv->room);
+    if (got > 0 && data_block_write(recv->copy, recv->offset, recv->buffer,
+                                    (size_t)got) == -1) {
+        got = -1;
+    }
+    return got;
+}
+
+/**
+ * Finish receiving data into an open file. If neither the file nor the
+ * handle changed since receive_start, the private block takes the place of
+ * the file's block; otherwise, the data is written like any other, and the
+ * part that no longer fits is dropped.
+ * Must be called within an update (see begin_update).
+ *
+ * Input:
+ * - fhandle: file handle of the file to write to
+ * - recv: what receive_start found
+ * - got: number of bytes received
+ * Returns the number of bytes written if successful, -1 otherwise.
+ */
+static ssize_t receive_finish(int fhandle, receive_t const *recv,
+                              size_t got) {
+    wrlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || file->of_inumber != recv->inumber) {
+        rw_unlock(get_entry_lock(fhandle));
+        data_block_free(recv->copy);
+        return -1;
+    }
+
+    wrlock(get_lock(recv->inumber));
+    inode_t *inode = inode_get(recv->inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_recvfile: inode of open file deleted");
+    bool unchanged =
+        !inode_sealed(inode) && inode->i_size == recv->size &&
+        (recv->block == -1 ||
+         (inode->i_data_block == recv->block &&
+          data_block_version(recv->block) == recv->version)) &&
+        (file->of_append || file->of_offset == recv->offset) &&
+        file->of_wb_len == 0;
+    ssize_t written = (ssize_t)got;
+    if (unchanged) {
+        if (recv->block != -1) {
+            data_block_free(recv->block);
+        }
+        inode->i_data_block = recv->copy;
+        inode_dirty(recv->inumber);
+        inode_written(recv->inumber, inode, recv->offset + got);
+        file->of_offset = recv->offset + got;
+        rw_unlock(get_lock(recv->inumber));
+    } else {
+        rw_unlock(get_lock(recv->inumber));
+        // Uncompressed blocks stay put, so the copy is written from
+        char const *data = recv->buffer != NULL
+                               ? recv->buffer
+                               : (char const *)data_block_get(recv->copy) +
+                                     recv->offset;
+        written = write_behind_flush(file) == -1 ? -1
+                                                 : entry_write(file, data, got);
+        data_block_free(recv->copy);
+    }
+    rw_unlock(get_entry_lock(fhandle));
+    return written;
+}
+
+ssize_t tfs_recvfile(int fd, int fhandle, size_t len) {
+    uint64_t start = trace_now();
+
+    // Wait for the input holding no lock, so that a descriptor that blocks
+    // holds off nobody: the data goes straight into a private copy of the
+    // file's block, which then takes the place of the block
+    receive_t recv;
+    begin_update();
+    int started = receive_start(fhandle, len, &recv);
+    end_update(0); // a failed commit shows once the data is written
+    ssize_t received = started == -1 ? -1 : 0;
+    if (started == 0 && recv.room > 0) {
+        received = receive_fill(fd, &recv);
+        begin_update();
+        if (received > 0) {
+            received = receive_finish(fhandle, &recv, (size_t)received);
+        } else {
+            data_block_free(recv.copy);
+        }
+        received = end_update(received);
+        free(recv.buffer);
+    }
+    return traced("tfs_recvfile", start,
+                  count_io(STAT_WRITE, STAT_WRITE_BYTES, received));
+}
+
+/**
+ * Flush an open file's buffered writes, reporting earlier background flushes
+ * that failed.
+ * Must be called with the open file entry write-locked.
+ *
+ * Input:
+ * - file: open file entry
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int file_flush(open_file_entry_t *file) {
+    int ret = write_behind_flush(file);
+    if (file->of_wb_error) {
+        file->of_wb_error = false;
+        ret = -1;
+    }
+    return ret;
+}
+
+int tfs_flush(int fhandle) {
+    uint64_t start = trace_now();
+    begin_update();
+    wrlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    int ret = file == NULL ? -1 : file_flush(file);
+    rw_unlock(get_entry_lock(fhandle));
+    return (int)traced("tfs_flush", start, end_update(ret));
+}
+
+/**
+ * Seal an open file, once its buffered writes are flushed.
+ *
+ * Input:
+ * - fhandle: file handle of the file to seal
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int file_seal(int fhandle) {
+    wrlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || file_flush(file) == -1) {
+        rw_unlock(get_entry_lock(fhandle));
+        return -1;
+    }
+
+    // Wait for the writes in progress, which see the seal once they lock it
+    wrlock(get_lock(file->of_inumber));
+    inode_t *inode = inode_get(file->of_inumber);
+    if (!inode_sealed(inode)) {
+        __atomic_store_n(&inode->i_sealed, true, __ATOMIC_RELEASE);
+        inode_dirty(file->of_inumber);
+    }
     rw_unlock(get_lock(file->of_inumber));
     rw_unlock(get_entry_lock(fhandle));
-    return (ssize_t)to_write;
+    return 0;
+}
+
+int tfs_seal(int fhandle) {
+    uint64_t start = trace_now();
+    begin_update();
+    return (int)traced("tfs_seal", start, end_update(file_seal(fhandle)));
+}
+
+/**
+ * Close file.
+ *
+ * Input:
+ *  - fhandle: file handle of the file to close
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_close(int fhandle) {
+    uint64_t start = trace_now();
+    begin_update();
+    // Lock the open file entry
+    wrlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        rw_unlock(get_entry_lock(fhandle));
+        return (int)traced("tfs_close", start, end_update(-1)); // invalid fd
+    }
+
+    // Write out buffered writes
+    int ret = file_flush(file);
+
+    // Remove the entry from the open file table
+    remove_from_open_file_table(fhandle);
+
+    // Unlock the open file entry
+    rw_unlock(get_entry_lock(fhandle));
+    return (int)traced("tfs_close", start, end_update(ret));
+}
+
+/**
+ * Flush an open file's buffered writes if they are older than the
+ * write-behind timeout (all of them if now is 0), for the flusher thread.
+ *
+ * Input:
+ * - file: open file entry
+ * - arg: pointer to the current time (uint64_t, in ms)
+ */
+static void write_behind_flush_old(open_file_entry_t *file, void *arg) {
+    uint64_t now = *(uint64_t *)arg;
+    if (file->of_wb_len > 0 &&
+        (now == 0 || now - file->of_wb_since >= write_behind_ms) &&
+        write_behind_flush(file) == -1) {
+        file->of_wb_error = true; // reported by tfs_flush or tfs_close
+    }
+}
+
+/**
+ * Flusher thread: flush buffered writes as they time out.
+ */
+static void *flusher_run(void *arg) {
+    (void)arg;
+    mutex_lock(&flusher_lock);
+    while (!flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        size_t period = write_behind_ms / 2 + 1; // ms
+        deadline.tv_sec += (time_t)(period / 1000);
+        deadline.tv_nsec += (long)(period % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&flusher_wakeup, &flusher_lock, &deadline);
+        if (flusher_stop) {
+            break;
+        }
+
+        mutex_unlock(&flusher_lock);
+        uint64_t now = now_ms();
+        begin_update();
+        open_file_table_foreach(write_behind_flush_old, &now);
+        end_update(0);
+        mutex_lock(&flusher_lock);
+    }
+    mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+/**
+ * Start the flusher thread, if it is not running yet.
+ */
+static void flusher_start(void) {
+    mutex_lock(&flusher_lock);
+    if (!flusher_running) {
+        flusher_stop = false;
+        flusher_running =
+            pthread_create(&flusher, NULL, flusher_run, NULL) == 0;
+    }
+    mutex_unlock(&flusher_lock);
+}
+
+/**
+ * Stop the flusher thread (if running), and flush every open file.
+ */
+static void flusher_shutdown(void) {
+    mutex_lock(&flusher_lock);
+    bool running = flusher_running;
+    flusher_stop = true;
+    flusher_running = false;
+    pthread_cond_signal(&flusher_wakeup);
+    mutex_unlock(&flusher_lock);
+    if (running) {
+        pthread_join(flusher, NULL);
+    }
+
+    uint64_t all = 0;
+    begin_update();
+    open_file_table_foreach(write_behind_flush_old, &all);
+    end_update(0);
+}
+
+
+/**
+ * Serve a read from the read-ahead of an open file, if it holds the requested
+ * bytes and the file's block has not changed since they were copied.
+ *
+ * Input:
+ * - file: open file entry
+ * - inode: inode of the file
+ * - buffer: buffer to store the data read
+ * - len: number of bytes to read, from the current offset
+ * Returns true if the read was served.
+ */
+static bool read_ahead_hit(open_file_entry_t const *file, inode_t const *inode,
+                           void *buffer, size_t len) {
+    if (file->of_ra_buffer == NULL || file->of_offset < file->of_ra_start ||
+        file->of_offset + len > file->of_ra_end ||
+        file->of_ra_block != inode->i_data_block ||
+        file->of_ra_version != data_block_version(inode->i_data_block)) {
+        return false;
+    }
+    memcpy(buffer, file->of_ra_buffer + file->of_offset, len);
+    return true;
+}
+
+/**
+ * Read ahead of a sequential reader: copy more of the file than requested,
+ * so that the next reads are served without accessing its block again.
+ * The window doubles while reads stay sequential, and is dropped otherwise.
+ *
+ * Input:
+ * - file: open file entry
+ * - block_number: the file's data block
+ * - block: contents of the block (pinned)
+ * - len: number of bytes being read, from the current offset
+ * - size: size of the file
+ */
+static void read_ahead(open_file_entry_t *file, int block_number,
+                       char const *block, size_t len, size_t size) {
+    if (file->of_offset != file->of_ra_next) {
+        file->of_ra_window = 0;
+        return;
+    }
+
+    size_t block_size = state_block_size();
+    size_t window = 2 * (file->of_ra_window > len ? file->of_ra_window : len);
+    file->of_ra_window = window < block_size ? window : block_size;
+    if (file->of_offset + len >= size) {
+        return; // nothing left to read ahead
+    }
+    if (file->of_ra_buffer == NULL) {
+        file->of_ra_buffer = malloc(block_size);
+        if (file->of_ra_buffer == NULL) {
+            return; // just read without it
+        }
+    }
+
+    size_t end = file->of_offset + file->of_ra_window;
+    file->of_ra_start = file->of_offset;
+    file->of_ra_end = end < size ? end : size;
+    file->of_ra_block = block_number;
+    file->of_ra_version = data_block_version(block_number);
+    memcpy(file->of_ra_buffer + file->of_ra_start, block + file->of_ra_start,
+           file->of_ra_end - file->of_ra_start);
+}
+
+/**
+ * Read from a sealed file, which never changes: without locking its inode,
+ * nor reading ahead.
+ * Must be called with the open file entry write-locked.
+ *
+ * Input:
+ * - file: open file entry of the file to read from
+ * - inode: the file's inode
+ * - buffer: buffer to store the data read
+ * - len: number of bytes to read
+ * Returns the number of bytes read if successful, -1 otherwise.
+ */
+static ssize_t sealed_read(open_file_entry_t *file, inode_t const *inode,
+                           void *buffer, size_t len) {
+    size_t to_read = inode->i_size - file->of_offset;
+    if (to_read > len) {
+        to_read = len;
+    }
+    if (to_read > 0) {
+        // Refuse to return corrupted contents
+        if (!data_block_verify(inode->i_data_block)) {
+            return -1;
+        }
+        memcpy(buffer,
+               (char const *)data_block_get(inode->i_data_block) +
+                   file->of_offset,
+               to_read);
+        data_block_put(inode->i_data_block);
+    }
+    file->of_offset += to_read;
+    file->of_ra_next = file->of_offset;
+    return (ssize_t)to_read;
+}
+
+/**
+ * Read from file.
+ *
+ * Sequential reads through a file handle read ahead (see read_ahead), and
+ * reads of sealed files do not lock them (see sealed_read).
+ *
+ * Input:
+ * - fhandle: file handle of the file to read from
+ * - buffer: buffer to store the data read
+ * - len: number of bytes to read
+ * Returns the number of bytes read if successful, -1 otherwise.
+ */
+static ssize_t file_read(int fhandle, void *buffer, size_t len) {
+    // Lock the open file entry (its offset and read-ahead change)
+    wrlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        rw_unlock(get_entry_lock(fhandle));
+        return -1;
+    }
+
+    // Read our own buffered writes
+    if (file->of_wb_len > 0) {
+        rw_unlock(get_entry_lock(fhandle));
+        if (tfs_flush(fhandle) == -1) {
+            return -1;
+        }
+        return file_read(fhandle, buffer, len);
+    }
+
+    // Get the inode number from the open file table entry
+    int inumber = file->of_inumber;
+    // From the open file table entry, we get the inode
+    inode_t const *inode = inode_get(inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    if (inode_sealed(inode)) {
+        ssize_t read = sealed_read(file, inode, buffer, len);
+        rw_unlock(get_entry_lock(fhandle));
+        return read;
+    }
+    // Lock the inode of the file to read from
+    rdlock(get_lock(inumber));
+
+    // Determine how many bytes to read
+    size_t size = inode_size(inode);
+    size_t to_read = size - file->of_offset;
+    if (to_read > len) {
+        to_read = len;
+    }
+    if (to_read > 0 && !read_ahead_hit(file, inode, buffer, to_read)) {
+        // Refuse to return corrupted contents
+        if (!data_block_verify(inode->i_data_block)) {
+            rw_unlock(get_lock(inumber));
+            rw_unlock(get_entry_lock(fhandle));
+            return -1;
+        }
+
+        // Wait for writes in progress (up to the end, for the read-ahead)
+        size_t start = file->of_offset;
+        inode_range_lock(inumber, start, size, false);
+        char const *block = data_block_get(inode->i_data_block);
+        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+
+        // Perform the actual read
+        memcpy(buffer, block + file->of_offset, to_read);
+        read_ahead(file, inode->i_data_block, block, to_read, size);
+        data_block_put(inode->i_data_block);
+        inode_range_unlock(inumber, start, size, false);
+    }
+    // The offset associated with the file handle is incremented accordingly
+    file->of_offset += to_read;
+    file->of_ra_next = file->of_offset;
+    // Unlock the inode and the open file entry
+    rw_unlock(get_lock(inumber));
+    rw_unlock(get_entry_lock(fhandle));
+    return (ssize_t)to_read;
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    uint64_t start = trace_now();
+    return traced("tfs_read", start,
+                  count_io(STAT_READ, STAT_READ_BYTES,
+                           file_read(fhandle, buffer, len)));
+}
+
+/**
+ * Write a buffer to a file descriptor of the OS, resuming partial writes.
+ *
+ * Input:
+ * - fd: file descriptor to write to
+ * - buffer: data to write
+ * - len: number of bytes to write
+ * Returns the number of bytes written (lower than len if a write failed
+ * midway), -1 if nothing could be written.
+ */
+static ssize_t write_external(int fd, char const *buffer, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t written = write(fd, buffer + done, len - done);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        done += (size_t)written;
+    }
+    return (ssize_t)done;
+}
+
+/**
+ * Send part of a file to a file descriptor of the OS.
+ *
+ * The output may block, so it is written with the file unlocked: straight
+ * from the block of sealed files, and from the block of other files once
+ * pinned by a reference of its own, as writers copy shared blocks before
+ * changing them. Compressed blocks only live in a cache, and are copied out
+ * instead (see tfs_sendfile in operations.h).
+ *
+ * Input:
+ * - fhandle: file handle of the file to send
+ * - out_fd: file descriptor to write to
+ * - offset: where to start in the file
+ * - len: maximum number of bytes to send
+ * Returns the number of bytes sent if successful, -1 otherwise.
+ */
+static ssize_t file_send(int fhandle, int out_fd, size_t offset,
+                         size_t len) {
+    begin_update(); // pinning a block updates its reference count
+    rdlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        rw_unlock(get_entry_lock(fhandle));
+        return end_update(-1);
+    }
+
+    // Send our own buffered writes too
+    if (file->of_wb_len > 0) {
+        rw_unlock(get_entry_lock(fhandle));
+        end_update(0);
+        if (tfs_flush(fhandle) == -1) {
+            return -1;
+        }
+        return file_send(fhandle, out_fd, offset, len);
+    }
+
+    int inumber = file->of_inumber;
+    inode_t const *inode = inode_get(inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_sendfile: inode of open file deleted");
+    // Sealed files never change, so they are sent without locking them
+    bool locked = !inode_sealed(inode);
+    if (locked) {
+        rdlock(get_lock(inumber));
+    }
+    rw_unlock(get_entry_lock(fhandle));
+
+    // Determine how many bytes to send
+    size_t size = inode_size(inode);
+    size_t to_send = offset < size ? size - offset : 0;
+    if (to_send > len) {
+        to_send = len;
+    }
+    int pinned = -1;
+    char const *from = NULL; // where the bytes are sent from
+    char *copy = NULL;
+    if (to_send > 0) {
+        // Refuse to send corrupted contents
+        if (!data_block_verify(inode->i_data_block)) {
+            if (locked) {
+                rw_unlock(get_lock(inumber));
+            }
+            return end_update(-1);
+        }
+        if (state_compressed()) {
+            copy = malloc(to_send);
+            if (copy == NULL) {
+                if (locked) {
+                    rw_unlock(get_lock(inumber));
+                }
+                return end_update(-1);
+            }
+        }
+
+        // Waiting for writes in progress
+        if (locked) {
+            inode_range_lock(inumber, offset, offset + to_send, false);
+        }
+        char const *block = data_block_get(inode->i_data_block);
+        ALWAYS_ASSERT(block != NULL, "tfs_sendfile: data block deleted");
+        from = block + offset;
+        if (copy != NULL) {
+            memcpy(copy, from, to_send);
+            data_block_put(inode->i_data_block);
+            from = copy;
+        } else if (locked) {
+            pinned = inode->i_data_block;
+            data_block_ref(pinned);
+        }
+        if (locked) {
+            inode_range_unlock(inumber, offset, offset + to_send, false);
+        }
+    }
+    if (locked) {
+        rw_unlock(get_lock(inumber));
+    }
+
+    ssize_t sent = end_update(0);
+    if (sent != -1 && from != NULL) {
+        sent = write_external(out_fd, from, to_send);
+    }
+    free(copy);
+    if (pinned != -1) {
+        begin_update();
+        data_block_free(pinned);
+        if (end_update(0) == -1) {
+            return -1;
+        }
+    }
+    return sent;
+}
+
+ssize_t tfs_sendfile(int fhandle, int out_fd, size_t offset, size_t len) {
+    uint64_t start = trace_now();
+    return traced("tfs_sendfile", start,
+                  count_io(STAT_READ, STAT_READ_BYTES,
+                           file_send(fhandle, out_fd, offset, len)));
+}
+
+ssize_t tfs_view(int fhandle, void const **contents) {
+    rdlock(get_entry_lock(fhandle));
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || state_compressed()) {
+        rw_unlock(get_entry_lock(fhandle));
+        return -1; // compressed blocks only exist in a cache
+    }
+    inode_t const *inode = inode_get(file->of_inumber);
+    rw_unlock(get_entry_lock(fhandle));
+    if (!inode_sealed(inode)) {
+        return -1;
+    }
+
+    *contents = NULL;
+    if (inode->i_size > 0) {
+        // Refuse to expose corrupted contents
+        if (!data_block_verify(inode->i_data_block)) {
+            return -1;
+        }
+        *contents = data_block_get(inode->i_data_block);
+        data_block_put(inode->i_data_block);
+    }
+    return (ssize_t)inode->i_size;
+}
+
+
+/**
+ * Delete a hardlink or symlink.
+ * Removes the link from the root directory.
+ *
+ * Input:
+ *   - target: absolute path name of the target link
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int unlink_file(char const *target) {
+    // Checks if the path name is valid
+    if (!valid_pathname(target)) {
+        return -1;
+    }
+
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    ALWAYS_ASSERT(root_dir_inode != NULL,
+                  "tfs_sym_link: root dir inode must exist");
+
+    // Check if the target file exists
+    int inumber = tfs_lookup(target, root_dir_inode);
+    if (inumber < 0) {
+        return -1;
+    }
+
+    // Lock the inode of the target file
+    wrlock(get_lock(inumber));
+    inode_t *inode = inode_get(inumber);
+    if (inode == NULL) {
+        rw_unlock(get_lock(inumber));
+        return -1;
+    }
+
+    // Sealed files are there for good
+    if (inode_sealed(inode)) {
+        rw_unlock(get_lock(inumber));
+        return -1;
+    }
+
+    // Remove entry from the root directory, if it still links to the file
+    // (it may have been renamed over since it was looked up)
+    int cleared = clear_dir_entry(root_dir_inode, target + 1, inumber);
+    if (cleared < 0) {
+        rw_unlock(get_lock(inumber));
+        int relinked = tfs_lookup(target, root_dir_inode);
+        if (relinked < 0 || relinked == inumber) {
+            return -1;
+        }
+        return unlink_file(target); // the file the name links to now
+    }
+
+    // If the target inode only has 1 hard link or
+    // is a symlink (has 1 hard link)
+    if (inode->hard_links == 1) {
+        inode_delete(inumber);
+    }
+
+    // If there is more than 1 hard link, simply unlink
+    else if (inode->hard_links > 1) {
+        inode->hard_links--;
+        inode_dirty(inumber);
+    }
+
+    rw_unlock(get_lock(inumber));
+    return cleared;
+}
+
+int tfs_unlink(char const *target) {
+    uint64_t start = trace_now();
+    stats_add(STAT_UNLINK, 1);
+    begin_update();
+    return (int)traced("tfs_unlink", start, end_update(unlink_file(target)));
+}
+
+/**
+ * Renames a file in the root directory.
+ *
+ * Input:
+ *   - old_name: absolute path name of the file
+ *   - new_name: absolute path name to move it to
+ *   - mode: rename flags
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int rename_file(char const *old_name, char const *new_name,
+                       tfs_rename_mode_t mode) {
+    // Checks if the path names are valid
+    if (!valid_pathname(old_name) || !valid_pathname(new_name)) {
+        return -1;
+    }
+
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    ALWAYS_ASSERT(root_dir_inode != NULL,
+                  "tfs_rename: root dir inode must exist");
+
+    // Lock the file to be replaced before its entry is removed, as in
+    // unlink_file, so that it cannot be unlinked meanwhile
+    bool replace = !(mode & TFS_RENAME_NOREPLACE);
+    int target = replace ? tfs_lookup(new_name, root_dir_inode) : -1;
+    if (target != -1) {
+        wrlock(get_lock(target));
+    }
+
+    // Sealed files cannot be replaced (see rename_dir_entry)
+    bool replaced;
+    int renamed = rename_dir_entry(root_dir_inode, old_name + 1, new_name + 1,
+                                   replace, target, &replaced);
+    if (renamed == 1) {
+        if (target != -1) {
+            rw_unlock(get_lock(target));
+        }
+        return rename_file(old_name, new_name, mode); // new_name was relinked
+    }
+    if (replaced) {
+        // The replaced file lost a link, as if it had been unlinked
+        inode_t *inode = inode_get(target);
+        if (inode->hard_links == 1) {
+            inode_delete(target);
+        } else if (inode->hard_links > 1) {
+            inode->hard_links--;
+            inode_dirty(target);
+        }
+    }
+    if (target != -1) {
+        rw_unlock(get_lock(target));
+    }
+    return renamed;
 }
 
+int tfs_rename(char const *old_name, char const *new_name,
+               tfs_rename_mode_t mode) {
+    uint64_t start = trace_now();
+    begin_update();
+    ssize_t ret = end_update(rename_file(old_name, new_name, mode));
+    return (int)traced("tfs_rename", start, ret);
+}
 
 /**
- * Read from file.
+ * Clone a file.
+ * The clone shares the data block of the source until one of them is
+ * written, so cloning does not copy any data.
  *
  * Input:
- * - fhandle: file handle of the file to read from
- * - buffer: buffer to store the data read
- * - len: number of bytes to read
- * Returns the number of bytes read if successful, -1 otherwise.
+ *   - source: absolute path name of the file to clone
+ *   - dest: absolute path name of the clone
+ * Returns 0 if successful, -1 otherwise.
  */
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    // Lock the open file entry
-    rdlock(get_entry_lock(fhandle));
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        rw_unlock(get_entry_lock(fhandle));
+static int clone_file(char const *source, char const *dest) {
+    // Checks if the path names are valid
+    if (!valid_pathname(source) || !valid_pathname(dest)) {
         return -1;
     }
 
-    // Get the inode number from the open file table entry
-    int inumber = file->of_inumber;
-    // Lock the inode of the file to read from
-    rdlock(get_lock(inumber));
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    ALWAYS_ASSERT(root_dir_inode != NULL,
+                  "tfs_clone: root dir inode must exist");
 
-    // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    // Check if the source exists and the destination does not
+    int source_inumber = tfs_lookup(source, root_dir_inode);
+    if (source_inumber < 0 || tfs_lookup(dest, root_dir_inode) != -1) {
+        return -1;
+    }
 
-    // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+    // Lock the source, so that it is not written while being cloned
+    rdlock(get_lock(source_inumber));
+    inode_t *source_inode = inode_get(source_inumber);
+    if (source_inode->state != TAKEN || source_inode->i_node_type != T_FILE) {
+        rw_unlock(get_lock(source_inumber));
+        return -1;
+    }
+    int inumber = inode_clone(source_inumber);
+    rw_unlock(get_lock(source_inumber));
+    if (inumber < 0) {
+        return -1; // no space in inode table
     }
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
 
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+    // Add entry in the root directory (the destination may have been created
+    // since it was looked up)
+    if (add_dir_entry(root_dir_inode, dest + 1, inumber) == -1) {
+        inode_delete(inumber);
+        return -1; // no space in directory, or dest exists
     }
-    // Unlock the inode and the open file entry
-    rw_unlock(get_lock(inumber));
-    rw_unlock(get_entry_lock(fhandle));
-    return (ssize_t)to_read;
+    return 0;
 }
 
+int tfs_clone(char const *source, char const *dest) {
+    uint64_t start = trace_now();
+    begin_update();
+    ssize_t ret = end_update(clone_file(source, dest));
+    return (int)traced("tfs_clone", start, ret);
+}
 
 /**
- * Delete a hardlink or symlink.
- * Removes the link from the root directory.
+ * Check whether an inumber refers to a snapshot directory.
+ */
+static bool valid_snapshot(int snapshot) {
+    return snapshot != ROOT_DIR_INUM && inode_is_taken(snapshot) &&
+           inode_get(snapshot)->i_node_type == T_DIRECTORY;
+}
+
+/**
+ * Delete a snapshot, dropping its references to the files' data blocks.
+ * Must be called with the snapshot lock held for writing.
  *
  * Input:
- *   - target: absolute path name of the target link
- * Returns 0 if successful, -1 otherwise.
+ *   - snapshot: snapshot identifier
  */
-int tfs_unlink(char const *target) {
-    // Checks if the path name is valid
-    if (!valid_pathname(target)) {
-        return -1;
+static void delete_snapshot(int snapshot) {
+    inode_t *snapshot_inode = inode_get(snapshot);
+
+    dir_entry_t entry;
+    for (size_t i = 0; dir_entry_get(snapshot_inode, i, &entry) == 0; i++) {
+        if (entry.d_inumber == -1) {
+            continue;
+        }
+
+        wrlock(get_lock(entry.d_inumber));
+        clear_dir_entry(snapshot_inode, entry.d_name, entry.d_inumber);
+        inode_t *inode = inode_get(entry.d_inumber);
+        if (inode->hard_links == 1) {
+            inode_delete(entry.d_inumber);
+        } else {
+            inode->hard_links--;
+            inode_dirty(entry.d_inumber);
+        }
+        rw_unlock(get_lock(entry.d_inumber));
+    }
+
+    inode_delete(snapshot);
+}
+
+/**
+ * Take a snapshot of the whole FS.
+ *
+ * Every file in the root directory gets a clone in the snapshot directory,
+ * under the same name. Hard links keep pointing to a single clone.
+ *
+ * Returns the snapshot identifier if successful, -1 otherwise.
+ */
+int tfs_snapshot(void) {
+    uint64_t start = trace_now();
+    // Wait for the operations in progress, and hold off new ones
+    wrlock(&snapshot_rw_lock);
+
+    int snapshot = inode_create(T_DIRECTORY);
+    if (snapshot < 0) {
+        rw_unlock(&snapshot_rw_lock);
+        return (int)traced("tfs_snapshot", start, -1);
     }
 
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_sym_link: root dir inode must exist");
+    inode_t *snapshot_inode = inode_get(snapshot);
+
+    // Clones made so far, to map hard links to the same clone
+    int *originals = NULL;
+    int *clones = NULL;
+    size_t clone_count = 0;
+
+    int ret = snapshot;
+    dir_entry_t entry;
+    for (size_t i = 0; dir_entry_get(root_dir_inode, i, &entry) == 0; i++) {
+        if (entry.d_inumber == -1) {
+            continue;
+        }
 
-    // Check if the target file exists
-    int inumber = tfs_lookup(target, root_dir_inode);
-    if (inumber < 0) {
+        int clone = -1;
+        for (size_t c = 0; c < clone_count; c++) {
+            if (originals[c] == entry.d_inumber) {
+                clone = clones[c];
+            }
+        }
+
+        if (clone == -1) {
+            rdlock(get_lock(entry.d_inumber));
+            clone = inode_clone(entry.d_inumber);
+            rw_unlock(get_lock(entry.d_inumber));
+            if (clone < 0) {
+                ret = -1;
+                break;
+            }
+
+            originals = realloc(originals, (clone_count + 1) * sizeof(int));
+            clones = realloc(clones, (clone_count + 1) * sizeof(int));
+            ALWAYS_ASSERT(originals != NULL && clones != NULL,
+                          "tfs_snapshot: out of memory");
+            originals[clone_count] = entry.d_inumber;
+            clones[clone_count] = clone;
+            clone_count++;
+        } else {
+            inode_get(clone)->hard_links++;
+            inode_dirty(clone);
+        }
+
+        if (add_dir_entry(snapshot_inode, entry.d_name, clone) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    free(originals);
+    free(clones);
+
+    if (ret == -1) {
+        delete_snapshot(snapshot);
+    }
+    return (int)traced("tfs_snapshot", start, end_update(ret));
+}
+
+int tfs_snapshot_open(int snapshot, char const *name, tfs_file_mode_t mode) {
+    uint64_t start = trace_now();
+    stats_add(STAT_OPEN, 1);
+    // Snapshots hold a fixed set of files
+    if (mode & TFS_O_CREAT) {
+        return (int)traced("tfs_snapshot_open", start, -1);
+    }
+
+    begin_update();
+    if (!valid_snapshot(snapshot)) {
+        return (int)traced("tfs_snapshot_open", start, end_update(-1));
+    }
+    ssize_t ret = end_update(open_in_dir(inode_get(snapshot), name, mode));
+    return (int)traced("tfs_snapshot_open", start, ret);
+}
+
+int tfs_snapshot_delete(int snapshot) {
+    wrlock(&snapshot_rw_lock);
+    if (!valid_snapshot(snapshot)) {
+        return (int)end_update(-1);
+    }
+    delete_snapshot(snapshot);
+    return (int)end_update(0);
+}
+
+int tfs_opendir(char const *path, tfs_dir_t *dir) {
+    if (path == NULL || dir == NULL || strcmp(path, "/") != 0) {
         return -1;
     }
+    *dir = (tfs_dir_t){.dir = ROOT_DIR_INUM, .next = 0};
+    return 0;
+}
 
-    // Lock the inode of the target file
-    wrlock(get_lock(inumber));
-    inode_t *inode = inode_get(inumber);
-    if (inode == NULL) {
-        rw_unlock(get_lock(inumber));
+int tfs_snapshot_opendir(int snapshot, tfs_dir_t *dir) {
+    if (dir == NULL) {
         return -1;
     }
 
-    // Remove entry from the root directory
-    int cleared = clear_dir_entry(root_dir_inode, target + 1);
-    if (cleared < 0) {
-        rw_unlock(get_lock(inumber));
+    begin_update();
+    if (!valid_snapshot(snapshot)) {
+        return (int)end_update(-1);
+    }
+    *dir = (tfs_dir_t){.dir = snapshot, .next = 0};
+    return (int)end_update(0);
+}
+
+// Directory entries copied out of a directory at a time by tfs_readdir
+#define READDIR_BATCH (64)
+
+ssize_t tfs_readdir(tfs_dir_t *dir, tfs_dirent_t *entries, size_t count) {
+    if (dir == NULL || (entries == NULL && count > 0)) {
         return -1;
     }
 
-    // If the target inode only has 1 hard link or
-    // is a symlink (has 1 hard link)
-    if (inode->hard_links == 1) {
-        inode_delete(inumber);
+    begin_update();
+    if (dir->dir != ROOT_DIR_INUM && !valid_snapshot(dir->dir)) {
+        return end_update(-1); // the snapshot was deleted
     }
+    inode_t const *dir_inode = inode_get(dir->dir);
+
+    size_t stored = 0;
+    while (stored < count) {
+        dir_entry_t batch[READDIR_BATCH];
+        size_t wanted = count - stored;
+        if (wanted > READDIR_BATCH) {
+            wanted = READDIR_BATCH;
+        }
+        ssize_t copied = dir_entries_get(dir_inode, &dir->next, batch, wanted);
+        if (copied <= 0) {
+            break; // end of the directory
+        }
 
-    // If there is more than 1 hard link, simply unlink
-    else if (inode->hard_links > 1) {
-        inode->hard_links--;
+        for (size_t i = 0; i < (size_t)copied; i++) {
+            int inumber = batch[i].d_inumber;
+            rdlock(get_lock(inumber));
+            if (!inode_is_taken(inumber)) {
+                rw_unlock(get_lock(inumber));
+                continue; // deleted since the entry was copied
+            }
+            inode_t const *inode = inode_get(inumber);
+            tfs_dirent_t *entry = &entries[stored++];
+            memcpy(entry->name, batch[i].d_name, MAX_FILE_NAME);
+            entry->inumber = inumber;
+            entry->generation = inode->i_generation;
+            entry->type = inode->i_node_type == T_DIRECTORY ? TFS_DT_DIRECTORY
+                          : inode->i_node_type == T_SYMLINK ? TFS_DT_SYMLINK
+                                                            : TFS_DT_FILE;
+            entry->size = inode_size(inode);
+            rw_unlock(get_lock(inumber));
+        }
     }
+    return end_update((ssize_t)stored);
+}
 
-    rw_unlock(get_lock(inumber));
-    return cleared;
+int64_t tfs_changes_since(uint64_t epoch, tfs_change_fn fn, void *arg) {
+    if (fn == NULL) {
+        return -1;
+    }
+
+    // No update may run while the stamps are scanned and the epoch advances
+    wrlock(&snapshot_rw_lock);
+    if (state_changes_since(epoch, fn, arg) == -1) {
+        return (int64_t)end_update(-1);
+    }
+    return (int64_t)end_update((ssize_t)state_epoch_advance());
+}
+
+int tfs_dedup_stats(tfs_dedup_stats_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+    state_dedup_stats(stats);
+    return 0;
+}
+
+int tfs_get_stats(tfs_stats_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+    uint64_t totals[STAT_COUNTERS];
+    stats_sum(totals);
+
+    *stats = (tfs_stats_t){0};
+    for (size_t op = 0; op < TFS_OP_COUNT; op++) {
+        stats->op_calls[op] = totals[STAT_OPEN + op];
+    }
+    stats->op_bytes[TFS_OP_READ] = totals[STAT_READ_BYTES];
+    stats->op_bytes[TFS_OP_WRITE] = totals[STAT_WRITE_BYTES];
+    state_usage(stats);
+    stats->inode_allocs = totals[STAT_INODE_ALLOCS];
+    stats->inode_alloc_scanned = totals[STAT_INODE_SCANNED];
+    stats->block_allocs = totals[STAT_BLOCK_ALLOCS];
+    stats->block_alloc_scanned = totals[STAT_BLOCK_SCANNED];
+    stats->lookup_scanned = totals[STAT_LOOKUP_SCANNED];
+    stats->delay_ns = totals[STAT_DELAY_NS];
+    return 0;
+}
+
+int tfs_trace_dump(char const *path) {
+    if (!trace_enabled()) {
+        return -1;
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    int ret = trace_dump(out);
+    if (fclose(out) != 0) {
+        ret = -1;
+    }
+    return ret;
 }
 
+/**
+ * Read the start of a file of the OS' file system, in a single pass.
+ *
+ * Input:
+ * - path: path name of the file
+ * - buffer: where to store its contents
+ * - len: maximum number of bytes to read
+ * Returns the number of bytes read, -1 if unsuccessful.
+ */
+static ssize_t read_external(char const *path, char *buffer, size_t len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t total = 0;
+    while (total < len) {
+        ssize_t r = read(fd, buffer + total, len - total);
+        if (r == -1) {
+            close(fd);
+            return -1;
+        }
+        if (r == 0) {
+            break;
+        }
+        total += (size_t)r;
+    }
+    close(fd);
+    return (ssize_t)total;
+}
 
 /**
  * Copy a file from an external FileSystem into TFS.
@@ -517,45 +2137,327 @@ int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
         return -1;
     }
 
-    // Open the source file
-    FILE *fd = fopen(source_path, "r");
-    if (fd == NULL) {
+    // Read the source file, up to a block
+    size_t block_size = state_block_size();
+    char *buffer = malloc(block_size);
+    if (buffer == NULL) {
+        return -1;
+    }
+    ssize_t size = read_external(source_path, buffer, block_size);
+    if (size == -1) {
+        free(buffer);
         return -1;
     }
 
-    // Create the destination file
-    int new = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC );
+    // Create the destination file, and write it in one go
+    int new = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
     if (new < 0) {
-        fclose(fd);
-        return -1;
-    }
-
-    char buffer[128];
-    memset(buffer,0,sizeof(buffer));
-    long unsigned int bytes_read;
-    long int bytes_written;
-    long int total_bytes = 0;
-
-    // Read from the source file and write to the destination file
-    while ((bytes_read = fread(buffer, sizeof(char), sizeof(buffer),fd)) > 0) {
-        bytes_written = tfs_write(new ,buffer, bytes_read);
-        memset(buffer, 0, sizeof(buffer));
-        total_bytes += bytes_written;
-        if (total_bytes >= get_block_size()) {
-            tfs_close(new);
-            fclose(fd);
-            return 0;
-        }
-        if (bytes_written != bytes_read) {
-            // If it is not able to write all the bytes, return an error
-            fclose(fd);
-            tfs_close(new);
-            return -1;
+        free(buffer);
+        return -1;
+    }
+    ssize_t written = tfs_write(new, buffer, (size_t)size);
+    free(buffer);
+    if (tfs_close(new) == -1 || written != size) {
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t tfs_copy_to_fd(char const *source_path, int fd) {
+    // Open the source file (following symlinks)
+    int fhandle = tfs_open(source_path, 0);
+    if (fhandle == -1) {
+        return -1;
+    }
+    // Until the end of the file, or an error (a short send is retried, to
+    // tell one from the other)
+    size_t total = 0;
+    ssize_t sent;
+    while ((sent = tfs_sendfile(fhandle, fd, total, SIZE_MAX)) > 0) {
+        total += (size_t)sent;
+    }
+    if (tfs_close(fhandle) == -1 || sent == -1) {
+        return -1;
+    }
+    return (ssize_t)total;
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    int fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t copied = tfs_copy_to_fd(source_path, fd);
+    if (close(fd) == -1 || copied == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Files found by tfs_import_tree, handed out to the import threads in
+ * batches.
+ */
+typedef struct {
+    char const *source_dir;
+    char **names; // TécnicoFS path names, relative to source_dir after the '/'
+    size_t count;
+    size_t capacity;
+    size_t next; // first file not yet handed out
+    size_t imported;
+    pthread_mutex_t lock;
+} import_t;
+
+/**
+ * Collect the regular files of a directory tree of the OS' file system.
+ *
+ * Input:
+ * - import: where to add the files
+ * - name: TécnicoFS path name of the directory ("" for the root of the tree)
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_walk(import_t *import, char const *name) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", import->source_dir, name) >=
+        (int)sizeof(path)) {
+        return -1;
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return name[0] == '\0' ? -1 : 0; // unreadable subtrees are skipped
+    }
+
+    int ret = 0;
+    struct dirent *entry;
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char sub_name[PATH_MAX];
+        char sub_path[PATH_MAX];
+        struct stat st;
+        if (snprintf(sub_name, sizeof(sub_name), "%s/%s", name,
+                     entry->d_name) >= (int)sizeof(sub_name) ||
+            snprintf(sub_path, sizeof(sub_path), "%s%s", import->source_dir,
+                     sub_name) >= (int)sizeof(sub_path) ||
+            lstat(sub_path, &st) == -1) {
+            continue; // skipped
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            ret = import_walk(import, sub_name);
+        } else if (S_ISREG(st.st_mode)) {
+            if (import->count == import->capacity) {
+                size_t capacity = import->capacity ? 2 * import->capacity : 64;
+                char **names =
+                    realloc(import->names, capacity * sizeof(char *));
+                if (names == NULL) {
+                    ret = -1;
+                    break;
+                }
+                import->names = names;
+                import->capacity = capacity;
+            }
+            import->names[import->count] = strdup(sub_name);
+            if (import->names[import->count] == NULL) {
+                ret = -1;
+                break;
+            }
+            import->count++;
         }
     }
+    closedir(dir);
+    return ret;
+}
 
-    fclose(fd);
-    tfs_close(new);
+/**
+ * Fill a newly created (empty) file with its contents.
+ *
+ * Input:
+ * - inumber: the file's inumber
+ * - data: contents of the file
+ * - size: size of the contents (up to a block)
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int file_fill(int inumber, void const *data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
 
+    wrlock(get_lock(inumber));
+    inode_t *inode = inode_get(inumber);
+    int bnum = data_block_alloc();
+    if (bnum == -1 || data_block_write(bnum, 0, data, size) == -1) {
+        if (bnum != -1) {
+            data_block_free(bnum);
+        }
+        rw_unlock(get_lock(inumber));
+        return -1; // no space
+    }
+    inode->i_data_block = bnum;
+    inode->i_size = size;
+    if (size == state_block_size()) {
+        inode->i_data_block = data_block_dedup(bnum);
+    }
+    inode_dirty(inumber);
+    inode_append_sync(inumber);
+    rw_unlock(get_lock(inumber));
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Import a batch of files: the new ones are created together, and only
+ * show up in the directory once they are filled.
+ *
+ * Input:
+ * - import: the files being imported
+ * - first: index of the first file of the batch
+ * - count: number of files in the batch (up to IMPORT_BATCH)
+ * - data: room for IMPORT_BATCH blocks
+ * Returns the number of files imported.
+ */
+static size_t import_batch(import_t *import, size_t first, size_t count,
+                           char *data) {
+    size_t block_size = state_block_size();
+    inode_t *root = inode_get(ROOT_DIR_INUM);
+    char const *names[IMPORT_BATCH];
+    size_t sizes[IMPORT_BATCH];
+    size_t fresh = 0;
+    size_t imported = 0;
+
+    for (size_t i = first; i < first + count; i++) {
+        char const *name = import->names[i];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", import->source_dir, name);
+        if (tfs_lookup(name, root) != -1) {
+            // Already exists, overwrite it
+            imported += tfs_copy_from_external_fs(path, name) == 0;
+            continue;
+        }
+        if (strlen(name) > MAX_FILE_NAME) {
+            continue; // name too long
+        }
+        ssize_t size = read_external(path, data + fresh * block_size,
+                                     block_size);
+        if (size != -1) {
+            names[fresh] = name + 1;
+            sizes[fresh] = (size_t)size;
+            fresh++;
+        }
+    }
+
+    begin_update();
+    int inumbers[IMPORT_BATCH];
+    size_t created = inode_create_files(inumbers, fresh);
+    size_t filled = 0;
+    for (size_t i = 0; i < created; i++) {
+        if (file_fill(inumbers[i], data + i * block_size, sizes[i]) == -1) {
+            wrlock(get_lock(inumbers[i]));
+            inode_delete(inumbers[i]);
+            rw_unlock(get_lock(inumbers[i]));
+            continue;
+        }
+        names[filled] = names[i];
+        inumbers[filled] = inumbers[i];
+        filled++;
+    }
+    size_t added = 0;
+    while (added < filled) {
+        ssize_t stored = add_dir_entries(root, names + added, inumbers + added,
+                                         filled - added);
+        added += stored > 0 ? (size_t)stored : 0;
+        if (added == filled || stored == -1 ||
+            find_in_dir(root, names[added]) == -1) {
+            break; // directory full
+        }
+        // The file was created meanwhile: leave it be, and add the others
+        wrlock(get_lock(inumbers[added]));
+        inode_delete(inumbers[added]);
+        rw_unlock(get_lock(inumbers[added]));
+        filled--;
+        memmove(&names[added], &names[added + 1],
+                (filled - added) * sizeof(names[0]));
+        memmove(&inumbers[added], &inumbers[added + 1],
+                (filled - added) * sizeof(inumbers[0]));
+    }
+    for (size_t i = added; i < filled; i++) {
+        wrlock(get_lock(inumbers[i]));
+        inode_delete(inumbers[i]); // directory full
+        rw_unlock(get_lock(inumbers[i]));
+    }
+    end_update(0);
+    return imported + added;
+}
+
+/**
+ * Import thread: import batches of files until none is left.
+ */
+static void *import_run(void *arg) {
+    import_t *import = arg;
+    char *data = malloc(IMPORT_BATCH * state_block_size());
+    if (data == NULL) {
+        return NULL;
+    }
+
+    for (;;) {
+        mutex_lock(&import->lock);
+        size_t first = import->next;
+        size_t count = import->count - first;
+        if (count > IMPORT_BATCH) {
+            count = IMPORT_BATCH;
+        }
+        import->next += count;
+        mutex_unlock(&import->lock);
+        if (count == 0) {
+            break;
+        }
+
+        size_t imported = import_batch(import, first, count, data);
+        mutex_lock(&import->lock);
+        import->imported += imported;
+        mutex_unlock(&import->lock);
+    }
+    free(data);
+    return NULL;
+}
+
+ssize_t tfs_import_tree(char const *source_dir, size_t threads) {
+    import_t import = {.source_dir = source_dir};
+    if (import_walk(&import, "") == -1) {
+        for (size_t i = 0; i < import.count; i++) {
+            free(import.names[i]);
+        }
+        free(import.names);
+        return -1;
+    }
+    pthread_mutex_init(&import.lock, NULL);
+
+    if (threads == 0) {
+        threads = IMPORT_THREADS;
+    }
+    size_t batches = (import.count + IMPORT_BATCH - 1) / IMPORT_BATCH;
+    if (threads > batches) {
+        threads = batches ? batches : 1;
+    }
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    size_t started = 0;
+    while (tids != NULL && started < threads &&
+           pthread_create(&tids[started], NULL, import_run, &import) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        import_run(&import); // no threads to spare, import on this one
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+
+    pthread_mutex_destroy(&import.lock);
+    for (size_t i = 0; i < import.count; i++) {
+        free(import.names[i]);
+    }
+    free(import.names);
+    return (ssize_t)import.imported;
+}
@@ -2,6 +2,8 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 /**
@@ -11,8 +13,40 @@ typedef struct {
     size_t max_inode_count;
     size_t max_block_count;
     size_t max_open_files_count;
+    // Let the tables above grow on demand (doubling when full) up to these
+    // sizes; 0 keeps them at their initial size. Inodes and blocks cannot
+    // grow in an image, nor blocks with compression
+    size_t inode_growth_limit;
+    size_t block_growth_limit;
+    size_t open_files_growth_limit;
 
     size_t block_size;
+
+    // Path of the image file backing the FS state (NULL keeps it in memory).
+    // An existing image is loaded as is; otherwise a new one is created.
+    char const *image_path;
+    // Journal metadata updates next to the image, so that they survive
+    // crashes (requires image_path)
+    bool journal;
+    // Keep a CRC32C of every data block, checked when files are read and
+    // when an image is loaded (an existing image keeps its own setting).
+    // Recovering from a crash recomputes them instead, as file data is not
+    // journaled.
+    bool checksums;
+    // Keep data blocks compressed, so that max_block_count blocks' worth of
+    // memory holds several times more data (cannot be used with image_path).
+    // Up to cache_block_count blocks are kept uncompressed while in use.
+    bool compression;
+    size_t cache_block_count;
+    // Share identical full file blocks between files (an existing image
+    // keeps its own setting)
+    bool dedup;
+    // Flush the writes buffered by TFS_O_BUFFERED handles once they are this
+    // old (in milliseconds); 0 only flushes them on demand
+    size_t write_behind_ms;
+    // Record the latest this many spans (TFS calls, lock waits and storage
+    // delays) of each thread, for tfs_trace_dump; 0 turns tracing off
+    size_t trace_events;
 } tfs_params;
 
 /**
@@ -32,6 +66,13 @@ int tfs_init(tfs_params const *params);
  */
 int tfs_destroy();
 
+/**
+ * Flush the FS state to its image file (see tfs_params.image_path).
+ * Does nothing if tecnicofs is not backed by an image.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_sync();
+
 /**
  * TécnicoFS file opening modes.
  */
@@ -39,6 +80,7 @@ typedef enum {
     TFS_O_CREAT = 0b001,
     TFS_O_TRUNC = 0b010,
     TFS_O_APPEND = 0b100,
+    TFS_O_BUFFERED = 0b1000,
 } tfs_file_mode_t;
 
 /**
@@ -50,6 +92,12 @@ typedef enum {
  *     - append mode (TFS_O_APPEND)
  *     - truncate file contents (TFS_O_TRUNC)
  *     - create file if it does not exist (TFS_O_CREAT)
+ *     - buffer writes (TFS_O_BUFFERED): small writes are gathered in the
+ *       handle, and only reach the file (and other handles) when a block's
+ *       worth is buffered, when the handle is read from, flushed (see
+ *       tfs_flush) or closed, or after tfs_params.write_behind_ms. Errors
+ *       writing the buffered data are reported by the next tfs_flush or
+ *       tfs_close.
  *
  * Returns file handle of the opened file if successful, -1 otherwise.
  */
@@ -78,15 +126,28 @@ int tfs_sym_link(char const *target, char const *link_name);
 int tfs_link(char const *target_file, char const *link_name);
 
 /**
- * Close a file.
+ * Close a file, flushing its buffered writes (see tfs_flush).
  *
  * Input:
  *   - fhandle: file handle (obtained from a previous call to tfs_open)
  *
- * Returns 0 if successful, -1 otherwise.
+ * Returns 0 if successful, -1 otherwise (the file is closed even if its
+ * buffered writes failed).
  */
 int tfs_close(int fhandle);
 
+/**
+ * Write the data buffered by a TFS_O_BUFFERED handle to its file.
+ * Does nothing for other handles.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful, -1 otherwise (including a failure to write data
+ * flushed earlier, in the background).
+ */
+int tfs_flush(int fhandle);
+
 /**
  * Write to an open file, starting at the current offset.
  *
@@ -109,10 +170,84 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  *   - len: length of the buffer
  *
  * Returns the number of bytes that were copied from the file to the buffer (can
- * be lower than 'len' if the file size was reached), or -1 in case of error.
+ * be lower than 'len' if the file size was reached), or -1 in case of error
+ * (including a data block that fails its checksum, see tfs_params.checksums).
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Send part of an open file to a file descriptor of the OS (e.g. a pipe or
+ * socket), in a single write when the descriptor takes it all. The data is
+ * written straight from the file's block, with the file unlocked, so that a
+ * descriptor that blocks holds off no writer of the file: the bytes sent are
+ * those of the file when the call started (writes meanwhile go to a copy of
+ * the block). Compressed blocks are copied out first.
+ * The offset of the file handle is neither used nor changed.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - out_fd: file descriptor to write to, at its current position
+ *   - offset: position in the file of the first byte to send
+ *   - len: maximum number of bytes to send
+ *
+ * Returns the number of bytes sent (can be lower than 'len' if the file size
+ * was reached, or if out_fd failed after taking part of the data), or -1 in
+ * case of error (including a data block that fails its checksum).
+ */
+ssize_t tfs_sendfile(int fhandle, int out_fd, size_t offset, size_t len);
+
+/**
+ * Write data read from a file descriptor of the OS (e.g. a pipe or socket) to
+ * an open file, starting at the current offset. Reads until 'len' bytes are
+ * received, the room left in the file's block is full or the input ends,
+ * without locking the file meanwhile, so a descriptor that blocks holds off
+ * no other user of the file. The data is read straight into a copy of the
+ * file's block, which takes the place of the block if nobody changed the
+ * file meanwhile; otherwise the data is written like any other, and what no
+ * longer fits (e.g. past appends made meanwhile) is read but dropped, and
+ * not counted.
+ *
+ * Input:
+ *   - fd: file descriptor to read from
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - len: maximum number of bytes to receive
+ *
+ * Returns the number of bytes written to the file (0 if the input ended
+ * right away), or -1 in case of error (including a descriptor that fails
+ * before any data is read).
+ */
+ssize_t tfs_recvfile(int fd, int fhandle, size_t len);
+
+/**
+ * Seal a file, making it read-only for good: once its buffered writes are
+ * flushed, it can no longer be written, truncated, unlinked or replaced (by
+ * tfs_rename), through any handle. Its clones and snapshots are not sealed.
+ * In exchange, reads of a sealed file do not lock it, and its contents can be
+ * accessed in place (see tfs_view).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful (including if the file was already sealed), -1
+ * otherwise.
+ */
+int tfs_seal(int fhandle);
+
+/**
+ * Access the contents of a sealed file in place, without copying them.
+ *
+ * Input:
+ *   - fhandle: file handle of a sealed file (see tfs_seal)
+ *   - contents: where to store a pointer to the file's contents, which stays
+ *     valid as long as the FS is initialized, or for a file of a snapshot,
+ *     until the snapshot is deleted (NULL for an empty file)
+ *
+ * Returns the size of the file if successful, or -1 in case of error
+ * (including a file that is not sealed, with tfs_params.compression, and a
+ * data block that fails its checksum).
+ */
+ssize_t tfs_view(int fhandle, void const **contents);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -124,6 +259,307 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_unlink(char const *target);
 
+/**
+ * TécnicoFS rename modes.
+ */
+typedef enum {
+    TFS_RENAME_NOREPLACE = 0b001,
+} tfs_rename_mode_t;
+
+/**
+ * Rename a file (or link), atomically: the file is found under exactly one of
+ * the two names at any time, and no data is copied.
+ * A file already named new_name is replaced, losing that link, as in unlink.
+ *
+ * Input:
+ *   - old_name: absolute path name of the file
+ *   - new_name: absolute path name to move it to
+ *   - mode: TFS_RENAME_NOREPLACE fails instead of replacing a file named
+ *     new_name, or 0
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_rename(char const *old_name, char const *new_name,
+               tfs_rename_mode_t mode);
+
+/**
+ * Clone a file, without copying its data: the clone shares the source's data
+ * block until one of the two files is written.
+ *
+ * Input:
+ *   - source: absolute path name of the file to clone
+ *   - dest: absolute path name of the clone, which must not exist
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_clone(char const *source, char const *dest);
+
+/**
+ * Take a point-in-time snapshot of the whole FS.
+ * The snapshot shares every data block with the live FS until either side
+ * writes to it.
+ *
+ * Returns a snapshot identifier if successful, -1 otherwise.
+ */
+int tfs_snapshot(void);
+
+/**
+ * Open a file as it was when a snapshot was taken.
+ *
+ * Input:
+ *   - snapshot: snapshot identifier (obtained from tfs_snapshot)
+ *   - name: absolute path name of the file at the time of the snapshot
+ *   - mode: as in tfs_open, except that TFS_O_CREAT is not allowed
+ *
+ * Returns file handle of the opened file if successful, -1 otherwise.
+ */
+int tfs_snapshot_open(int snapshot, char const *name, tfs_file_mode_t mode);
+
+/**
+ * Delete a snapshot, releasing the data blocks only it still uses.
+ *
+ * Input:
+ *   - snapshot: snapshot identifier (obtained from tfs_snapshot)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_snapshot_delete(int snapshot);
+
+/**
+ * Kinds of files reported by tfs_readdir.
+ */
+typedef enum {
+    TFS_DT_FILE,
+    TFS_DT_DIRECTORY,
+    TFS_DT_SYMLINK,
+} tfs_file_type_t;
+
+/**
+ * A directory entry reported by tfs_readdir.
+ */
+typedef struct {
+    char name[MAX_FILE_NAME];
+    int inumber;
+    uint64_t generation; // as in tfs_stat
+    tfs_file_type_t type;
+    size_t size; // bytes
+} tfs_dirent_t;
+
+/**
+ * Position in a directory listing, owned by the caller (nothing needs to be
+ * released when done with it).
+ */
+typedef struct {
+    int dir;     // inumber of the directory
+    size_t next; // next directory slot to look at
+} tfs_dir_t;
+
+/**
+ * Start listing a directory.
+ *
+ * Input:
+ *   - path: absolute path name of the directory (only "/" exists)
+ *   - dir: listing position to initialize
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_opendir(char const *path, tfs_dir_t *dir);
+
+/**
+ * Start listing the files of a snapshot.
+ *
+ * Input:
+ *   - snapshot: snapshot identifier (obtained from tfs_snapshot)
+ *   - dir: listing position to initialize
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_snapshot_opendir(int snapshot, tfs_dir_t *dir);
+
+/**
+ * List the next entries of a directory, in a single pass over it.
+ *
+ * Files created or deleted while a directory is listed may or may not be
+ * reported; any other file is reported exactly once.
+ * Entries identify their files as tfs_stat does, so that they can be
+ * reopened with tfs_open_inum; that fails if a file was deleted since (or
+ * while) it was listed, even if its inumber was reused.
+ *
+ * Input:
+ *   - dir: listing position (from tfs_opendir), advanced past the entries
+ *   - entries: where to store the entries
+ *   - count: maximum number of entries to store
+ *
+ * Returns the number of entries stored (0 at the end of the directory), -1
+ * otherwise (e.g. the snapshot being listed was deleted).
+ */
+ssize_t tfs_readdir(tfs_dir_t *dir, tfs_dirent_t *entries, size_t count);
+
+/**
+ * Identity and attributes of a file, reported by tfs_stat.
+ */
+typedef struct {
+    int inumber;
+    uint64_t generation; // changes when the inumber is reused
+    tfs_file_type_t type;
+    size_t size; // bytes
+    size_t links;
+    bool sealed;
+} tfs_stat_t;
+
+/**
+ * Look up a file, following symlinks, and report its identity (inumber and
+ * generation, which can be cached to reopen it with tfs_open_inum) and
+ * attributes.
+ *
+ * Input:
+ *   - name: absolute path name
+ *   - stat: where to store the file's identity and attributes
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat(char const *name, tfs_stat_t *stat);
+
+/**
+ * Open a file by its identity (see tfs_stat), without looking its name up.
+ * Fails if the file was deleted since, even if its inumber was reused.
+ *
+ * Input:
+ *   - inumber: inumber of the file
+ *   - generation: generation of the file's inode
+ *   - mode: as in tfs_open, except that TFS_O_CREAT is not allowed
+ *
+ * Returns the file handle if successful, -1 otherwise.
+ */
+int tfs_open_inum(int inumber, uint64_t generation, tfs_file_mode_t mode);
+
+/**
+ * Kinds of FS objects reported by tfs_changes_since.
+ */
+typedef enum {
+    TFS_CHANGE_INODE,
+    TFS_CHANGE_BLOCK,
+} tfs_change_kind_t;
+
+/**
+ * An inode or data block that changed since a given epoch.
+ */
+typedef struct {
+    tfs_change_kind_t kind;
+    int number;     // inumber or block number
+    uint64_t epoch; // epoch of the last change
+    bool freed;     // the inode or block is now free
+    // Current contents (the raw inode, or the whole block), NULL if freed.
+    // Only valid during the callback.
+    void const *data;
+    size_t size;
+} tfs_change_t;
+
+/**
+ * Function called by tfs_changes_since for each change.
+ * Returns 0 to go on, or any other value to stop.
+ */
+typedef int (*tfs_change_fn)(tfs_change_t const *change, void *arg);
+
+/**
+ * Report every inode and data block changed since a given epoch (e.g. to
+ * take an incremental backup), and start a new epoch.
+ *
+ * Input:
+ *   - epoch: epoch returned by a previous call, or 0 to report everything
+ *   - fn: function called for each changed inode or block
+ *   - arg: passed on to fn
+ *
+ * Returns the epoch to pass to the next call if successful (changes made
+ * after this call are reported by it), -1 otherwise.
+ */
+int64_t tfs_changes_since(uint64_t epoch, tfs_change_fn fn, void *arg);
+
+/**
+ * Block deduplication counters (see tfs_params.dedup).
+ */
+typedef struct {
+    size_t logical_blocks;  // block references held by files and snapshots
+    size_t physical_blocks; // blocks actually allocated
+    size_t indexed_blocks;  // blocks in the fingerprint index
+    size_t dedup_hits;      // blocks replaced by an identical indexed block
+} tfs_dedup_stats_t;
+
+/**
+ * Report how much block sharing (deduplication, clones and snapshots) saves:
+ * the dedup ratio is logical_blocks / physical_blocks.
+ *
+ * Input:
+ *   - stats: where to store the counters
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_dedup_stats(tfs_dedup_stats_t *stats);
+
+/**
+ * Operations counted by tfs_get_stats.
+ */
+typedef enum {
+    TFS_OP_OPEN,   // tfs_open, tfs_open_inum, tfs_snapshot_open
+    TFS_OP_READ,   // tfs_read, tfs_sendfile
+    TFS_OP_WRITE,  // tfs_write, tfs_recvfile
+    TFS_OP_LINK,   // tfs_link, tfs_sym_link
+    TFS_OP_UNLINK, // tfs_unlink
+    TFS_OP_LOOKUP, // name lookups, by these and other operations
+    TFS_OP_COUNT
+} tfs_op_t;
+
+/**
+ * Runtime statistics, counted since tfs_init.
+ */
+typedef struct {
+    uint64_t op_calls[TFS_OP_COUNT];
+    uint64_t op_bytes[TFS_OP_COUNT]; // bytes read or written (by TFS_OP_READ
+                                     // and TFS_OP_WRITE)
+    // Table occupancy: slots in use, and current size of each table
+    size_t inodes_used;
+    size_t inodes_total;
+    size_t blocks_used;
+    size_t blocks_total;
+    size_t open_files_used;
+    size_t open_files_total;
+    // Allocations, and table slots they scanned for a free one
+    uint64_t inode_allocs;
+    uint64_t inode_alloc_scanned;
+    uint64_t block_allocs;
+    uint64_t block_alloc_scanned;
+    // Directory entries scanned by lookups
+    uint64_t lookup_scanned;
+    // Time spent in the simulated storage access delays
+    uint64_t delay_ns;
+} tfs_stats_t;
+
+/**
+ * Report what the FS has been doing: how often each operation was called,
+ * how full the tables are, how far allocations and lookups scan, and how
+ * much time went into storage access delays.
+ * Each thread keeps its own counters, which are added up here.
+ *
+ * Input:
+ *   - stats: where to store the statistics
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_get_stats(tfs_stats_t *stats);
+
+/**
+ * Write the spans recorded by all threads (see tfs_params.trace_events) to a
+ * file of the OS' file system, as Chrome trace events (JSON), to be viewed in
+ * Perfetto or chrome://tracing.
+ * Threads may keep running meanwhile; the spans are kept.
+ *
+ * Input:
+ *   - path: path name of the trace file (from the OS' file system)
+ *
+ * Returns 0 if successful, -1 otherwise (e.g. tracing is off).
+ */
+int tfs_trace_dump(char const *path);
+
 /**
  * Copy the contents of a file that exists in the OS' file system tree
  * (outside TécnicoFS) to the TécnicoFS.
@@ -137,4 +573,49 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Copy the contents of a TécnicoFS file to a file of the OS' file system.
+ *
+ * Input:
+ *   - source_path: absolute path name of the source file (in TécnicoFS)
+ *   - dest_path: path name of the destination file (from the OS' file
+ *     system), which is created if needed, and overwritten if it already
+ *     exists.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
+
+/**
+ * Write the contents of a TécnicoFS file to an open file descriptor (e.g. a
+ * file, pipe or socket of the OS), at its current position, straight from
+ * the file's block and with the file unlocked (see tfs_sendfile).
+ *
+ * Input:
+ *   - source_path: absolute path name of the source file (in TécnicoFS)
+ *   - fd: file descriptor to write to
+ *
+ * Returns the number of bytes written (the size of the file) if successful,
+ * -1 otherwise.
+ */
+ssize_t tfs_copy_to_fd(char const *source_path, int fd);
+
+/**
+ * Import a directory tree of the OS' file system into TécnicoFS, copying its
+ * files with a pool of threads.
+ * TécnicoFS has a single directory, so each file is named after its path
+ * relative to source_dir (source_dir/a/b.txt becomes "/a/b.txt"). As in
+ * tfs_copy_from_external_fs, existing files are overwritten, and only the
+ * first block of larger files is copied.
+ *
+ * Input:
+ *   - source_dir: path name of the directory (from the OS' file system)
+ *   - threads: number of threads to copy with (0 for a default)
+ *
+ * Returns the number of files imported (files that cannot be, e.g. with
+ * relative paths longer than MAX_FILE_NAME - 1, or once TécnicoFS is full,
+ * are skipped), or -1 if source_dir could not be walked.
+ */
+ssize_t tfs_import_tree(char const *source_dir, size_t threads);
+
 #endif // OPERATIONS_H
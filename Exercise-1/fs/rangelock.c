@@ -0,0 +1,119 @@
+#include "rangelock.h"
+#include "betterassert.h"
+#include "state.h"
+#include <pthread.h>
+
+// Objects are spread over this many buckets, each holding up to
+// RANGES_PER_BUCKET locked ranges at a time
+#define RANGE_BUCKETS (64)
+#define RANGES_PER_BUCKET (32)
+
+/**
+ * A locked range.
+ */
+typedef struct {
+    bool used;
+    bool exclusive;
+    size_t key;
+    size_t start;
+    size_t end;
+} range_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t released; // a range of the bucket was unlocked
+    range_t ranges[RANGES_PER_BUCKET];
+} bucket_t;
+
+static bucket_t buckets[RANGE_BUCKETS];
+
+/**
+ * Initialize the range locks (none is locked).
+ */
+void rangelock_init(void) {
+    for (size_t i = 0; i < RANGE_BUCKETS; i++) {
+        pthread_mutex_init(&buckets[i].lock, NULL);
+        pthread_cond_init(&buckets[i].released, NULL);
+        for (size_t j = 0; j < RANGES_PER_BUCKET; j++) {
+            buckets[i].ranges[j].used = false;
+        }
+    }
+}
+
+/**
+ * Destroy the range locks.
+ */
+void rangelock_destroy(void) {
+    for (size_t i = 0; i < RANGE_BUCKETS; i++) {
+        pthread_mutex_destroy(&buckets[i].lock);
+        pthread_cond_destroy(&buckets[i].released);
+    }
+}
+
+/**
+ * Find where to lock a range in a bucket.
+ * Must be called with the bucket locked.
+ *
+ * Returns the free slot to use, or NULL if the range conflicts with a locked
+ * one (or the bucket is full).
+ */
+static range_t *range_slot(bucket_t *bucket, size_t key, size_t start,
+                           size_t end, bool exclusive) {
+    range_t *slot = NULL;
+    for (size_t i = 0; i < RANGES_PER_BUCKET; i++) {
+        range_t *range = &bucket->ranges[i];
+        if (!range->used) {
+            slot = slot ? slot : range;
+        } else if (range->key == key && range->start < end &&
+                   start < range->end && (exclusive || range->exclusive)) {
+            return NULL;
+        }
+    }
+    return slot;
+}
+
+/**
+ * Lock a range of an object, waiting for the conflicting ranges to be
+ * unlocked.
+ *
+ * Input:
+ *   - key: the object
+ *   - start: first byte of the range
+ *   - end: byte right after the range
+ *   - exclusive: whether other threads may lock overlapping ranges shared
+ */
+void range_lock(size_t key, size_t start, size_t end, bool exclusive) {
+    bucket_t *bucket = &buckets[key % RANGE_BUCKETS];
+    mutex_lock(&bucket->lock);
+    range_t *slot;
+    while ((slot = range_slot(bucket, key, start, end, exclusive)) == NULL) {
+        pthread_cond_wait(&bucket->released, &bucket->lock);
+    }
+    *slot = (range_t){
+        .used = true,
+        .exclusive = exclusive,
+        .key = key,
+        .start = start,
+        .end = end,
+    };
+    mutex_unlock(&bucket->lock);
+}
+
+/**
+ * Unlock a range locked with range_lock (with the same arguments).
+ */
+void range_unlock(size_t key, size_t start, size_t end, bool exclusive) {
+    bucket_t *bucket = &buckets[key % RANGE_BUCKETS];
+    mutex_lock(&bucket->lock);
+    for (size_t i = 0; i < RANGES_PER_BUCKET; i++) {
+        range_t *range = &bucket->ranges[i];
+        if (range->used && range->key == key && range->start == start &&
+            range->end == end && range->exclusive == exclusive) {
+            range->used = false;
+            pthread_cond_broadcast(&bucket->released);
+            mutex_unlock(&bucket->lock);
+            return;
+        }
+    }
+    ALWAYS_ASSERT(false, "range_unlock: range is not locked");
+}
@@ -0,0 +1,21 @@
+#ifndef RANGELOCK_H
+#define RANGELOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Byte-range locks.
+ *
+ * Ranges [start, end) of an object (identified by a key) are locked shared or
+ * exclusive; a lock waits for the overlapping ranges of the same object held
+ * exclusive (or held at all, to lock exclusive) to be unlocked.
+ */
+
+void rangelock_init(void);
+void rangelock_destroy(void);
+
+void range_lock(size_t key, size_t start, size_t end, bool exclusive);
+void range_unlock(size_t key, size_t start, size_t end, bool exclusive);
+
+#endif // RANGELOCK_H
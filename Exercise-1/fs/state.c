@@ -1,9 +1,25 @@
 #include "state.h"
+#include "arena.h"
 #include "betterassert.h"
+#include "blockstore.h"
+#include "crc32c.h"
+#include "journal.h"
+#include "lockprof.h"
+#include "rangelock.h"
+#include "stats.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 /*
@@ -13,6 +29,14 @@
  */
 static tfs_params fs_params;
 
+// Current sizes of the inode, data block and open file tables. Each table is
+// reserved at its capacity (fs_params.max_*_count) and grows towards it on
+// demand, so entries never move; a new size is only published once the
+// entries it adds are initialized, so readers need no lock to check indices.
+static atomic_size_t inode_count;
+static atomic_size_t block_count;
+static atomic_size_t open_file_count;
+
 // Read-Write locks for specific inodes
 static pthread_rwlock_t *inode_rw_lock;
 static pthread_rwlock_t *link_rw_lock;
@@ -23,10 +47,37 @@ static allocation_state_t *freeinode_ts;
 static pthread_rwlock_t inode_table_rw_lock;
 
 // Data blocks
-static char *fs_data; // # blocks * block size
+static char *fs_data; // # blocks * block size (compressed: see DATA_BYTES)
 static allocation_state_t *free_blocks;
+static uint32_t *block_refs; // # inodes sharing each block
+
+// Change tracking
+static uint64_t *fs_epoch;     // current epoch (a single counter)
+static uint64_t *inode_epochs; // epoch of the last change to each inode
+static uint64_t *block_epochs; // epoch of the last change to each block
+
+// Block checksums (only kept up to date if fs_params.checksums is set)
+static uint32_t *block_crcs;    // CRC32C of each data block (not journaled)
+static uint32_t zero_block_crc; // CRC32C of a block full of zeros
+
+// Deduplication (only if fs_params.dedup is set): full file blocks are
+// indexed by fingerprint, and the index holds a reference to each of them,
+// so that they are copied before being written
+static uint8_t *block_indexed; // the block is in the index
+static int *dedup_buckets;     // first indexed block of each bucket, or -1
+static int *dedup_next;        // next indexed block in the same bucket
+static uint32_t *dedup_fingerprints;
+static size_t dedup_bucket_count; // a power of 2
+static size_t dedup_hits;         // blocks replaced by an indexed twin
+static size_t unreleased_blocks; // freed since their memory was last released
 static pthread_rwlock_t data_block_table_rw_lock;
 
+// Image file the persistent state is mapped from (if any)
+static int image_fd = -1;
+static void *image_map;
+static size_t image_map_size;
+static bool recovered; // the journal held records when the image was loaded
+
 /*
  * Volatile FS state
  */
@@ -36,13 +87,53 @@ static pthread_rwlock_t open_file_table_rw_lock;
 static pthread_rwlock_t dir_entries_rw_lock;
 static pthread_rwlock_t *open_file_table_entry_lock;
 
+// Atomic appends (see inode_append_reserve): end of the room reserved in each
+// file, and locks ordering the sizes published by appenders (shared by the
+// inodes with the same number modulo APPEND_LOCKS)
+#define APPEND_LOCKS (64)
+static atomic_size_t *append_tails;
+
+// Version of the contents of each block, bumped on every change (kept in
+// memory only, to validate the read-ahead of open files)
+static uint64_t *block_versions;
+static pthread_mutex_t append_locks[APPEND_LOCKS];
+static pthread_cond_t append_published[APPEND_LOCKS];
+
 // Convenience macros
-#define INODE_TABLE_SIZE (fs_params.max_inode_count)
-#define DATA_BLOCKS (fs_params.max_block_count)
-#define MAX_OPEN_FILES (fs_params.max_open_files_count)
+#define INODE_TABLE_SIZE                                                       \
+    (atomic_load_explicit(&inode_count, memory_order_acquire))
+#define DATA_BLOCKS (atomic_load_explicit(&block_count, memory_order_acquire))
+// Sizes the tables are reserved at (see inode_count)
+#define INODE_CAPACITY (fs_params.max_inode_count)
+#define BLOCK_CAPACITY (fs_params.max_block_count)
+#define OPEN_FILES_CAPACITY (fs_params.max_open_files_count)
+// With compression, DATA_BLOCKS counts logical blocks, which share an arena
+// COMPRESSION_RATIO times smaller than their total size
+#define COMPRESSION_RATIO (4)
+#define DATA_BYTES                                                             \
+    (BLOCK_CAPACITY / (fs_params.compression ? COMPRESSION_RATIO : 1) *        \
+     BLOCK_SIZE)
+// Freed blocks have their memory given back to the OS in batches of this size
+#define RELEASE_BATCH_BLOCKS (64)
+#define MAX_OPEN_FILES                                                         \
+    (atomic_load_explicit(&open_file_count, memory_order_acquire))
 #define BLOCK_SIZE (fs_params.block_size)
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
 
+/**
+ * Next size of a full table: twice its size, within its capacity.
+ *
+ * Input:
+ *   - count: current size of the table
+ *   - capacity: size the table is reserved at
+ *
+ * Returns the new size (count itself if the table cannot grow).
+ */
+static size_t table_grow_size(size_t count, size_t capacity) {
+    size_t grown = count > 0 ? count * 2 : 1;
+    return grown < capacity ? grown : capacity;
+}
+
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
 }
@@ -55,29 +146,341 @@ static inline bool valid_file_handle(int file_handle) {
     return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
 }
 
-void rdlock(pthread_rwlock_t *lock) {
+// The names are parenthesized so that the profiling macros of state.h leave
+// them alone
+
+// When tracing, a lock that cannot be taken right away records how long it
+// was waited for
+void(rdlock)(pthread_rwlock_t *lock) {
+    if (trace_enabled() && pthread_rwlock_tryrdlock(lock) == 0) {
+        return;
+    }
+    uint64_t start = trace_now();
     if (pthread_rwlock_rdlock(lock) != 0) {
         perror("pthread_rwlock_rdlock");
         exit(1);
     }
+    trace_span("rdlock wait", "lock", start, trace_now());
 }
 
-void wrlock(pthread_rwlock_t *lock) {
+void(wrlock)(pthread_rwlock_t *lock) {
+    if (trace_enabled() && pthread_rwlock_trywrlock(lock) == 0) {
+        return;
+    }
+    uint64_t start = trace_now();
     if (pthread_rwlock_wrlock(lock) != 0) {
         perror("pthread_rwlock_wrlock");
         exit(1);
     }
+    trace_span("wrlock wait", "lock", start, trace_now());
 }
 
 void rw_unlock(pthread_rwlock_t *lock) {
+#ifdef TFS_LOCK_PROFILE
+    lockprof_released(lock);
+#endif
     if (pthread_rwlock_unlock(lock) != 0) {
         perror("pthread_rwlock_unlock");
         exit(1);
     }
 }
 
+void mutex_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock) != 0) {
+        perror("pthread_mutex_lock");
+        exit(1);
+    }
+}
+
+void mutex_unlock(pthread_mutex_t *lock) {
+    if (pthread_mutex_unlock(lock) != 0) {
+        perror("pthread_mutex_unlock");
+        exit(1);
+    }
+}
+
+#ifdef TFS_LOCK_PROFILE
+/**
+ * Whether a lock is one of an array of locks.
+ */
+static bool lock_in(pthread_rwlock_t const *lock,
+                    pthread_rwlock_t const *array, size_t count) {
+    uintptr_t address = (uintptr_t)lock;
+    return array != NULL && address >= (uintptr_t)array &&
+           address < (uintptr_t)(array + count);
+}
+
+/**
+ * Find the class of a lock, for the lock profiler.
+ */
+static lock_class_t lock_class(pthread_rwlock_t const *lock) {
+    if (lock == &inode_table_rw_lock) {
+        return LOCK_INODE_TABLE;
+    } else if (lock == &data_block_table_rw_lock) {
+        return LOCK_DATA_BLOCK_TABLE;
+    } else if (lock == &dir_entries_rw_lock) {
+        return LOCK_DIR_ENTRIES;
+    } else if (lock == &open_file_table_rw_lock) {
+        return LOCK_OPEN_FILE_TABLE;
+    } else if (lock_in(lock, inode_rw_lock, INODE_CAPACITY)) {
+        return LOCK_INODE;
+    } else if (lock_in(lock, link_rw_lock, INODE_CAPACITY)) {
+        return LOCK_LINK;
+    } else if (lock_in(lock, open_file_table_entry_lock,
+                       OPEN_FILES_CAPACITY)) {
+        return LOCK_OPEN_FILE_ENTRY;
+    }
+    return LOCK_OTHER;
+}
+
+void rdlock_at(pthread_rwlock_t *lock, char const *func, int line) {
+    uint64_t start = lockprof_now();
+    (rdlock)(lock);
+    lockprof_acquired(lock, lock_class(lock), false, func, line, start);
+}
+
+void wrlock_at(pthread_rwlock_t *lock, char const *func, int line) {
+    uint64_t start = lockprof_now();
+    (wrlock)(lock);
+    lockprof_acquired(lock, lock_class(lock), true, func, line, start);
+}
+#endif
+
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+bool state_compressed(void) { return fs_params.compression; }
+
+#define IMAGE_MAGIC "TFSIMAGE"
+#define IMAGE_VERSION (7)
+
+/**
+ * Image file header, stored at the start of the image.
+ * The persistent arrays follow it, each one starting at a page boundary.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t max_inode_count;
+    uint64_t max_block_count;
+    uint64_t block_size;
+    uint64_t checksums;
+    uint64_t dedup;
+} image_header_t;
+
+/**
+ * A persistent array, either malloc'ed or mapped from the image file.
+ */
+typedef struct {
+    void **ptr;
+    size_t size;
+} state_section_t;
+
+/**
+ * Persistent arrays, in image order.
+ */
+typedef enum {
+    SECTION_INODE_TABLE,
+    SECTION_FREE_INODES,
+    SECTION_FREE_BLOCKS,
+    SECTION_BLOCK_REFS,
+    SECTION_EPOCH,
+    SECTION_INODE_EPOCHS,
+    SECTION_BLOCK_EPOCHS,
+    SECTION_BLOCK_CRCS,
+    SECTION_BLOCK_INDEXED,
+    SECTION_FS_DATA,
+    SECTION_COUNT
+} section_id_t;
+
+/**
+ * List the persistent arrays of the FS, indexed by section_id_t.
+ *
+ * Input:
+ *   - sections: array of SECTION_COUNT entries to fill
+ *
+ * Returns the number of sections.
+ */
+static size_t persistent_sections(state_section_t *sections) {
+    sections[SECTION_INODE_TABLE] = (state_section_t){
+        (void **)&inode_table, INODE_CAPACITY * sizeof(inode_t)};
+    sections[SECTION_FREE_INODES] = (state_section_t){
+        (void **)&freeinode_ts, INODE_CAPACITY * sizeof(allocation_state_t)};
+    sections[SECTION_FREE_BLOCKS] = (state_section_t){
+        (void **)&free_blocks, BLOCK_CAPACITY * sizeof(allocation_state_t)};
+    sections[SECTION_BLOCK_REFS] = (state_section_t){
+        (void **)&block_refs, BLOCK_CAPACITY * sizeof(uint32_t)};
+    sections[SECTION_EPOCH] =
+        (state_section_t){(void **)&fs_epoch, sizeof(uint64_t)};
+    sections[SECTION_INODE_EPOCHS] = (state_section_t){
+        (void **)&inode_epochs, INODE_CAPACITY * sizeof(uint64_t)};
+    sections[SECTION_BLOCK_EPOCHS] = (state_section_t){
+        (void **)&block_epochs, BLOCK_CAPACITY * sizeof(uint64_t)};
+    sections[SECTION_BLOCK_CRCS] = (state_section_t){
+        (void **)&block_crcs, BLOCK_CAPACITY * sizeof(uint32_t)};
+    sections[SECTION_BLOCK_INDEXED] = (state_section_t){
+        (void **)&block_indexed, BLOCK_CAPACITY * sizeof(uint8_t)};
+    sections[SECTION_FS_DATA] =
+        (state_section_t){(void **)&fs_data, DATA_BYTES};
+    return SECTION_COUNT;
+}
+
+static size_t page_align(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+/**
+ * Map the persistent FS state from an image file, creating it if needed.
+ *
+ * If the image already exists, its geometry (inode count, block count and
+ * block size) and whether it keeps block checksums or deduplicates blocks
+ * override fs_params.
+ *
+ * Input:
+ *   - path: path of the image file (in the OS' file system)
+ *
+ * Returns 1 if an existing image was loaded, 0 if a new one was created, -1
+ * otherwise.
+ *
+ * Possible errors:
+ *   - open/mmap failure.
+ *   - Existing file is not a TFS image or has an unsupported version.
+ */
+static int image_open(char const *path) {
+    image_fd = open(path, O_RDWR | O_CREAT, 0640);
+    if (image_fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(image_fd, &st) == -1) {
+        return -1;
+    }
+
+    bool existing = st.st_size > 0;
+    image_header_t header;
+    if (existing) {
+        if (pread(image_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != IMAGE_VERSION) {
+            return -1; // not an image, or made by another version
+        }
+        fs_params.max_inode_count = header.max_inode_count;
+        fs_params.max_block_count = header.max_block_count;
+        fs_params.block_size = header.block_size;
+        fs_params.checksums = header.checksums != 0;
+        fs_params.dedup = header.dedup != 0;
+    }
+
+    state_section_t sections[SECTION_COUNT];
+    size_t count = persistent_sections(sections);
+
+    image_map_size = page_align(sizeof(image_header_t));
+    for (size_t i = 0; i < count; i++) {
+        image_map_size += page_align(sections[i].size);
+    }
+
+    if (existing && (header.section_count != count ||
+                     (size_t)st.st_size != image_map_size)) {
+        return -1; // truncated or inconsistent image
+    }
+    if (!existing && ftruncate(image_fd, (off_t)image_map_size) == -1) {
+        return -1;
+    }
+
+    image_map = mmap(NULL, image_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     image_fd, 0);
+    if (image_map == MAP_FAILED) {
+        image_map = NULL;
+        return -1;
+    }
+
+    char *cursor = (char *)image_map + page_align(sizeof(image_header_t));
+    for (size_t i = 0; i < count; i++) {
+        *sections[i].ptr = cursor;
+        cursor += page_align(sections[i].size);
+    }
+
+    if (!existing) {
+        memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+        header.version = IMAGE_VERSION;
+        header.section_count = (uint32_t)count;
+        header.max_inode_count = INODE_CAPACITY;
+        header.max_block_count = BLOCK_CAPACITY;
+        header.block_size = BLOCK_SIZE;
+        header.checksums = fs_params.checksums;
+        header.dedup = fs_params.dedup;
+        memcpy(image_map, &header, sizeof(header));
+    }
+
+    return existing ? 1 : 0;
+}
+
+/**
+ * Unmap the image file, flushing it first.
+ */
+static void image_close(void) {
+    if (image_map != NULL) {
+        msync(image_map, image_map_size, MS_SYNC);
+        munmap(image_map, image_map_size);
+    }
+    if (image_fd != -1) {
+        close(image_fd);
+    }
+    image_map = NULL;
+    image_map_size = 0;
+    image_fd = -1;
+}
+
+/**
+ * Open the metadata journal of an image and redo the records it holds.
+ *
+ * Input:
+ *   - image_path: path of the image file; the journal lives next to it
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_start(char const *image_path) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s.journal", image_path) >=
+        sizeof(path)) {
+        return -1;
+    }
+    if (journal_open(path, state_sync) == -1) {
+        return -1;
+    }
+
+    state_section_t sections[SECTION_COUNT];
+    void *bases[SECTION_COUNT];
+    size_t sizes[SECTION_COUNT];
+    persistent_sections(sections);
+    for (size_t i = 0; i < SECTION_COUNT; i++) {
+        bases[i] = *sections[i].ptr;
+        sizes[i] = sections[i].size;
+    }
+    int replayed = journal_replay(bases, sizes, SECTION_COUNT);
+    if (replayed == -1) {
+        return -1;
+    }
+    recovered = replayed > 0;
+
+    // Fold the replayed records into the image
+    return journal_checkpoint();
+}
+
+/**
+ * Flush the dirty pages of the image file to secondary memory.
+ *
+ * Returns 0 if successful (or if there is no image), -1 otherwise.
+ */
+int state_sync(void) {
+    if (image_map == NULL) {
+        return 0;
+    }
+    return msync(image_map, image_map_size, MS_SYNC);
+}
+
 /**
  * Do nothing, while preventing the compiler from performing any optimizations.
  *
@@ -104,9 +507,115 @@ static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
  * latencies as if such data structures were really stored in secondary memory.
  */
 static void insert_delay(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     for (int i = 0; i < DELAY; i++) {
         touch_all_memory();
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t start_ns =
+        (uint64_t)start.tv_sec * 1000000000 + (uint64_t)start.tv_nsec;
+    uint64_t end_ns = (uint64_t)end.tv_sec * 1000000000 + (uint64_t)end.tv_nsec;
+    stats_add(STAT_DELAY_NS, end_ns - start_ns);
+    if (trace_enabled()) {
+        trace_span("insert_delay", "storage", start_ns, end_ns);
+    }
+}
+
+static uint32_t block_crc(size_t block_number) {
+    uint32_t crc = crc32c(0, data_block_get((int)block_number), BLOCK_SIZE);
+    data_block_put((int)block_number);
+    return crc;
+}
+
+/**
+ * Recompute the checksum of every allocated block of a recovered image,
+ * whose data blocks (which are not journaled) may not match the checksums
+ * the image holds.
+ */
+static void rebuild_all_crcs(void) {
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        if (free_blocks[i] == TAKEN) {
+            block_crcs[i] = block_crc(i);
+        }
+    }
+}
+
+/**
+ * Check every allocated block of a loaded image against its checksum,
+ * reporting the corrupted ones (reading them fails later on).
+ *
+ * Returns the number of corrupted blocks.
+ */
+static size_t verify_all_blocks(void) {
+    size_t corrupted = 0;
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        if (free_blocks[i] == TAKEN && block_crc(i) != block_crcs[i]) {
+            fprintf(stderr, "tfs: data block %zu failed its checksum\n", i);
+            corrupted++;
+        }
+    }
+    return corrupted;
+}
+
+static uint32_t block_fingerprint(int block_number) {
+    uint32_t fingerprint = crc32c(0, data_block_get(block_number), BLOCK_SIZE);
+    data_block_put(block_number);
+    return fingerprint;
+}
+
+/**
+ * Add a block to the fingerprint index.
+ * Must be called with the data block table locked.
+ */
+static void dedup_insert(int block_number, uint32_t fingerprint) {
+    size_t bucket = fingerprint & (dedup_bucket_count - 1);
+    dedup_fingerprints[block_number] = fingerprint;
+    dedup_next[block_number] = dedup_buckets[bucket];
+    dedup_buckets[bucket] = block_number;
+}
+
+/**
+ * Remove a block from the fingerprint index.
+ * Must be called with the data block table locked.
+ */
+static void dedup_remove(int block_number) {
+    size_t bucket = dedup_fingerprints[block_number] & (dedup_bucket_count - 1);
+    int *link = &dedup_buckets[bucket];
+    while (*link != block_number) {
+        ALWAYS_ASSERT(*link != -1, "dedup_remove: block is not indexed");
+        link = &dedup_next[*link];
+    }
+    *link = dedup_next[block_number];
+}
+
+/**
+ * Allocate the fingerprint index, and fill it with the blocks flagged as
+ * indexed (e.g. in a loaded image).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int dedup_index_init(void) {
+    dedup_bucket_count = 1;
+    while (dedup_bucket_count < BLOCK_CAPACITY) {
+        dedup_bucket_count *= 2;
+    }
+    dedup_buckets = malloc(dedup_bucket_count * sizeof(int));
+    dedup_next = arena_alloc(BLOCK_CAPACITY * sizeof(int));
+    dedup_fingerprints = arena_alloc(BLOCK_CAPACITY * sizeof(uint32_t));
+    if (!dedup_buckets || !dedup_next || !dedup_fingerprints) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < dedup_bucket_count; i++) {
+        dedup_buckets[i] = -1;
+    }
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        if (block_indexed[i]) {
+            dedup_insert((int)i, block_fingerprint((int)i));
+        }
+    }
+    return 0;
 }
 
 /**
@@ -115,55 +624,159 @@ static void insert_delay(void) {
  * Input:
  *   - params: TécnicoFS parameters
  *
- * Returns 0 if successful, -1 otherwise.
+ * If params.image_path is set, the persistent state is mapped from that image
+ * file instead of being allocated in primary memory.
+ * If params.compression is set, data blocks are kept compressed and the FS
+ * holds COMPRESSION_RATIO times as many of them (not with an image).
+ *
+ * Returns 1 if the state was loaded from an existing image, 0 if a new FS was
+ * created, -1 otherwise.
  *
  * Possible errors:
  *   - TFS already initialized.
  *   - malloc failure when allocating TFS structures.
+ *   - Image file could not be opened, mapped or is invalid.
+ *   - Compression requested together with an image.
  */
 int state_init(tfs_params params) {
-    fs_params = params;
-
     if (inode_table != NULL) {
         return -1; // already initialized
     }
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
+    if (params.compression && params.image_path != NULL) {
+        return -1; // compressed blocks are not kept in images
+    }
+
+    fs_params = params;
+    stats_reset();
+    trace_init(params.trace_events);
+    if (params.compression) {
+        fs_params.max_block_count *= COMPRESSION_RATIO;
+    }
+
+    // Tables start at the requested sizes, and are reserved at their growth
+    // limits. Inodes and blocks only grow in memory (images have a fixed
+    // layout), and blocks not at all with compression (the arena is fixed)
+    size_t inodes = fs_params.max_inode_count;
+    size_t blocks = fs_params.max_block_count;
+    size_t files = fs_params.max_open_files_count;
+    if (params.open_files_growth_limit > files) {
+        fs_params.max_open_files_count = params.open_files_growth_limit;
+    }
+    if (params.image_path == NULL && params.inode_growth_limit > inodes) {
+        fs_params.max_inode_count = params.inode_growth_limit;
+    }
+    if (params.image_path == NULL && !params.compression &&
+        params.block_growth_limit > blocks) {
+        fs_params.max_block_count = params.block_growth_limit;
+    }
+
+    int restored = 0;
+    recovered = false;
+    if (params.image_path != NULL) {
+        restored = image_open(params.image_path);
+        if (restored == -1 ||
+            (params.journal && journal_start(params.image_path) == -1)) {
+            journal_close();
+            image_close();
+            return -1;
+        }
+    } else {
+        state_section_t sections[SECTION_COUNT];
+        size_t count = persistent_sections(sections);
+        for (size_t i = 0; i < count; i++) {
+            *sections[i].ptr = arena_alloc(sections[i].size);
+        }
+    }
+    if (params.image_path != NULL) {
+        inodes = fs_params.max_inode_count; // possibly set by the image
+        blocks = fs_params.max_block_count;
+    }
+    atomic_store(&inode_count, inodes);
+    atomic_store(&block_count, blocks);
+    atomic_store(&open_file_count, files);
+
+    // Reserved at full capacity, memory is only taken as the tables grow
+    open_file_table =
+        arena_alloc(OPEN_FILES_CAPACITY * sizeof(open_file_entry_t));
     free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
-    inode_rw_lock = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
-    link_rw_lock = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
-    open_file_table_entry_lock = malloc(MAX_OPEN_FILES * sizeof(pthread_rwlock_t));
+        arena_alloc(OPEN_FILES_CAPACITY * sizeof(allocation_state_t));
+    inode_rw_lock = arena_alloc(INODE_CAPACITY * sizeof(pthread_rwlock_t));
+    link_rw_lock = arena_alloc(INODE_CAPACITY * sizeof(pthread_rwlock_t));
+    append_tails = arena_alloc(INODE_CAPACITY * sizeof(atomic_size_t));
+    block_versions = arena_alloc(BLOCK_CAPACITY * sizeof(uint64_t));
+    open_file_table_entry_lock =
+        arena_alloc(OPEN_FILES_CAPACITY * sizeof(pthread_rwlock_t));
 
     pthread_rwlock_init(&inode_table_rw_lock, NULL);
     pthread_rwlock_init(&data_block_table_rw_lock, NULL);
     pthread_rwlock_init(&open_file_table_rw_lock, NULL);
     pthread_rwlock_init(&dir_entries_rw_lock, NULL);
     if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
+        !block_refs || !fs_epoch || !inode_epochs || !block_epochs ||
+        !block_crcs || !block_indexed ||
         !open_file_table || !free_open_file_entries ||
-        !inode_rw_lock || !link_rw_lock) {
+        !inode_rw_lock || !link_rw_lock || !open_file_table_entry_lock ||
+        !append_tails || !block_versions) {
         return -1; // allocation failed
     }
 
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
         pthread_rwlock_init(&inode_rw_lock[i], NULL);
         pthread_rwlock_init(&link_rw_lock[i], NULL);
     }
-
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    for (size_t i = 0; i < APPEND_LOCKS; i++) {
+        pthread_mutex_init(&append_locks[i], NULL);
+        pthread_cond_init(&append_published[i], NULL);
     }
+    rangelock_init();
 
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
         free_open_file_entries[i] = FREE;
         pthread_rwlock_init(&open_file_table_entry_lock[i], NULL);
     }
 
-    return 0;
+    if (fs_params.compression &&
+        blockstore_init(fs_data, DATA_BYTES, DATA_BLOCKS, BLOCK_SIZE,
+                        fs_params.cache_block_count) == -1) {
+        return -1;
+    }
+
+    if (fs_params.checksums) {
+        char *zeros = calloc(1, BLOCK_SIZE);
+        if (zeros == NULL) {
+            return -1;
+        }
+        zero_block_crc = crc32c(0, zeros, BLOCK_SIZE);
+        free(zeros);
+    }
+
+    if (restored) {
+        // the image already holds the FS contents
+        if (fs_params.checksums && recovered) {
+            rebuild_all_crcs();
+        } else if (fs_params.checksums) {
+            verify_all_blocks();
+        }
+    } else {
+        *fs_epoch = 1; // stamp 0 means never changed
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            freeinode_ts[i] = FREE;
+            inode_epochs[i] = 0;
+        }
+
+        for (size_t i = 0; i < DATA_BLOCKS; i++) {
+            free_blocks[i] = FREE;
+            block_refs[i] = 0;
+            block_epochs[i] = 0;
+            block_indexed[i] = 0;
+        }
+    }
+
+    if (fs_params.dedup && dedup_index_init() == -1) {
+        return -1;
+    }
+
+    return restored;
 }
 
 /**
@@ -172,6 +785,10 @@ int state_init(tfs_params params) {
  * Returns 0 if succesful, -1 otherwise.
  */
 int state_destroy(void) {
+#ifdef TFS_LOCK_PROFILE
+    lockprof_report(stderr);
+#endif
+    trace_destroy();
 
     pthread_rwlock_destroy(&inode_table_rw_lock);
     pthread_rwlock_destroy(&data_block_table_rw_lock);
@@ -182,61 +799,158 @@ int state_destroy(void) {
         pthread_rwlock_destroy(&inode_rw_lock[i]);
         pthread_rwlock_destroy(&link_rw_lock[i]);
     }
+    for (size_t i = 0; i < APPEND_LOCKS; i++) {
+        pthread_mutex_destroy(&append_locks[i]);
+        pthread_cond_destroy(&append_published[i]);
+    }
+    rangelock_destroy();
 
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
         pthread_rwlock_destroy(&open_file_table_entry_lock[i]);
+        if (free_open_file_entries[i] == TAKEN) {
+            free(open_file_table[i].of_ra_buffer);
+            free(open_file_table[i].of_wb_buffer);
+        }
+    }
+
+    if (fs_params.compression) {
+        blockstore_destroy();
+    }
+
+    free(dedup_buckets);
+    arena_free(dedup_next, BLOCK_CAPACITY * sizeof(int));
+    arena_free(dedup_fingerprints, BLOCK_CAPACITY * sizeof(uint32_t));
+    dedup_buckets = NULL;
+    dedup_next = NULL;
+    dedup_fingerprints = NULL;
+    dedup_hits = 0;
+    unreleased_blocks = 0;
+
+    if (image_map != NULL) {
+        journal_checkpoint();
+        journal_close();
+        image_close();
+    } else {
+        state_section_t sections[SECTION_COUNT];
+        size_t count = persistent_sections(sections);
+        for (size_t i = 0; i < count; i++) {
+            arena_free(*sections[i].ptr, sections[i].size);
+        }
     }
 
-    free(inode_table);
-    free(inode_rw_lock);
-    free(link_rw_lock);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
-    free(open_file_table_entry_lock);
+    arena_free(inode_rw_lock, INODE_CAPACITY * sizeof(pthread_rwlock_t));
+    arena_free(link_rw_lock, INODE_CAPACITY * sizeof(pthread_rwlock_t));
+    arena_free(append_tails, INODE_CAPACITY * sizeof(atomic_size_t));
+    arena_free(block_versions, BLOCK_CAPACITY * sizeof(uint64_t));
+    arena_free(open_file_table,
+               OPEN_FILES_CAPACITY * sizeof(open_file_entry_t));
+    arena_free(free_open_file_entries,
+               OPEN_FILES_CAPACITY * sizeof(allocation_state_t));
+    arena_free(open_file_table_entry_lock,
+               OPEN_FILES_CAPACITY * sizeof(pthread_rwlock_t));
 
     link_rw_lock = NULL;
+    append_tails = NULL;
+    block_versions = NULL;
     inode_table = NULL;
     inode_rw_lock = NULL;
     freeinode_ts = NULL;
     fs_data = NULL;
     free_blocks = NULL;
+    block_refs = NULL;
+    fs_epoch = NULL;
+    inode_epochs = NULL;
+    block_epochs = NULL;
+    block_crcs = NULL;
+    block_indexed = NULL;
     open_file_table = NULL;
     free_open_file_entries = NULL;
     open_file_table_entry_lock = NULL;
+    atomic_store(&inode_count, 0);
+    atomic_store(&block_count, 0);
+    atomic_store(&open_file_count, 0);
 
     return 0;
 }
 
 /**
- * (Try to) Allocate a new inode in the inode table, without initializing its
- * data.
+ * Grow the inode table (see table_grow_size).
+ * Must be called with the inode table locked.
  *
- * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ * Returns the first of the new inumbers, all free, or -1 if the table is full.
+ */
+static int inode_table_grow(void) {
+    size_t count = INODE_TABLE_SIZE;
+    size_t grown = table_grow_size(count, INODE_CAPACITY);
+    if (grown == count) {
+        return -1;
+    }
+    for (size_t i = count; i < grown; i++) {
+        freeinode_ts[i] = FREE;
+        inode_epochs[i] = 0;
+        pthread_rwlock_init(&inode_rw_lock[i], NULL);
+        pthread_rwlock_init(&link_rw_lock[i], NULL);
+    }
+    atomic_store_explicit(&inode_count, grown, memory_order_release);
+    return (int)count;
+}
+
+/**
+ * (Try to) Allocate new inodes in the inode table, without initializing their
+ * data, in a single pass over the table.
  *
- * Possible errors:
- *   - No free slots in inode table.
+ * Input:
+ *   - inumbers: where to store the inumbers of the new inodes
+ *   - count: number of inodes to allocate
+ *
+ * Returns the number of inodes allocated (fewer than count if the table runs
+ * out of free slots, and cannot grow further).
  */
-static int inode_alloc(void) {
+static size_t inode_alloc_batch(int *inumbers, size_t count) {
+    size_t allocated = 0;
     wrlock(&inode_table_rw_lock);
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+    size_t inumber = 0;
+    for (; inumber < INODE_TABLE_SIZE && allocated < count; inumber++) {
         if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
             insert_delay(); // simulate storage access delay (to freeinode_ts)
         }
 
-        // Finds first free entry in inode table
+        // Takes the free entries found in the inode table
         if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
             freeinode_ts[inumber] = TAKEN;
-            rw_unlock(&inode_table_rw_lock);
-            return (int)inumber;
+            inumbers[allocated++] = (int)inumber;
+        }
+    }
+    // no more free inodes, unless the table can grow
+    while (allocated < count) {
+        int first = inode_table_grow();
+        if (first == -1) {
+            break;
+        }
+        for (size_t i = (size_t)first;
+             i < INODE_TABLE_SIZE && allocated < count; i++) {
+            freeinode_ts[i] = TAKEN;
+            inumbers[allocated++] = (int)i;
         }
     }
-    // no free inodes
     rw_unlock(&inode_table_rw_lock);
-    return -1;
+    stats_add(STAT_INODE_ALLOCS, allocated);
+    stats_add(STAT_INODE_SCANNED, inumber);
+    return allocated;
+}
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data.
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table, which cannot grow further.
+ */
+static int inode_alloc(void) {
+    int inumber;
+    return inode_alloc_batch(&inumber, 1) == 1 ? inumber : -1;
 }
 
 /**
@@ -287,13 +1001,17 @@ int inode_create(inode_type i_type) {
         inode_table[inumber].i_data_block = b;
 
         wrlock(&dir_entries_rw_lock);
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
-
+        dir_entry_t const empty = {.d_inumber = -1};
         for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
+            if (data_block_write(b, i * sizeof(dir_entry_t), &empty,
+                                 sizeof(empty)) == -1) {
+                rw_unlock(&dir_entries_rw_lock);
+                inode_delete(inumber);
+                rw_unlock(get_lock(inumber));
+                return -1; // no space for the entries
+            }
         }
+        data_block_journal(b, 0, MAX_DIR_ENTRIES * sizeof(dir_entry_t));
         rw_unlock(&dir_entries_rw_lock);
     } break;
     case T_FILE: {
@@ -326,10 +1044,43 @@ int inode_create(inode_type i_type) {
     }
     inode->state = TAKEN;
     inode->hard_links = 1;
+    inode->i_sealed = false;
+    inode_dirty(inumber);
+    inode_append_sync(inumber);
     rw_unlock(get_lock(inumber));
     return inumber;
 }
 
+/**
+ * Create several empty files at once, allocating their inodes in a single
+ * pass over the inode table (see inode_create).
+ *
+ * Input:
+ *   - inumbers: where to store the inumbers of the new inodes
+ *   - count: number of files to create
+ *
+ * Returns the number of files created (fewer than count if the inode table
+ * runs out of free slots).
+ */
+size_t inode_create_files(int *inumbers, size_t count) {
+    size_t created = inode_alloc_batch(inumbers, count);
+    for (size_t i = 0; i < created; i++) {
+        wrlock(get_lock(inumbers[i]));
+        insert_delay(); // simulate storage access delay (to inode)
+        inode_t *inode = &inode_table[inumbers[i]];
+        inode->i_node_type = T_FILE;
+        inode->i_size = 0;
+        inode->i_data_block = -1;
+        inode->state = TAKEN;
+        inode->hard_links = 1;
+        inode->i_sealed = false;
+        inode_dirty(inumbers[i]);
+        inode_append_sync(inumbers[i]);
+        rw_unlock(get_lock(inumbers[i]));
+    }
+    return created;
+}
+
 /**
  * Delete an inode.
  *
@@ -350,7 +1101,9 @@ void inode_delete(int inumber) {
     if (inode_table[inumber].i_size > 0) {
         data_block_free(inode_table[inumber].i_data_block);
     }
+    inode_table[inumber].i_generation++; // stale identities no longer match
     freeinode_ts[inumber] = FREE;
+    inode_dirty(inumber);
 
     rw_unlock(&inode_table_rw_lock);
 }
@@ -371,40 +1124,186 @@ inode_t *inode_get(int inumber) {
 }
 
 /**
- * Clear the directory entry associated with a sub file.
+ * Check whether an inumber refers to an allocated inode.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *
- * Returns 0 if successful, -1 otherwise.
- *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ *   - inumber: inode's number
  */
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+bool inode_is_taken(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return false;
     }
 
-    wrlock(&dir_entries_rw_lock);
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
+    rdlock(&inode_table_rw_lock);
+    bool taken = freeinode_ts[inumber] == TAKEN;
+    rw_unlock(&inode_table_rw_lock);
+    return taken;
+}
 
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            rw_unlock(&dir_entries_rw_lock);
-            return 0;
+/**
+ * Create a copy-on-write clone of an inode.
+ *
+ * The clone has the same type and size as the original and shares its data
+ * block, which is copied only when one of them is written. The caller must
+ * hold the original inode's lock (read-locked, it waits for the writes in
+ * progress inside the file, see inode_range_lock).
+ *
+ * Input:
+ *   - inumber: inumber of the inode to clone
+ *
+ * Returns inumber of the clone, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ */
+int inode_clone(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_clone: invalid inumber");
+
+    int clone = inode_alloc();
+    if (clone < 0) {
+        return -1; // no free slots in inode table
+    }
+
+    wrlock(get_lock(clone));
+    insert_delay(); // simulate storage access delay (to both inodes)
+    insert_delay();
+
+    inode_t *original = &inode_table[inumber];
+    inode_t *inode = &inode_table[clone];
+    inode->i_node_type = original->i_node_type;
+    inode_range_lock(inumber, 0, SIZE_MAX, false);
+    inode->i_size = inode_size(original); // may be appended to meanwhile
+    inode->i_data_block = original->i_data_block;
+    if (inode->i_size > 0) {
+        data_block_ref(inode->i_data_block);
+    }
+    inode_range_unlock(inumber, 0, SIZE_MAX, false);
+    inode->state = TAKEN;
+    inode->hard_links = 1;
+    inode->i_sealed = false; // clones (and snapshots) can be changed
+    inode_dirty(clone);
+    inode_append_sync(clone);
+    rw_unlock(get_lock(clone));
+    return clone;
+}
+
+/**
+ * Copy a directory entry out of a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - index: index of the entry (from 0 to the directory capacity)
+ *   - entry: where to copy the entry to (d_inumber is -1 for empty slots)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - index is past the last entry of the directory.
+ */
+int dir_entry_get(inode_t const *inode, size_t index, dir_entry_t *entry) {
+    if (inode->i_node_type != T_DIRECTORY || index >= MAX_DIR_ENTRIES) {
+        return -1;
+    }
+
+    rdlock(&dir_entries_rw_lock);
+    dir_entry_t const *dir_entry = data_block_get(inode->i_data_block);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "dir_entry_get: directory must have a data block");
+    *entry = dir_entry[index];
+    data_block_put(inode->i_data_block);
+    rw_unlock(&dir_entries_rw_lock);
+    return 0;
+}
+
+/**
+ * Copy a batch of directory entries out of a directory, skipping empty slots.
+ *
+ * Entries never move while they exist, so resuming from the returned slot
+ * visits each entry present all along exactly once.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - index: slot to start from; updated to the slot to resume from
+ *   - entries: where to copy the entries to
+ *   - count: maximum number of entries to copy
+ *
+ * Returns the number of entries copied (0 once the end is reached), -1 if
+ * inode is not a directory inode.
+ */
+ssize_t dir_entries_get(inode_t const *inode, size_t *index,
+                        dir_entry_t *entries, size_t count) {
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    rdlock(&dir_entries_rw_lock);
+    dir_entry_t const *dir_entry = data_block_get(inode->i_data_block);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "dir_entries_get: directory must have a data block");
+    size_t copied = 0;
+    size_t i = *index;
+    for (; i < MAX_DIR_ENTRIES && copied < count; i++) {
+        if (dir_entry[i].d_inumber != -1) {
+            entries[copied++] = dir_entry[i];
         }
     }
+    data_block_put(inode->i_data_block);
+    rw_unlock(&dir_entries_rw_lock);
+    *index = i;
+    return (ssize_t)copied;
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ * The entry is checked under the directory lock, so that a name that was
+ * relinked to another file (e.g. by rename_dir_entry) is left alone.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber the entry must link to
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ *   - The entry for sub_name links to another inode.
+ */
+int clear_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    insert_delay();
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    wrlock(&dir_entries_rw_lock);
+    // Locates the block containing the entries of the directory
+    dir_entry_t const *dir_entry = data_block_get(inode->i_data_block);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "clear_dir_entry: directory must have a data block");
+
+    size_t i = 0;
+    while (i < MAX_DIR_ENTRIES && strcmp(dir_entry[i].d_name, sub_name)) {
+        i++;
+    }
+    int found = i < MAX_DIR_ENTRIES ? dir_entry[i].d_inumber : -1;
+    data_block_put(inode->i_data_block);
+    if (found != sub_inumber) {
+        rw_unlock(&dir_entries_rw_lock);
+        return -1; // sub_name not found, or relinked
+    }
+
+    dir_entry_t const empty = {.d_inumber = -1};
+    if (data_block_write(inode->i_data_block, i * sizeof(dir_entry_t), &empty,
+                         sizeof(empty)) == -1) {
+        rw_unlock(&dir_entries_rw_lock);
+        return -1; // no space to store the directory
+    }
+    data_block_journal(inode->i_data_block, i * sizeof(dir_entry_t),
+                       sizeof(dir_entry_t));
     rw_unlock(&dir_entries_rw_lock);
-    return -1; // sub_name not found
+    return 0;
 }
 
 /**
@@ -420,11 +1319,38 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
  * Possible errors:
  *   - inode is not a directory inode.
  *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - Directory already has an entry named sub_name.
  *   - Directory is already full of entries.
  */
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        return -1; // invalid sub_name
+    return add_dir_entries(inode, &sub_name, &sub_inumber, 1) == 1 ? 0 : -1;
+}
+
+/**
+ * Store the inumbers of several sub files in a directory, in a single pass
+ * over it.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_names: sub file names
+ *   - sub_inumbers: inumbers of the sub inodes
+ *   - count: number of sub files
+ *
+ * Returns the number of entries stored, in order (fewer than count if the
+ * directory fills up, or has an entry named as the next sub file), or -1
+ * otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - A sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ */
+ssize_t add_dir_entries(inode_t *inode, char const *const *sub_names,
+                        int const *sub_inumbers, size_t count) {
+    for (size_t n = 0; n < count; n++) {
+        size_t len = strlen(sub_names[n]);
+        if (len == 0 || len > MAX_FILE_NAME - 1) {
+            return -1; // invalid sub_name
+        }
     }
 
     insert_delay(); // simulate storage access delay to inode with inumber
@@ -432,25 +1358,177 @@ int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
+    size_t *slots = malloc((count ? count : 1) * sizeof(size_t));
+    if (slots == NULL) {
+        return -1;
+    }
 
     wrlock(&dir_entries_rw_lock);
     // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
+    dir_entry_t const *dir_entry = data_block_get(inode->i_data_block);
     ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+                  "add_dir_entries: directory must have a data block");
 
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+    // Only the sub files up to the first name already in the directory are
+    // stored, checked under the same lock as the entries are added (so that
+    // two files cannot be created with the same name)
+    for (size_t i = 0; i < MAX_DIR_ENTRIES && count > 0; i++) {
         if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+            continue;
+        }
+        for (size_t n = 0; n < count; n++) {
+            if (strncmp(dir_entry[i].d_name, sub_names[n], MAX_FILE_NAME) ==
+                0) {
+                count = n;
+                break;
+            }
+        }
+    }
+
+    // Finds the empty entries
+    size_t found = 0;
+    for (size_t i = 0; i < MAX_DIR_ENTRIES && found < count; i++) {
+        if (dir_entry[i].d_inumber == -1) {
+            slots[found++] = i;
+        }
+    }
+    data_block_put(inode->i_data_block);
+
+    // Fills them
+    for (size_t n = 0; n < found; n++) {
+        dir_entry_t entry = {.d_inumber = sub_inumbers[n]};
+        strncpy(entry.d_name, sub_names[n], MAX_FILE_NAME - 1);
+        if (data_block_write(inode->i_data_block, slots[n] * sizeof(entry),
+                             &entry, sizeof(entry)) == -1) {
             rw_unlock(&dir_entries_rw_lock);
-            return 0;
+            free(slots);
+            return (ssize_t)n; // no space to store the directory
         }
+        data_block_journal(inode->i_data_block, slots[n] * sizeof(entry),
+                           sizeof(entry));
     }
     rw_unlock(&dir_entries_rw_lock);
-    return -1; // no space for entry
+    free(slots);
+    return (ssize_t)found;
+}
+
+/**
+ * Rename a sub file of a directory, in a single step: no lookup sees both
+ * names or neither.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - old_name: current name of the sub file
+ *   - new_name: new name of the sub file
+ *   - replace: whether an entry already named new_name may be replaced
+ *   - target: inumber new_name was found to link to, write-locked by the
+ *     caller (-1 if none)
+ *   - replaced: where to store whether the entry of target was removed
+ *
+ * Returns 0 if successful, 1 if new_name no longer links to target (nothing
+ * is renamed, look it up again), -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - new_name is not a valid file name.
+ *   - Directory does not contain an entry for old_name.
+ *   - Directory contains an entry for new_name, and replace is false.
+ *   - The entry for new_name is a sealed file (checked here, under the
+ *     directory lock, so that the entry cannot change after the check).
+ */
+int rename_dir_entry(inode_t *inode, char const *old_name,
+                     char const *new_name, bool replace, int target,
+                     bool *replaced) {
+    *replaced = false;
+    if (strlen(new_name) == 0 || strlen(new_name) > MAX_FILE_NAME - 1) {
+        return -1; // invalid new_name
+    }
+
+    insert_delay(); // simulate storage access delay to inode with inumber
+
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    wrlock(&dir_entries_rw_lock);
+    dir_entry_t const *dir_entry = data_block_get(inode->i_data_block);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "rename_dir_entry: directory must have a data block");
+
+    size_t from = MAX_DIR_ENTRIES;
+    size_t to = MAX_DIR_ENTRIES;
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (dir_entry[i].d_inumber == -1) {
+            continue;
+        }
+        if (strncmp(dir_entry[i].d_name, old_name, MAX_FILE_NAME) == 0) {
+            from = i;
+        } else if (strncmp(dir_entry[i].d_name, new_name, MAX_FILE_NAME) ==
+                   0) {
+            to = i;
+        }
+    }
+    if (from == MAX_DIR_ENTRIES) {
+        data_block_put(inode->i_data_block);
+        rw_unlock(&dir_entries_rw_lock);
+        return -1; // old_name not found
+    }
+    int found = to != MAX_DIR_ENTRIES ? dir_entry[to].d_inumber : -1;
+    if (found != -1 && !replace) {
+        data_block_put(inode->i_data_block);
+        rw_unlock(&dir_entries_rw_lock);
+        return -1; // new_name taken
+    }
+    if (found == dir_entry[from].d_inumber) {
+        data_block_put(inode->i_data_block);
+        rw_unlock(&dir_entries_rw_lock);
+        return 0; // both names link to the same file, nothing to do
+    }
+    if (found != target) {
+        data_block_put(inode->i_data_block);
+        rw_unlock(&dir_entries_rw_lock);
+        return 1; // new_name was relinked since it was looked up
+    }
+    if (target != -1 && inode_sealed(inode_get(target))) {
+        data_block_put(inode->i_data_block);
+        rw_unlock(&dir_entries_rw_lock);
+        return -1; // sealed files cannot be replaced
+    }
+
+    // Renamed in place (entries never move, see dir_entries_get), clearing
+    // the replaced entry: both slots are updated by a single write, so that
+    // it cannot be left half done
+    size_t first = to < from ? to : from;
+    size_t last = to != MAX_DIR_ENTRIES && to > from ? to : from;
+    size_t count = last - first + 1;
+    dir_entry_t *span = malloc(count * sizeof(dir_entry_t));
+    if (span == NULL) {
+        data_block_put(inode->i_data_block);
+        rw_unlock(&dir_entries_rw_lock);
+        return -1;
+    }
+    memcpy(span, &dir_entry[first], count * sizeof(dir_entry_t));
+    data_block_put(inode->i_data_block);
+
+    dir_entry_t entry = {.d_inumber = span[from - first].d_inumber};
+    strncpy(entry.d_name, new_name, MAX_FILE_NAME - 1);
+    span[from - first] = entry;
+    if (to != MAX_DIR_ENTRIES) {
+        span[to - first] = (dir_entry_t){.d_inumber = -1};
+    }
+    int written =
+        data_block_write(inode->i_data_block, first * sizeof(dir_entry_t),
+                         span, count * sizeof(dir_entry_t));
+    free(span);
+    if (written == -1) {
+        rw_unlock(&dir_entries_rw_lock);
+        return -1; // no space to store the directory
+    }
+    data_block_journal(inode->i_data_block, first * sizeof(dir_entry_t),
+                       count * sizeof(dir_entry_t));
+    rw_unlock(&dir_entries_rw_lock);
+    *replaced = target != -1;
+    return 0;
 }
 
 /**
@@ -478,7 +1556,7 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
 
     rdlock(&dir_entries_rw_lock);
     // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
+    dir_entry_t const *dir_entry = data_block_get(inode->i_data_block);
 
     ALWAYS_ASSERT(dir_entry != NULL,
                   "find_in_dir: directory inode must have a data block");
@@ -488,48 +1566,168 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
     for (int i = 0; i < MAX_DIR_ENTRIES; i++)
         if ((dir_entry[i].d_inumber != -1) &&
             (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+            int sub_inumber = dir_entry[i].d_inumber;
+            data_block_put(inode->i_data_block);
+            stats_add(STAT_LOOKUP_SCANNED, (uint64_t)i + 1);
 
-            if(inode_get(dir_entry[i].d_inumber)->state == FREE) {
+            if(inode_get(sub_inumber)->state == FREE) {
                 rw_unlock(&dir_entries_rw_lock);
                 return -1; // Free inode
             }
-            int sub_inumber = dir_entry[i].d_inumber;
             rw_unlock(&dir_entries_rw_lock);
             return sub_inumber;
         }
+    data_block_put(inode->i_data_block);
     rw_unlock(&dir_entries_rw_lock);
+    stats_add(STAT_LOOKUP_SCANNED, MAX_DIR_ENTRIES);
     return -1; // entry not found
 }
 
+/**
+ * Stamp a block with the current epoch, logging the stamp in the journal if
+ * it changed, and bump its version. Different parts of a block may be
+ * written at the same time (see inode_range_writes).
+ */
+static void block_stamp(size_t block_number) {
+    __atomic_add_fetch(&block_versions[block_number], 1, __ATOMIC_RELEASE);
+    uint64_t epoch = *fs_epoch;
+    if (__atomic_exchange_n(&block_epochs[block_number], epoch,
+                            __ATOMIC_RELAXED) != epoch) {
+        journal_log(SECTION_BLOCK_EPOCHS, block_number * sizeof(uint64_t),
+                    &epoch, sizeof(uint64_t));
+    }
+}
+
+/**
+ * Log the allocation state and reference count of a block in the journal.
+ * Must be called with the data block table locked.
+ */
+static void block_journal(size_t block_number) {
+    block_stamp(block_number);
+    journal_log(SECTION_FREE_BLOCKS, block_number * sizeof(allocation_state_t),
+                &free_blocks[block_number], sizeof(allocation_state_t));
+    journal_log(SECTION_BLOCK_REFS, block_number * sizeof(uint32_t),
+                &block_refs[block_number], sizeof(uint32_t));
+    journal_log(SECTION_BLOCK_INDEXED, block_number * sizeof(uint8_t),
+                &block_indexed[block_number], sizeof(uint8_t));
+}
+
+/**
+ * Grow the data block table (see table_grow_size).
+ * Must be called with the data block table locked.
+ *
+ * Returns the first of the new blocks, all free, or -1 if the table is full.
+ */
+static int block_table_grow(void) {
+    size_t count = DATA_BLOCKS;
+    size_t grown = table_grow_size(count, BLOCK_CAPACITY);
+    if (grown == count) {
+        return -1;
+    }
+    for (size_t i = count; i < grown; i++) {
+        free_blocks[i] = FREE;
+        block_refs[i] = 0;
+        block_epochs[i] = 0;
+        block_indexed[i] = 0;
+    }
+    atomic_store_explicit(&block_count, grown, memory_order_release);
+    return (int)count;
+}
+
 /**
  * Allocate a new data block.
  *
  * Returns block number/index if successful, -1 otherwise.
  *
  * Possible errors:
- *   - No free data blocks.
+ *   - No free data blocks, and the table cannot grow further.
  */
 int data_block_alloc(void) {
     // Lock data table
     wrlock(&data_block_table_rw_lock);
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+    size_t count = DATA_BLOCKS;
+    size_t i = 0;
+    for (; i < count; i++) {
         if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
             insert_delay(); // simulate storage access delay to free_blocks
         }
 
         if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            rw_unlock(&data_block_table_rw_lock);
-            return (int)i;
+            break;
         }
     }
-    // Unlock data table
+    stats_add(STAT_BLOCK_SCANNED, i < count ? i + 1 : count);
+    if (i == count && block_table_grow() == -1) {
+        // Unlock data table
+        rw_unlock(&data_block_table_rw_lock);
+        return -1;
+    }
+    stats_add(STAT_BLOCK_ALLOCS, 1);
+
+    free_blocks[i] = TAKEN;
+    block_refs[i] = 1;
+    block_journal(i);
+    if (fs_params.compression) {
+        blockstore_clear(i); // compressed blocks start out as zeros
+    } else if (fs_params.checksums) {
+        // Start from a known block, so that its checksum is known too
+        memset(&fs_data[i * BLOCK_SIZE], 0, BLOCK_SIZE);
+    }
+    if (fs_params.checksums) {
+        block_crcs[i] = zero_block_crc;
+    }
     rw_unlock(&data_block_table_rw_lock);
-    return -1;
+    return (int)i;
 }
 
 /**
- * Free a data block.
+ * Give the memory of every run of free data blocks back to the OS, so that
+ * the footprint of the FS follows the data it holds. Released blocks read as
+ * zeros, and take memory again when they are next written.
+ * Must be called with the data block table locked.
+ */
+static void release_free_blocks(void) {
+    size_t run_start = 0;
+    for (size_t i = 0; i <= DATA_BLOCKS; i++) {
+        if (i < DATA_BLOCKS && free_blocks[i] == FREE) {
+            continue;
+        }
+        if (i > run_start) {
+            arena_release(fs_data, run_start * BLOCK_SIZE,
+                          (i - run_start) * BLOCK_SIZE);
+        }
+        run_start = i + 1;
+    }
+    unreleased_blocks = 0;
+}
+
+/**
+ * Drop a reference to a data block, freeing it when no inode uses it anymore
+ * (the fingerprint index does not count as a user).
+ * Must be called with the data block table locked.
+ */
+static void block_unref(int block_number) {
+    block_refs[block_number]--;
+    if (block_refs[block_number] == 1 && block_indexed[block_number]) {
+        dedup_remove(block_number);
+        block_indexed[block_number] = 0;
+        block_refs[block_number]--;
+    }
+    if (block_refs[block_number] == 0) {
+        free_blocks[block_number] = FREE;
+        if (fs_params.compression) {
+            blockstore_clear((size_t)block_number); // release its space
+        } else if (image_map == NULL &&
+                   ++unreleased_blocks >= RELEASE_BATCH_BLOCKS) {
+            // Batched, as a release splits huge pages and costs a syscall
+            release_free_blocks();
+        }
+    }
+    block_journal((size_t)block_number);
+}
+
+/**
+ * Drop a reference to a data block, freeing it when no inode uses it anymore.
  *
  * Input:
  *   - block_number: the block number/index
@@ -539,56 +1737,680 @@ void data_block_free(int block_number) {
     wrlock(&data_block_table_rw_lock);
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_free: invalid block number");
+    ALWAYS_ASSERT(block_refs[block_number] > 0,
+                  "data_block_free: block already freed");
 
     insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
+    block_unref(block_number);
     // Unlock data table
     rw_unlock(&data_block_table_rw_lock);
 }
 
+/**
+ * Add a reference to a data block, so that one more inode shares it.
+ * Shared blocks are copied before being written (see data_block_shared).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_ref(int block_number) {
+    wrlock(&data_block_table_rw_lock);
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_ref: invalid block number");
+    ALWAYS_ASSERT(block_refs[block_number] > 0,
+                  "data_block_ref: block is not allocated");
+
+    block_refs[block_number]++;
+    block_journal((size_t)block_number);
+    rw_unlock(&data_block_table_rw_lock);
+}
+
+/**
+ * Check whether a data block is shared by more than one inode.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+bool data_block_shared(int block_number) {
+    rdlock(&data_block_table_rw_lock);
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_shared: invalid block number");
+
+    bool shared = block_refs[block_number] > 1;
+    rw_unlock(&data_block_table_rw_lock);
+    return shared;
+}
+
+/**
+ * Deduplicate a full file block: if an identical block is already indexed,
+ * share it instead; otherwise, index this one.
+ * Does nothing unless deduplication is enabled.
+ *
+ * Indexed blocks hold an extra reference, so that they count as shared and
+ * are copied before being written (breaking the sharing).
+ *
+ * Input:
+ *   - block_number: the block number/index, used by a single inode
+ *
+ * Returns the block the inode should use from now on (block_number itself,
+ * or the identical block whose reference it now holds instead).
+ */
+int data_block_dedup(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_dedup: invalid block number");
+    if (!fs_params.dedup) {
+        return block_number;
+    }
+
+    wrlock(&data_block_table_rw_lock);
+    if (block_indexed[block_number]) {
+        rw_unlock(&data_block_table_rw_lock);
+        return block_number;
+    }
+
+    // Keep a copy, to compare with candidates one block pin at a time
+    char *contents = malloc(BLOCK_SIZE);
+    ALWAYS_ASSERT(contents != NULL, "data_block_dedup: out of memory");
+    memcpy(contents, data_block_get(block_number), BLOCK_SIZE);
+    data_block_put(block_number);
+    uint32_t fingerprint = crc32c(0, contents, BLOCK_SIZE);
+
+    int twin = dedup_buckets[fingerprint & (dedup_bucket_count - 1)];
+    for (; twin != -1; twin = dedup_next[twin]) {
+        if (dedup_fingerprints[twin] != fingerprint) {
+            continue;
+        }
+        bool same = memcmp(data_block_get(twin), contents, BLOCK_SIZE) == 0;
+        data_block_put(twin);
+        if (same) {
+            break;
+        }
+    }
+    free(contents);
+
+    if (twin != -1) {
+        block_refs[twin]++;
+        block_journal((size_t)twin);
+        block_unref(block_number);
+        dedup_hits++;
+        rw_unlock(&data_block_table_rw_lock);
+        return twin;
+    }
+
+    dedup_insert(block_number, fingerprint);
+    block_indexed[block_number] = 1;
+    block_refs[block_number]++;
+    block_journal((size_t)block_number);
+    rw_unlock(&data_block_table_rw_lock);
+    return block_number;
+}
+
+/**
+ * Report how much deduplication saves.
+ *
+ * Input:
+ *   - stats: where to store the counters
+ */
+void state_dedup_stats(tfs_dedup_stats_t *stats) {
+    *stats = (tfs_dedup_stats_t){0};
+
+    rdlock(&data_block_table_rw_lock);
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        if (free_blocks[i] == FREE) {
+            continue;
+        }
+        stats->physical_blocks++;
+        stats->logical_blocks += block_refs[i] - block_indexed[i];
+        stats->indexed_blocks += block_indexed[i];
+    }
+    stats->dedup_hits = dedup_hits;
+    rw_unlock(&data_block_table_rw_lock);
+}
+
+/**
+ * Report how full the inode, data block and open file tables are.
+ *
+ * Input:
+ *   - stats: where to store the counts (the *_used and *_total fields)
+ */
+void state_usage(tfs_stats_t *stats) {
+    stats->inodes_used = 0;
+    rdlock(&inode_table_rw_lock);
+    stats->inodes_total = INODE_TABLE_SIZE;
+    for (size_t i = 0; i < stats->inodes_total; i++) {
+        stats->inodes_used += freeinode_ts[i] == TAKEN;
+    }
+    rw_unlock(&inode_table_rw_lock);
+
+    stats->blocks_used = 0;
+    rdlock(&data_block_table_rw_lock);
+    stats->blocks_total = DATA_BLOCKS;
+    for (size_t i = 0; i < stats->blocks_total; i++) {
+        stats->blocks_used += free_blocks[i] == TAKEN;
+    }
+    rw_unlock(&data_block_table_rw_lock);
+
+    stats->open_files_used = 0;
+    rdlock(&open_file_table_rw_lock);
+    stats->open_files_total = MAX_OPEN_FILES;
+    for (size_t i = 0; i < stats->open_files_total; i++) {
+        stats->open_files_used += free_open_file_entries[i] == TAKEN;
+    }
+    rw_unlock(&open_file_table_rw_lock);
+}
+
 /**
  * Obtain a pointer to the contents of a given block.
  *
+ * The block stays pinned (with compression, in the cache of uncompressed
+ * blocks) until it is released with data_block_put. A thread must not pin
+ * more than one block at a time. Blocks are changed with data_block_write.
+ *
  * Input:
  *   - block_number: the block number/index
  *
  * Returns a pointer to the first byte of the block.
  */
-void *data_block_get(int block_number) {
+void const *data_block_get(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_get: invalid block number");
 
+    insert_delay(); // simulate storage access delay to block
+    if (fs_params.compression) {
+        return blockstore_get((size_t)block_number);
+    }
+    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+}
+
+/**
+ * Release a block obtained with data_block_get.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_put(int block_number) {
+    if (fs_params.compression) {
+        blockstore_put((size_t)block_number);
+    }
+}
+
+/**
+ * Obtain the version of the contents of a block, which changes whenever the
+ * block is written (or allocated, or freed).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+uint64_t data_block_version(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_version: invalid block number");
+    return __atomic_load_n(&block_versions[block_number], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Record a change to an inode (or to its allocation state): stamp it with
+ * the current epoch and log its contents in the metadata journal.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_dirty(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_dirty: invalid inumber");
+
+    if (inode_epochs[inumber] != *fs_epoch) {
+        inode_epochs[inumber] = *fs_epoch;
+        journal_log(SECTION_INODE_EPOCHS, (size_t)inumber * sizeof(uint64_t),
+                    &inode_epochs[inumber], sizeof(uint64_t));
+    }
+    journal_log(SECTION_INODE_TABLE, (size_t)inumber * sizeof(inode_t),
+                &inode_table[inumber], sizeof(inode_t));
+    journal_log(SECTION_FREE_INODES,
+                (size_t)inumber * sizeof(allocation_state_t),
+                &freeinode_ts[inumber], sizeof(allocation_state_t));
+}
+
+/**
+ * Check whether different parts of a file can be written at the same time,
+ * by threads holding the inode's read lock and an exclusive lock on the range
+ * they write (see inode_range_lock). Not with block checksums or compression,
+ * which only update blocks as a whole.
+ */
+bool inode_range_writes(void) {
+    return !fs_params.checksums && !fs_params.compression;
+}
+
+/**
+ * Lock a range of a file's contents, for threads that only hold the inode's
+ * read lock: writers lock the range they write exclusive, and readers the
+ * range they read shared. Does nothing unless inode_range_writes().
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ *   - start: first byte of the range
+ *   - end: byte right after the range
+ *   - exclusive: whether to lock the range for writing
+ */
+void inode_range_lock(int inumber, size_t start, size_t end, bool exclusive) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_range_lock: invalid inumber");
+    if (inode_range_writes()) {
+        range_lock((size_t)inumber, start, end, exclusive);
+    }
+}
+
+/**
+ * Unlock a range locked with inode_range_lock (with the same arguments).
+ */
+void inode_range_unlock(int inumber, size_t start, size_t end,
+                        bool exclusive) {
+    if (inode_range_writes()) {
+        range_unlock((size_t)inumber, start, end, exclusive);
+    }
+}
+
+/**
+ * Reserve room at the end of a file for an atomic append.
+ *
+ * Appenders only hold the inode's read lock, so they copy their data at the
+ * same time (with data_block_append), each one to the room it reserved, and
+ * then publish the new size (with inode_append_publish), in reservation
+ * order. Must be called with the inode read-locked, and the file must have a
+ * data block of its own (not shared, nor empty).
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ *   - len: number of bytes to append
+ *   - start: where to store the offset of the reserved room
+ *
+ * Returns the number of bytes reserved (fewer than len at the end of the
+ * block, 0 if the file is full), or -1 if appends cannot run concurrently
+ * (with block checksums or compression), and the inode must be write-locked
+ * instead.
+ */
+ssize_t inode_append_reserve(int inumber, size_t len, size_t *start) {
+    ALWAYS_ASSERT(valid_inumber(inumber),
+                  "inode_append_reserve: invalid inumber");
+    if (!inode_range_writes()) {
+        return -1;
+    }
+
+    if (len > BLOCK_SIZE) {
+        len = BLOCK_SIZE;
+    }
+    *start = atomic_fetch_add(&append_tails[inumber], len);
+    if (*start >= BLOCK_SIZE) {
+        return 0;
+    }
+    return (ssize_t)(*start + len > BLOCK_SIZE ? BLOCK_SIZE - *start : len);
+}
+
+/**
+ * Copy data to the room reserved in a block by inode_append_reserve.
+ * Different appenders copy to the same block at the same time.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - offset: start of the reserved room
+ *   - buffer: data to copy
+ *   - len: size of the reserved room
+ */
+void data_block_append(int block_number, size_t offset, void const *buffer,
+                       size_t len) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_append: invalid block number");
+    ALWAYS_ASSERT(offset + len <= BLOCK_SIZE,
+                  "data_block_append: append past the end of the block");
+
+    insert_delay(); // simulate storage access delay to block
+    memcpy(&fs_data[(size_t)block_number * BLOCK_SIZE + offset], buffer, len);
+}
+
+/**
+ * Get the memory of a block that no inode uses yet, to fill it in place (e.g.
+ * with read), without compression only. Finish with data_block_filled.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void *data_block_claim(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_claim: invalid block number");
+    ALWAYS_ASSERT(!fs_params.compression,
+                  "data_block_claim: compressed blocks live in a cache");
+
     insert_delay(); // simulate storage access delay to block
     return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
+/**
+ * Finish filling a block obtained with data_block_claim, stamping it and
+ * updating its checksum.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_filled(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_filled: invalid block number");
+
+    block_stamp((size_t)block_number);
+    if (fs_params.checksums) {
+        block_crcs[block_number] = block_crc((size_t)block_number);
+    }
+}
+
+/**
+ * Publish the new size of a file once an append is copied, after waiting for
+ * the appends reserved before it, so that readers never see a hole.
+ * Must be called with the inode read-locked.
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ *   - start: start of the reserved room
+ *   - end: end of the reserved room
+ */
+void inode_append_publish(int inumber, size_t start, size_t end) {
+    inode_t *inode = &inode_table[inumber];
+    size_t lock = (size_t)inumber % APPEND_LOCKS;
+
+    mutex_lock(&append_locks[lock]);
+    while (inode_size(inode) != start) {
+        pthread_cond_wait(&append_published[lock], &append_locks[lock]);
+    }
+    block_stamp((size_t)inode->i_data_block);
+    __atomic_store_n(&inode->i_size, end, __ATOMIC_RELEASE);
+    inode_dirty(inumber);
+    pthread_cond_broadcast(&append_published[lock]);
+    mutex_unlock(&append_locks[lock]);
+}
+
+/**
+ * Start reserving appends at the current end of a file, after its size was
+ * changed by other means.
+ * Must be called with the inode write-locked.
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ */
+void inode_append_sync(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_append_sync: invalid inumber");
+    atomic_store(&append_tails[inumber], inode_table[inumber].i_size);
+}
+
+/**
+ * Log a range of a metadata block (directory entries or a symlink target),
+ * written with data_block_write, in the metadata journal.
+ * Does nothing if journaling is disabled.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - offset: offset of the range inside the block
+ *   - len: length of the range
+ */
+void data_block_journal(int block_number, size_t offset, size_t len) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_journal: invalid block number");
+
+    if (!journal_enabled()) {
+        return;
+    }
+    size_t start = (size_t)block_number * BLOCK_SIZE + offset;
+    journal_log(SECTION_FS_DATA, start, &fs_data[start], len);
+}
+
+/**
+ * Write to a data block, stamping it with the current epoch and updating its
+ * checksum. Only metadata blocks are journaled (see data_block_journal).
+ *
+ * The checksum is patched with the bytes that change, so small writes do not
+ * pay for reading the whole block.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - offset: where to write, inside the block
+ *   - buffer: contents to write
+ *   - len: length of the contents (must fit in the block)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - (with compression) No space left to store the block.
+ */
+int data_block_write(int block_number, size_t offset, void const *buffer,
+                     size_t len) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_write: invalid block number");
+    ALWAYS_ASSERT(offset + len <= BLOCK_SIZE,
+                  "data_block_write: write past the end of the block");
+
+    char *block;
+    if (fs_params.compression) {
+        block = blockstore_get((size_t)block_number);
+        if (blockstore_dirty((size_t)block_number) == -1) {
+            blockstore_put((size_t)block_number);
+            return -1;
+        }
+    } else {
+        block = &fs_data[(size_t)block_number * BLOCK_SIZE];
+    }
+    insert_delay(); // simulate storage access delay to block
+
+    block_stamp((size_t)block_number);
+    if (fs_params.checksums) {
+        block_crcs[block_number] =
+            crc32c_patch(block_crcs[block_number], block + offset, buffer, len,
+                         BLOCK_SIZE - offset - len);
+    }
+    memcpy(block + offset, buffer, len);
+    data_block_put(block_number);
+    return 0;
+}
+
+/**
+ * Copy the start of a data block to another one.
+ *
+ * Input:
+ *   - dest: number of the block to write
+ *   - source: number of the block to read
+ *   - len: number of bytes to copy
+ *
+ * Returns 0 if successful, -1 otherwise (see data_block_write).
+ */
+int data_block_copy(int dest, int source, size_t len) {
+    // Go through a buffer, so that only one block is pinned at a time
+    char *buffer = malloc(len);
+    if (buffer == NULL) {
+        return -1;
+    }
+    memcpy(buffer, data_block_get(source), len);
+    data_block_put(source);
+
+    int ret = data_block_write(dest, 0, buffer, len);
+    free(buffer);
+    return ret;
+}
+
+/**
+ * Check a data block against its checksum.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns true if the block is intact (or checksums are disabled), false if
+ * its contents were corrupted.
+ */
+bool data_block_verify(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_verify: invalid block number");
+
+    if (!fs_params.checksums) {
+        return true;
+    }
+    return block_crc((size_t)block_number) == block_crcs[block_number];
+}
+
+/**
+ * Start a new change-tracking epoch.
+ * Must not run concurrently with operations that change the FS.
+ *
+ * Returns the new epoch.
+ */
+uint64_t state_epoch_advance(void) {
+    (*fs_epoch)++;
+    journal_log(SECTION_EPOCH, 0, fs_epoch, sizeof(uint64_t));
+    return *fs_epoch;
+}
+
+/**
+ * Report every inode and block changed since a given epoch.
+ * Must not run concurrently with operations that change the FS.
+ *
+ * The scan reads one stamp per inode and block; only the changed ones are
+ * read and passed on.
+ *
+ * Input:
+ *   - epoch: report changes stamped with this epoch or a later one (0 means
+ *     every change ever made)
+ *   - fn: function called for each change; a non-zero return stops the scan
+ *   - arg: passed on to fn
+ *
+ * Returns 0 if successful, -1 if fn stopped the scan.
+ */
+int state_changes_since(uint64_t epoch, tfs_change_fn fn, void *arg) {
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (inode_epochs[i] == 0 || inode_epochs[i] < epoch) {
+            continue;
+        }
+        tfs_change_t change = {
+            .kind = TFS_CHANGE_INODE,
+            .number = (int)i,
+            .epoch = inode_epochs[i],
+            .freed = freeinode_ts[i] == FREE,
+            .data = freeinode_ts[i] == FREE ? NULL : &inode_table[i],
+            .size = freeinode_ts[i] == FREE ? 0 : sizeof(inode_t),
+        };
+        if (fn(&change, arg) != 0) {
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        if (block_epochs[i] == 0 || block_epochs[i] < epoch) {
+            continue;
+        }
+        bool freed = free_blocks[i] == FREE;
+        tfs_change_t change = {
+            .kind = TFS_CHANGE_BLOCK,
+            .number = (int)i,
+            .epoch = block_epochs[i],
+            .freed = freed,
+            .data = freed ? NULL : data_block_get((int)i),
+            .size = freed ? 0 : BLOCK_SIZE,
+        };
+        int stop = fn(&change, arg);
+        if (!freed) {
+            data_block_put((int)i);
+        }
+        if (stop != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Make the metadata changes logged by the calling thread durable.
+ *
+ * Returns 0 if successful (or if journaling is disabled), -1 otherwise.
+ */
+int state_commit(void) { return journal_commit(); }
+
+/**
+ * Whether the journal should be checkpointed (see state_checkpoint).
+ */
+bool state_checkpoint_due(void) { return journal_checkpoint_due(); }
+
+/**
+ * Sync the FS state to its image and empty the journal.
+ * Must be called while no update is in progress.
+ *
+ * Returns 0 if successful (or if journaling is disabled), -1 otherwise.
+ */
+int state_checkpoint(void) { return journal_checkpoint(); }
+
+/**
+ * Grow the open file table (see table_grow_size).
+ * Must be called with the open file table locked.
+ *
+ * Returns the first of the new file handles, all free, or -1 if the table is
+ * full.
+ */
+static int open_file_table_grow(void) {
+    size_t count = MAX_OPEN_FILES;
+    size_t grown = table_grow_size(count, OPEN_FILES_CAPACITY);
+    if (grown == count) {
+        return -1;
+    }
+    for (size_t i = count; i < grown; i++) {
+        free_open_file_entries[i] = FREE;
+        pthread_rwlock_init(&open_file_table_entry_lock[i], NULL);
+    }
+    atomic_store_explicit(&open_file_count, grown, memory_order_release);
+    return (int)count;
+}
+
+/**
+ * Initialize a newly taken entry of the open file table.
+ */
+static void open_file_entry_init(int fhandle, int inumber, size_t offset,
+                                 tfs_file_mode_t mode) {
+    open_file_entry_t *file = &open_file_table[fhandle];
+    file->of_inumber = inumber;
+    file->of_offset = offset;
+    file->of_append = mode & TFS_O_APPEND;
+    file->of_buffered = mode & TFS_O_BUFFERED;
+    file->of_wb_buffer = NULL;
+    file->of_wb_len = 0;
+    file->of_wb_error = false;
+    file->of_ra_buffer = NULL;
+    file->of_ra_start = 0;
+    file->of_ra_end = 0;
+    file->of_ra_window = 0;
+    file->of_ra_next = offset;
+}
+
 /**
  * Add a new entry to the open file table.
  *
  * Input:
  *   - inumber: inode number of the file to open
  *   - offset: initial offset
+ *   - mode: the mode it was opened with (see tfs_open)
  *
  * Returns file handle if successful, -1 otherwise.
  *
  * Possible errors:
- *   - No space in open file table for a new open file.
+ *   - No space in open file table for a new open file, and the table
+ *     cannot grow further.
  */
-int add_to_open_file_table(int inumber, size_t offset) {
+int add_to_open_file_table(int inumber, size_t offset, tfs_file_mode_t mode) {
     // Lock open file table
     wrlock(&open_file_table_rw_lock);
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         if (free_open_file_entries[i] == FREE) {
             free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
+            open_file_entry_init(i, inumber, offset, mode);
             rw_unlock(&open_file_table_rw_lock);
             return i;
         }
     }
+    int fhandle = open_file_table_grow();
+    if (fhandle != -1) {
+        free_open_file_entries[fhandle] = TAKEN;
+        open_file_entry_init(fhandle, inumber, offset, mode);
+    }
     // Unlock open file table
     rw_unlock(&open_file_table_rw_lock);
-    return -1;
+    return fhandle;
 }
 
 /**
@@ -606,6 +2428,8 @@ void remove_from_open_file_table(int fhandle) {
     ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
                   "remove_from_open_file_table: file handle must be taken");
     free_open_file_entries[fhandle] = FREE;
+    free(open_file_table[fhandle].of_ra_buffer);
+    free(open_file_table[fhandle].of_wb_buffer);
     // Unlock open file table
     rw_unlock(&open_file_table_rw_lock);
 }
@@ -631,6 +2455,28 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
     return &open_file_table[fhandle];
 }
 
+/**
+ * Call a function on every open file, with its entry write-locked.
+ * Files opened or closed meanwhile may or may not be visited.
+ *
+ * Input:
+ *   - fn: function to call
+ *   - arg: passed on to fn
+ */
+void open_file_table_foreach(void (*fn)(open_file_entry_t *file, void *arg),
+                             void *arg) {
+    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+        wrlock(&open_file_table_entry_lock[i]);
+        rdlock(&open_file_table_rw_lock);
+        bool taken = free_open_file_entries[i] == TAKEN;
+        rw_unlock(&open_file_table_rw_lock);
+        if (taken) {
+            fn(&open_file_table[i], arg);
+        }
+        rw_unlock(&open_file_table_entry_lock[i]);
+    }
+}
+
 /**
  * Obtain a pointer to a specific rwlock associated with an inode.
  * This lock is used to synchronize access to the inode.
@@ -5,6 +5,7 @@
 #include "operations.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -30,41 +31,123 @@ typedef struct {
     size_t i_size;
     int i_data_block;
     int hard_links;
-    
+    bool i_sealed; // read-only for good (see tfs_seal)
+    uint64_t i_generation; // bumped whenever the inode is freed, for reuse
+
     allocation_state_t state;
     // in a more complete FS, more fields could exist here
 } inode_t;
 
+/**
+ * Size of a file, which appenders may be publishing meanwhile (see
+ * inode_append_publish) unless the inode is write-locked.
+ */
+static inline size_t inode_size(inode_t const *inode) {
+    return __atomic_load_n(&inode->i_size, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Whether a file is sealed, which can be checked without locking its inode:
+ * once set, the flag and the file's contents never change again.
+ */
+static inline bool inode_sealed(inode_t const *inode) {
+    return __atomic_load_n(&inode->i_sealed, __ATOMIC_ACQUIRE);
+}
+
 /**
  * Open file entry (in open file table)
  */
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    bool of_append;   // every write appends (opened with TFS_O_APPEND)
+    bool of_buffered; // writes are buffered (opened with TFS_O_BUFFERED)
+    // Write-behind (see tfs_write): of_wb_len bytes buffered in of_wb_buffer,
+    // to be written at of_wb_start (or appended), since of_wb_since (ms)
+    char *of_wb_buffer;
+    size_t of_wb_start;
+    size_t of_wb_len;
+    uint64_t of_wb_since;
+    bool of_wb_error; // a background flush failed
+    // Read-ahead (see tfs_read): bytes [of_ra_start, of_ra_end) of the file,
+    // at the same offsets of of_ra_buffer, copied from block of_ra_block when
+    // it had version of_ra_version
+    char *of_ra_buffer;
+    int of_ra_block;
+    uint64_t of_ra_version;
+    size_t of_ra_start;
+    size_t of_ra_end;
+    size_t of_ra_window; // bytes to read ahead, 0 if reads are not sequential
+    size_t of_ra_next;   // offset right after the last read
 } open_file_entry_t;
 
 
 
 int state_init(tfs_params);
 int state_destroy(void);
+int state_sync(void);
+int state_commit(void);
+bool state_checkpoint_due(void);
+int state_checkpoint(void);
 
 size_t state_block_size(void);
+bool state_compressed(void);
 
 int inode_create(inode_type n_type);
+size_t inode_create_files(int *inumbers, size_t count);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
-
-int clear_dir_entry(inode_t *inode, char const *sub_name);
+void inode_dirty(int inumber);
+bool inode_range_writes(void);
+void inode_range_lock(int inumber, size_t start, size_t end, bool exclusive);
+void inode_range_unlock(int inumber, size_t start, size_t end,
+                        bool exclusive);
+ssize_t inode_append_reserve(int inumber, size_t len, size_t *start);
+void inode_append_publish(int inumber, size_t start, size_t end);
+void inode_append_sync(int inumber);
+bool inode_is_taken(int inumber);
+int inode_clone(int inumber);
+
+int clear_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
+ssize_t add_dir_entries(inode_t *inode, char const *const *sub_names,
+                        int const *sub_inumbers, size_t count);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+int rename_dir_entry(inode_t *inode, char const *old_name,
+                     char const *new_name, bool replace, int target,
+                     bool *replaced);
+int dir_entry_get(inode_t const *inode, size_t index, dir_entry_t *entry);
+ssize_t dir_entries_get(inode_t const *inode, size_t *index,
+                        dir_entry_t *entries, size_t count);
 
 int data_block_alloc(void);
 void data_block_free(int block_number);
-void *data_block_get(int block_number);
-
-int add_to_open_file_table(int inumber, size_t offset);
+void data_block_ref(int block_number);
+bool data_block_shared(int block_number);
+int data_block_dedup(int block_number);
+void state_dedup_stats(tfs_dedup_stats_t *stats);
+void state_usage(tfs_stats_t *stats);
+void const *data_block_get(int block_number);
+void data_block_put(int block_number);
+uint64_t data_block_version(int block_number);
+void data_block_journal(int block_number, size_t offset, size_t len);
+void data_block_append(int block_number, size_t offset, void const *buffer,
+                       size_t len);
+void *data_block_claim(int block_number);
+void data_block_filled(int block_number);
+int data_block_write(int block_number, size_t offset, void const *buffer,
+                     size_t len);
+int data_block_copy(int dest, int source, size_t len);
+bool data_block_verify(int block_number);
+
+uint64_t state_epoch_advance(void);
+int state_changes_since(uint64_t epoch, tfs_change_fn fn, void *arg);
+
+int add_to_open_file_table(int inumber, size_t offset, tfs_file_mode_t mode);
 void remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
+void open_file_table_foreach(void (*fn)(open_file_entry_t *file, void *arg),
+                             void *arg);
 
 pthread_rwlock_t *get_lock(int inumber);
 pthread_rwlock_t *get_link_lock(int inumber);
@@ -74,4 +157,14 @@ size_t get_block_size();
 void rdlock(pthread_rwlock_t *lock);
 void wrlock(pthread_rwlock_t *lock);
 void rw_unlock(pthread_rwlock_t *lock);
+void mutex_lock(pthread_mutex_t *lock);
+void mutex_unlock(pthread_mutex_t *lock);
+
+#ifdef TFS_LOCK_PROFILE
+// Tell the lock profiler where each lock is taken (see lockprof.h)
+void rdlock_at(pthread_rwlock_t *lock, char const *func, int line);
+void wrlock_at(pthread_rwlock_t *lock, char const *func, int line);
+#define rdlock(lock) rdlock_at((lock), __func__, __LINE__)
+#define wrlock(lock) wrlock_at((lock), __func__, __LINE__)
+#endif
 #endif // STATE_H
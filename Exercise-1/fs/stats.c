@@ -0,0 +1,119 @@
+#include "stats.h"
+#include "state.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Counters of a thread, in the list of all threads' counters.
+ */
+typedef struct thread_stats {
+    uint64_t counters[STAT_COUNTERS];
+    struct thread_stats *next;
+} thread_stats_t;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats_t *threads;         // threads alive
+static uint64_t retired[STAT_COUNTERS]; // counted by threads gone
+static uint64_t baseline[STAT_COUNTERS]; // totals at the last reset
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key; // to retire a thread's counters when it exits
+static _Thread_local thread_stats_t *mine;
+
+/**
+ * Fold the counters of an exiting thread into the retired totals.
+ */
+static void thread_retire(void *arg) {
+    thread_stats_t *stats = arg;
+    mine = NULL;
+    mutex_lock(&registry_lock);
+    for (thread_stats_t **p = &threads; *p != NULL; p = &(*p)->next) {
+        if (*p == stats) {
+            *p = stats->next;
+            break;
+        }
+    }
+    for (size_t i = 0; i < STAT_COUNTERS; i++) {
+        retired[i] += stats->counters[i];
+    }
+    mutex_unlock(&registry_lock);
+    free(stats);
+}
+
+static void key_create(void) {
+    if (pthread_key_create(&key, thread_retire) != 0) {
+        perror("pthread_key_create");
+        exit(1);
+    }
+}
+
+/**
+ * Register the calling thread's counters.
+ *
+ * Returns them, or NULL if out of memory (nothing is counted then).
+ */
+static thread_stats_t *thread_register(void) {
+    pthread_once(&key_once, key_create);
+    thread_stats_t *stats = calloc(1, sizeof(thread_stats_t));
+    if (stats == NULL || pthread_setspecific(key, stats) != 0) {
+        free(stats);
+        return NULL;
+    }
+    mutex_lock(&registry_lock);
+    stats->next = threads;
+    threads = stats;
+    mutex_unlock(&registry_lock);
+    return stats;
+}
+
+/**
+ * Add to a counter of the calling thread.
+ *
+ * Input:
+ *   - counter: the counter
+ *   - n: amount to add
+ */
+void stats_add(stat_counter_t counter, uint64_t n) {
+    thread_stats_t *stats = mine;
+    if (stats == NULL && (stats = mine = thread_register()) == NULL) {
+        return;
+    }
+    // Only this thread writes the counter, but others read it
+    uint64_t *c = &stats->counters[counter];
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Add up the counters of all threads, since the last reset.
+ *
+ * Input:
+ *   - totals: where to store the total of each counter
+ */
+void stats_sum(uint64_t totals[STAT_COUNTERS]) {
+    mutex_lock(&registry_lock);
+    for (size_t i = 0; i < STAT_COUNTERS; i++) {
+        totals[i] = retired[i] - baseline[i];
+    }
+    for (thread_stats_t *t = threads; t != NULL; t = t->next) {
+        for (size_t i = 0; i < STAT_COUNTERS; i++) {
+            totals[i] += __atomic_load_n(&t->counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    mutex_unlock(&registry_lock);
+}
+
+/**
+ * Start counting from zero (the counters themselves are left alone, as only
+ * their threads write them).
+ */
+void stats_reset(void) {
+    uint64_t totals[STAT_COUNTERS];
+    stats_sum(totals);
+    mutex_lock(&registry_lock);
+    for (size_t i = 0; i < STAT_COUNTERS; i++) {
+        baseline[i] += totals[i];
+    }
+    mutex_unlock(&registry_lock);
+}
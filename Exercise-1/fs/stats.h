@@ -0,0 +1,41 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/**
+ * Operation statistics.
+ *
+ * Each thread counts into counters of its own, which only it writes, so
+ * counting costs a couple of plain memory accesses; the counters of all
+ * threads (alive or gone) are added up when read.
+ */
+
+typedef enum {
+    // Calls of each operation (in the order of tfs_op_t)
+    STAT_OPEN,
+    STAT_READ,
+    STAT_WRITE,
+    STAT_LINK,
+    STAT_UNLINK,
+    STAT_LOOKUP,
+    // Bytes read and written
+    STAT_READ_BYTES,
+    STAT_WRITE_BYTES,
+    // Allocations, and table slots scanned by them
+    STAT_INODE_ALLOCS,
+    STAT_INODE_SCANNED,
+    STAT_BLOCK_ALLOCS,
+    STAT_BLOCK_SCANNED,
+    // Directory entries scanned by lookups
+    STAT_LOOKUP_SCANNED,
+    // Time spent in simulated storage delays
+    STAT_DELAY_NS,
+    STAT_COUNTERS
+} stat_counter_t;
+
+void stats_add(stat_counter_t counter, uint64_t n);
+void stats_sum(uint64_t totals[STAT_COUNTERS]);
+void stats_reset(void);
+
+#endif // STATS_H
@@ -0,0 +1,27 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Operation tracer (see tfs_params.trace_events).
+ *
+ * Each thread records the spans of what it does (TFS calls, lock waits,
+ * storage delays) into a ring buffer of its own, which only it writes, so
+ * tracing takes no locks; once full, a ring overwrites its oldest spans.
+ * The rings of all threads (alive or gone) are written out as Chrome trace
+ * events, which Perfetto and chrome://tracing show as a timeline.
+ */
+
+void trace_init(size_t events);
+void trace_destroy(void);
+
+bool trace_enabled(void);
+uint64_t trace_now(void);
+void trace_span(char const *name, char const *category, uint64_t start,
+                uint64_t end);
+int trace_dump(FILE *out);
+
+#endif // TRACE_H
@@ -0,0 +1,82 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK (1024)
+#define THREADS (4)
+#define RECORD (8)
+#define RECORDS (BLOCK / RECORD / THREADS - 1)
+#define SIZE ((THREADS * RECORDS + 2) * RECORD)
+
+char const path[] = "/log";
+
+// Each thread appends RECORDS records "<thread id>:<n>" through its own handle
+void *th_run(void *arg) {
+    int id = *(int *)arg;
+    int fd = tfs_open(path, TFS_O_APPEND);
+    assert(fd != -1);
+    for (int i = 0; i < RECORDS; i++) {
+        char record[RECORD + 1];
+        snprintf(record, sizeof(record), "%d:%05d", id, i);
+        assert(tfs_write(fd, record, RECORD) == RECORD);
+    }
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // The first record is not appended concurrently (the file has no block)
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, "header!!", RECORD) == RECORD);
+
+    pthread_t tids[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, th_run, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    // An append handle opened earlier still writes at the end
+    assert(tfs_write(fd, "trailer!", RECORD) == RECORD);
+    assert(tfs_close(fd) != -1);
+
+    // Every record is there, whole, and in order within its thread
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    char contents[BLOCK + 1];
+    assert(tfs_read(fd, contents, sizeof(contents)) == SIZE);
+    assert(tfs_close(fd) != -1);
+    assert(memcmp(contents, "header!!", RECORD) == 0);
+    assert(memcmp(contents + SIZE - RECORD, "trailer!", RECORD) == 0);
+
+    int next[THREADS] = {0};
+    for (size_t off = RECORD; off < SIZE - RECORD; off += RECORD) {
+        int id, n;
+        char record[RECORD + 1];
+        memcpy(record, contents + off, RECORD);
+        record[RECORD] = '\0';
+        assert(sscanf(record, "%d:%d", &id, &n) == 2);
+        assert(id >= 0 && id < THREADS);
+        assert(n == next[id]);
+        next[id]++;
+    }
+    int total = 0;
+    for (int i = 0; i < THREADS; i++) {
+        total += next[i];
+    }
+    assert(total == THREADS * RECORDS);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
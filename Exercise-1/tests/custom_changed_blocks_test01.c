@@ -0,0 +1,93 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+char const file_contents[] = "SO PROJECT!!!";
+char f1[] = "/f1";
+char f2[] = "/f2";
+
+typedef struct {
+    int inodes;
+    int blocks;
+    int freed_blocks;
+    bool saw_contents;
+} changes_t;
+
+int count_change(tfs_change_t const *change, void *arg) {
+    changes_t *changes = arg;
+    if (change->kind == TFS_CHANGE_INODE) {
+        changes->inodes++;
+    } else if (change->freed) {
+        assert(change->data == NULL);
+        changes->freed_blocks++;
+    } else {
+        changes->blocks++;
+        if (memcmp(change->data, file_contents, sizeof(file_contents)) == 0) {
+            changes->saw_contents = true;
+        }
+    }
+    return 0;
+}
+
+int stop(tfs_change_t const *change, void *arg) {
+    (void)change;
+    (void)arg;
+    return 1;
+}
+
+void write_file(char const *path) {
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, file_contents, sizeof(file_contents)) ==
+           sizeof(file_contents));
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    write_file(f1);
+    write_file(f2);
+
+    // Everything changed since the FS was created: the root directory, its
+    // block, and both files with their blocks
+    changes_t changes = {0};
+    int64_t epoch = tfs_changes_since(0, count_change, &changes);
+    assert(epoch > 0);
+    assert(changes.inodes == 3);
+    assert(changes.blocks == 3);
+    assert(changes.saw_contents);
+
+    // Nothing changed since
+    memset(&changes, 0, sizeof(changes));
+    int64_t next = tfs_changes_since((uint64_t)epoch, count_change, &changes);
+    assert(next > epoch);
+    assert(changes.inodes == 0 && changes.blocks == 0);
+
+    // Only the rewritten file is reported (f1's entry in the root directory
+    // is left as is, and its block is freed and allocated again)
+    write_file(f1);
+    memset(&changes, 0, sizeof(changes));
+    epoch = tfs_changes_since((uint64_t)next, count_change, &changes);
+    assert(changes.inodes == 1);
+    assert(changes.blocks == 1 && changes.freed_blocks == 0);
+    assert(changes.saw_contents);
+
+    // Deleting a file reports its inode and block, and the root directory's
+    // block (not the root inode, which is left as is)
+    assert(tfs_unlink(f2) != -1);
+    memset(&changes, 0, sizeof(changes));
+    assert(tfs_changes_since((uint64_t)epoch, count_change, &changes) != -1);
+    assert(changes.inodes == 1);
+    assert(changes.blocks == 1 && changes.freed_blocks == 1);
+
+    // The callback can stop the scan
+    assert(tfs_changes_since(0, stop, NULL) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
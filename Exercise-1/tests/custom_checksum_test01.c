@@ -0,0 +1,145 @@
+#include "../fs/crc32c.h"
+#include "../fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+char const image_path[] = "/tmp/tfs_custom_checksum_test01.img";
+char const journal_path[] = "/tmp/tfs_custom_checksum_test01.img.journal";
+char const file_contents[] = "SO PROJECT!!! (to be corrupted)";
+char const other_contents[] = "SO PROJECT!!! (left intact)";
+char f1[] = "/f1";
+char f2[] = "/f2";
+
+void check_crc32c(void) {
+    // Standard check value
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+
+    // Chunked computation gives the same result
+    assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+    // Patching a range matches computing the CRC from scratch
+    unsigned char block[1024];
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = (unsigned char)rand();
+    }
+    uint32_t crc = crc32c(0, block, sizeof(block));
+    for (int round = 0; round < 100; round++) {
+        size_t offset = (size_t)rand() % sizeof(block);
+        size_t len = (size_t)rand() % (sizeof(block) - offset + 1);
+        unsigned char update[sizeof(block)];
+        for (size_t i = 0; i < len; i++) {
+            update[i] = (unsigned char)rand();
+        }
+        crc = crc32c_patch(crc, block + offset, update, len,
+                           sizeof(block) - offset - len);
+        memcpy(block + offset, update, len);
+        assert(crc == crc32c(0, block, sizeof(block)));
+    }
+}
+
+void write_file(char const *path, char const *contents, size_t len) {
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, len) == len);
+    assert(tfs_close(fd) != -1);
+}
+
+ssize_t read_file(char const *path, char *buffer, size_t len) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    ssize_t r = tfs_read(fd, buffer, len);
+    assert(tfs_close(fd) != -1);
+    return r;
+}
+
+// Flip a byte of the first copy of a string found in the image
+void corrupt_image(char const *needle) {
+    int fd = open(image_path, O_RDWR);
+    assert(fd != -1);
+    struct stat st;
+    assert(fstat(fd, &st) != -1);
+
+    char *image = malloc((size_t)st.st_size);
+    assert(image != NULL);
+    assert(pread(fd, image, (size_t)st.st_size, 0) == st.st_size);
+
+    size_t needle_len = strlen(needle);
+    for (off_t pos = 0; pos + (off_t)needle_len <= st.st_size; pos++) {
+        if (memcmp(image + pos, needle, needle_len) == 0) {
+            char flipped = (char)(image[pos] ^ 1);
+            assert(pwrite(fd, &flipped, 1, pos) == 1);
+            break;
+        }
+    }
+    free(image);
+    assert(close(fd) != -1);
+}
+
+int main() {
+    check_crc32c();
+
+    unlink(image_path);
+
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+    params.checksums = true;
+
+    assert(tfs_init(&params) != -1);
+
+    // Partial overwrites keep the checksum up to date
+    write_file(f1, "SO project", 10);
+    write_file(f1, file_contents, sizeof(file_contents));
+    write_file(f2, other_contents, sizeof(other_contents));
+
+    char buffer[sizeof(file_contents)];
+    assert(read_file(f1, buffer, sizeof(buffer)) == sizeof(file_contents));
+    assert(memcmp(buffer, file_contents, sizeof(file_contents)) == 0);
+
+    assert(tfs_destroy() != -1);
+
+    corrupt_image(file_contents);
+
+    // The image still loads (the corrupted block is reported), but the
+    // corrupted file can no longer be read
+    params.checksums = false; // the image's own setting wins
+    assert(tfs_init(&params) != -1);
+    assert(read_file(f1, buffer, sizeof(buffer)) == -1);
+    assert(read_file(f2, buffer, sizeof(buffer)) == sizeof(other_contents));
+    assert(memcmp(buffer, other_contents, sizeof(other_contents)) == 0);
+    assert(tfs_destroy() != -1);
+
+    unlink(image_path);
+
+    // File data is not journaled, so after a crash it may be older than its
+    // checksum: recovery recomputes the checksums rather than failing reads
+    params.checksums = true;
+    params.journal = true;
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(&params) != -1);
+        write_file(f1, file_contents, sizeof(file_contents));
+        _exit(0); // crash
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    corrupt_image(file_contents); // as if the block was never written back
+
+    assert(tfs_init(&params) != -1);
+    assert(read_file(f1, buffer, sizeof(buffer)) == sizeof(file_contents));
+    assert(tfs_destroy() != -1);
+
+    unlink(image_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+char const file_contents[] = "SO PROJECT!!!";
+char const new_contents[] = "CLONED!";
+char f1[] = "/f1";
+char f2[] = "/f2";
+char f3[] = "/f3";
+
+// Checks the file size, and that it starts with contents
+void assert_contents(char const *path, char const *contents, size_t size) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    char buffer[64];
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == size);
+    assert(memcmp(buffer, contents, strlen(contents)) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    // Room for the root directory and two data blocks only
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 3;
+    assert(tfs_init(&params) != -1);
+
+    int fd = tfs_open(f1, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, file_contents, sizeof(file_contents)) ==
+           sizeof(file_contents));
+    assert(tfs_close(fd) != -1);
+
+    // Cloning shares the block, so any number of clones fits
+    assert(tfs_clone(f1, f2) != -1);
+    assert(tfs_clone(f1, f3) != -1);
+    assert(tfs_clone(f1, f2) == -1); // destination exists
+    assert(tfs_clone("/missing", "/f4") == -1);
+    assert_contents(f2, file_contents, sizeof(file_contents));
+    assert_contents(f3, file_contents, sizeof(file_contents));
+
+    // Writing to a clone copies the block first
+    fd = tfs_open(f2, 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, new_contents, sizeof(new_contents)) ==
+           sizeof(new_contents));
+    assert(tfs_close(fd) != -1);
+    assert_contents(f1, file_contents, sizeof(file_contents));
+    assert_contents(f3, file_contents, sizeof(file_contents));
+    assert_contents(f2, new_contents, sizeof(file_contents));
+
+    // Both blocks are in use now
+    fd = tfs_open(f3, 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, new_contents, sizeof(new_contents)) == -1);
+    assert(tfs_close(fd) != -1);
+
+    // Once f1 is gone, f3 owns the block and writes it in place
+    assert(tfs_unlink(f1) != -1);
+    fd = tfs_open(f3, 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, new_contents, sizeof(new_contents)) ==
+           sizeof(new_contents));
+    assert(tfs_close(fd) != -1);
+    assert_contents(f3, new_contents, sizeof(file_contents));
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
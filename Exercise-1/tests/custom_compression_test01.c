@@ -0,0 +1,128 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK (1024)
+#define FILES (12)
+#define THREADS (4)
+
+char const image_path[] = "/tmp/tfs_custom_compression_test01.img";
+
+// Compressible contents, different for each file
+void fill_text(char *buffer, int id) {
+    for (size_t i = 0; i < BLOCK; i++) {
+        buffer[i] = "SO PROJECT!!! "[i % 14];
+    }
+    snprintf(buffer, 16, "file %d", id);
+}
+
+void fill_random(char *buffer) {
+    for (size_t i = 0; i < BLOCK; i++) {
+        buffer[i] = (char)rand();
+    }
+}
+
+void path_of(char *path, size_t size, int id) {
+    snprintf(path, size, "/f%d", id);
+}
+
+ssize_t write_file(int id, char const *contents) {
+    char path[16];
+    path_of(path, sizeof(path), id);
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    ssize_t w = tfs_write(fd, contents, BLOCK);
+    assert(tfs_close(fd) != -1);
+    return w;
+}
+
+void assert_file(int id, char const *contents) {
+    char path[16];
+    path_of(path, sizeof(path), id);
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    char buffer[BLOCK];
+    assert(tfs_read(fd, buffer, BLOCK) == BLOCK);
+    assert(memcmp(buffer, contents, BLOCK) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+void *th_run(void *arg) {
+    int id = *(int *)arg;
+    char contents[BLOCK];
+    fill_text(contents, id);
+    for (int i = 0; i < 20; i++) {
+        assert(write_file(id, contents) == BLOCK);
+        assert_file(id, contents);
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 4;
+    params.compression = true;
+    params.cache_block_count = 2;
+
+    // Not available for images
+    params.image_path = image_path;
+    assert(tfs_init(&params) == -1);
+    params.image_path = NULL;
+
+    assert(tfs_init(&params) != -1);
+
+    // Three times more data than the budget of 4 blocks, read back after
+    // being evicted from the cache
+    char contents[FILES][BLOCK];
+    for (int i = 0; i < FILES; i++) {
+        fill_text(contents[i], i);
+        assert(write_file(i, contents[i]) == BLOCK);
+    }
+    for (int i = 0; i < FILES; i++) {
+        assert_file(i, contents[i]);
+    }
+
+    // Incompressible data eventually runs out of space, without losing
+    // anything already written
+    char noise[BLOCK];
+    fill_random(noise);
+    int id = FILES;
+    while (write_file(id, noise) == BLOCK) {
+        id++;
+    }
+    assert(id < FILES + 4);
+    for (int i = 0; i < FILES; i++) {
+        assert_file(i, contents[i]);
+    }
+
+    // Deleting files gives the space back
+    for (int i = 0; i < FILES; i++) {
+        char path[16];
+        path_of(path, sizeof(path), i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(write_file(id, noise) == BLOCK);
+    assert_file(id, noise);
+
+    assert(tfs_destroy() != -1);
+
+    // Concurrent users of a cache smaller than the number of threads
+    assert(tfs_init(&params) != -1);
+    pthread_t tids[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, th_run, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
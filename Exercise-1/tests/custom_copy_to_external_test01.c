@@ -0,0 +1,82 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK (1024)
+
+char const dest[] = "/tmp/tfs_custom_copy_to_external_test01";
+
+// Check the contents of a host file
+void assert_host(char const *path, char const *contents, size_t len) {
+    static char buffer[2 * BLOCK];
+    FILE *f = fopen(path, "r");
+    assert(f != NULL);
+    assert(fread(buffer, 1, sizeof(buffer), f) == len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(fclose(f) == 0);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    assert(tfs_init(&params) != -1);
+
+    char contents[BLOCK];
+    for (size_t i = 0; i < BLOCK; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, BLOCK) == BLOCK);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_sym_link("/f1", "/l1") != -1);
+    fd = tfs_open("/empty", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    tfs_dedup_stats_t before;
+    assert(tfs_dedup_stats(&before) != -1);
+
+    // A full block, through a symlink, overwriting what was there
+    FILE *f = fopen(dest, "w");
+    assert(f != NULL);
+    assert(fprintf(f, "%*s", 2 * BLOCK, "old") == 2 * BLOCK);
+    assert(fclose(f) == 0);
+    assert(tfs_copy_to_external_fs("/l1", dest) != -1);
+    assert_host(dest, contents, BLOCK);
+
+    // An empty file
+    assert(tfs_copy_to_external_fs("/empty", dest) != -1);
+    assert_host(dest, "", 0);
+
+    // The fd variant writes at the current position of the descriptor
+    int host = open(dest, O_WRONLY | O_TRUNC);
+    assert(host != -1);
+    assert(write(host, "head:", 5) == 5);
+    assert(tfs_copy_to_fd("/f1", host) == BLOCK);
+    assert(close(host) == 0);
+    char expected[BLOCK + 5];
+    memcpy(expected, "head:", 5);
+    memcpy(expected + 5, contents, BLOCK);
+    assert_host(dest, expected, sizeof(expected));
+
+    // Copying leaves no reference behind on the blocks it was written from
+    tfs_dedup_stats_t after;
+    assert(tfs_dedup_stats(&after) != -1);
+    assert(after.logical_blocks == before.logical_blocks);
+    assert(after.physical_blocks == before.physical_blocks);
+
+    // Missing sources, and destinations that cannot be written
+    assert(tfs_copy_to_external_fs("/missing", dest) == -1);
+    assert(tfs_copy_to_external_fs("/f1", "/tmp/missing_dir/f1") == -1);
+    assert(tfs_copy_to_fd("/f1", -1) == -1);
+
+    assert(tfs_destroy() != -1);
+    unlink(dest);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK (1024)
+#define COPIES (6)
+
+char const image_path[] = "/tmp/tfs_custom_dedup_test01.img";
+
+void path_of(char *path, size_t size, int id) {
+    snprintf(path, size, "/f%d", id);
+}
+
+ssize_t write_file(int id, char const *contents, size_t len) {
+    char path[16];
+    path_of(path, sizeof(path), id);
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    ssize_t w = tfs_write(fd, contents, len);
+    assert(tfs_close(fd) != -1);
+    return w;
+}
+
+void assert_file(int id, char const *contents) {
+    char path[16];
+    path_of(path, sizeof(path), id);
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    char buffer[BLOCK];
+    assert(tfs_read(fd, buffer, BLOCK) == BLOCK);
+    assert(memcmp(buffer, contents, BLOCK) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    char contents[BLOCK];
+    memset(contents, 'a', BLOCK);
+    char changed[BLOCK];
+    memcpy(changed, contents, BLOCK);
+    changed[0] = 'b';
+
+    unlink(image_path);
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 4; // the root directory, and room for 3 blocks
+    params.image_path = image_path;
+    params.dedup = true;
+    assert(tfs_init(&params) != -1);
+
+    // Identical copies take a single block
+    for (int i = 0; i < COPIES; i++) {
+        assert(write_file(i, contents, BLOCK) == BLOCK);
+    }
+    tfs_dedup_stats_t stats;
+    assert(tfs_dedup_stats(&stats) != -1);
+    assert(stats.physical_blocks == 2);
+    assert(stats.logical_blocks == COPIES + 1);
+    assert(stats.indexed_blocks == 1);
+    assert(stats.dedup_hits == COPIES - 1);
+
+    // Writing to a copy breaks the sharing
+    int fd = tfs_open("/f0", 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, "b", 1) == 1);
+    assert(tfs_close(fd) != -1);
+    assert_file(0, changed);
+    for (int i = 1; i < COPIES; i++) {
+        assert_file(i, contents);
+    }
+
+    // The index survives reloading the image
+    assert(tfs_destroy() != -1);
+    params.dedup = false; // the image's own setting wins
+    assert(tfs_init(&params) != -1);
+    assert(write_file(COPIES, changed, BLOCK) == BLOCK);
+    assert(tfs_dedup_stats(&stats) != -1);
+    assert(stats.physical_blocks == 3);
+    assert(stats.logical_blocks == COPIES + 2);
+
+    // Blocks leave the index (and are freed) along with their last file
+    for (int i = 1; i < COPIES; i++) {
+        char path[16];
+        path_of(path, sizeof(path), i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(tfs_dedup_stats(&stats) != -1);
+    assert(stats.physical_blocks == 2);
+    assert(stats.indexed_blocks == 1);
+
+    assert(tfs_destroy() != -1);
+    unlink(image_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define INODE_LIMIT (64)
+#define THREADS (4)
+#define FILES_PER_THREAD ((INODE_LIMIT - 1) / THREADS)
+
+void path_of(char *path, size_t size, int id) {
+    snprintf(path, size, "/f%d", id);
+}
+
+// Open many files at once, so that every table grows while in use
+void *th_run(void *arg) {
+    int first = *(int *)arg;
+    int fds[FILES_PER_THREAD];
+    char path[16];
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        path_of(path, sizeof(path), first + i);
+        fds[i] = tfs_open(path, TFS_O_CREAT);
+        assert(fds[i] != -1);
+        assert(tfs_write(fds[i], path, sizeof(path)) == sizeof(path));
+    }
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        assert(tfs_close(fds[i]) != -1);
+    }
+
+    char buffer[16];
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        path_of(path, sizeof(path), first + i);
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(strcmp(buffer, path) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 2;
+    params.max_block_count = 2;
+    params.max_open_files_count = 1;
+    params.inode_growth_limit = INODE_LIMIT;
+    params.block_growth_limit = INODE_LIMIT;
+    params.open_files_growth_limit = INODE_LIMIT;
+    params.block_size = 4096; // room for every file in the root directory
+    assert(tfs_init(&params) != -1);
+
+    pthread_t tids[THREADS];
+    int firsts[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        firsts[i] = i * FILES_PER_THREAD;
+        assert(pthread_create(&tids[i], NULL, th_run, &firsts[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    // The tables stop growing at their limits
+    int created = THREADS * FILES_PER_THREAD;
+    char path[16];
+    for (;; created++) {
+        path_of(path, sizeof(path), created);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        if (fd == -1) {
+            break;
+        }
+        assert(tfs_close(fd) != -1);
+    }
+    assert(created == INODE_LIMIT - 1); // the root directory takes an inode
+
+    assert(tfs_destroy() != -1);
+
+    // Without limits, the tables keep their initial sizes
+    params.inode_growth_limit = 0;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/f1", TFS_O_CREAT) != -1);
+    assert(tfs_open("/f2", TFS_O_CREAT) == -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
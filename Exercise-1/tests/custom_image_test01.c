@@ -0,0 +1,61 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+char const image_path[] = "/tmp/tfs_custom_image_test01.img";
+char const file_contents[] = "SO PROJECT!!!";
+char f1[] = "/f1";
+char l1[] = "/l1";
+
+int main() {
+    unlink(image_path);
+
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+
+    // Create a new image and fill it
+    assert(tfs_init(&params) != -1);
+
+    int fd = tfs_open(f1, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, file_contents, sizeof(file_contents)) ==
+           sizeof(file_contents));
+    assert(tfs_close(fd) != -1);
+    assert(tfs_link(f1, l1) != -1);
+
+    assert(tfs_sync() != -1);
+    assert(tfs_destroy() != -1);
+
+    // Load it again, the contents must still be there
+    assert(tfs_init(&params) != -1);
+
+    fd = tfs_open(l1, 0);
+    assert(fd != -1);
+    char buffer[sizeof(file_contents)];
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, file_contents, sizeof(buffer)) == 0);
+    assert(tfs_close(fd) != -1);
+
+    // Hard link count survived, so the file outlives one unlink
+    assert(tfs_unlink(f1) != -1);
+    fd = tfs_open(l1, 0);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    // Files that are not images are rejected
+    FILE *junk = fopen(image_path, "w");
+    assert(junk != NULL);
+    assert(fputs("not an image", junk) != EOF);
+    assert(fclose(junk) == 0);
+    assert(tfs_init(&params) == -1);
+
+    unlink(image_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
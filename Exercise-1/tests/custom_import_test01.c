@@ -0,0 +1,158 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOCK (4096)
+#define DIRS (3)
+#define FILES_PER_DIR (20)
+
+char const root[] = "/tmp/tfs_custom_import_test01";
+
+void host_path(char *path, size_t size, char const *name) {
+    snprintf(path, size, "%s%s", root, name);
+}
+
+void host_write(char const *name, char const *contents, size_t len) {
+    char path[256];
+    host_path(path, sizeof(path), name);
+    FILE *f = fopen(path, "w");
+    assert(f != NULL);
+    assert(fwrite(contents, 1, len, f) == len);
+    assert(fclose(f) == 0);
+}
+
+void file_name(char *name, size_t size, int dir, int file) {
+    snprintf(name, size, "/d%d/f%d", dir, file);
+}
+
+void assert_file(char const *name, char const *contents, size_t len) {
+    static char buffer[2 * BLOCK];
+    int fd = tfs_open(name, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+void *th_create(void *arg) {
+    (void)arg;
+    char name[64];
+    for (int d = 0; d < DIRS; d++) {
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            file_name(name, sizeof(name), d, f);
+            int fd = tfs_open(name, TFS_O_CREAT);
+            assert(fd != -1);
+            assert(tfs_close(fd) != -1);
+        }
+    }
+    return NULL;
+}
+
+// Number of directory entries named as a file
+int listed(char const *name) {
+    tfs_dir_t dir;
+    assert(tfs_opendir("/", &dir) != -1);
+    tfs_dirent_t entries[16];
+    int found = 0;
+    ssize_t n;
+    while ((n = tfs_readdir(&dir, entries, 16)) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            found += strcmp(entries[i].name, name + 1) == 0;
+        }
+    }
+    assert(n == 0);
+    return found;
+}
+
+int main() {
+    // A host tree with DIRS directories of small files, an empty file, a
+    // file larger than a block, and a name too long for TécnicoFS
+    mkdir(root, 0700);
+    char path[256];
+    char name[64];
+    char contents[128];
+    for (int d = 0; d < DIRS; d++) {
+        snprintf(name, sizeof(name), "/d%d", d);
+        host_path(path, sizeof(path), name);
+        mkdir(path, 0700);
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            file_name(name, sizeof(name), d, f);
+            snprintf(contents, sizeof(contents), "contents of %s", name);
+            host_write(name, contents, strlen(contents));
+        }
+    }
+    host_write("/empty", "", 0);
+    static char large[2 * BLOCK];
+    memset(large, 'L', sizeof(large));
+    host_write("/large", large, sizeof(large));
+    char const long_name[] = "/a_name_too_long_to_fit_in_a_tfs_directory";
+    host_write(long_name, "x", 1);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.max_inode_count = 2 * DIRS * FILES_PER_DIR;
+    assert(tfs_init(&params) != -1);
+
+    // Existing files are overwritten
+    int fd = tfs_open("/empty", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "old", 3) == 3);
+    assert(tfs_close(fd) != -1);
+
+    // A missing tree cannot be imported
+    assert(tfs_import_tree("/tmp/tfs_custom_import_test01_missing", 0) == -1);
+
+    assert(tfs_import_tree(root, 4) == DIRS * FILES_PER_DIR + 2);
+    for (int d = 0; d < DIRS; d++) {
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            file_name(name, sizeof(name), d, f);
+            snprintf(contents, sizeof(contents), "contents of %s", name);
+            assert_file(name, contents, strlen(contents));
+        }
+    }
+    assert_file("/empty", "", 0);
+    assert_file("/large", large, BLOCK);
+    assert(tfs_open(long_name, 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    // Files created while the tree is imported are not listed twice
+    assert(tfs_init(&params) != -1);
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, th_create, NULL) == 0);
+    assert(tfs_import_tree(root, 4) != -1);
+    assert(pthread_join(tid, NULL) == 0);
+    for (int d = 0; d < DIRS; d++) {
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            file_name(name, sizeof(name), d, f);
+            assert(listed(name) == 1);
+        }
+    }
+    assert(tfs_destroy() != -1);
+
+    // Clean up the host tree
+    for (int d = 0; d < DIRS; d++) {
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            file_name(name, sizeof(name), d, f);
+            host_path(path, sizeof(path), name);
+            unlink(path);
+        }
+        snprintf(name, sizeof(name), "/d%d", d);
+        host_path(path, sizeof(path), name);
+        rmdir(path);
+    }
+    char const *others[] = {"/empty", "/large", long_name};
+    for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+        host_path(path, sizeof(path), others[i]);
+        unlink(path);
+    }
+    rmdir(root);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
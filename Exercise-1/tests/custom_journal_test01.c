@@ -0,0 +1,212 @@
+#include "../fs/journal.h"
+#include "../fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THREADS 8
+#define SMALL_RECORDS 8192
+#define SECTION_SIZE 8192
+#define CHURN_FILES 2
+#define CHURN_ROUNDS 800
+
+char const image_path[] = "/tmp/tfs_custom_journal_test01.img";
+char const journal_path[] = "/tmp/tfs_custom_journal_test01.img.journal";
+char const file_contents[] = "SO PROJECT!!!";
+
+void *th_create(void *arg) {
+    char path[16];
+    snprintf(path, sizeof(path), "/f%d", *(int *)arg);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, file_contents, sizeof(file_contents)) ==
+           sizeof(file_contents));
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+// Create and remove files of its own over and over, journaling enough for
+// checkpoints to happen meanwhile; only the even files are left
+void *th_churn(void *arg) {
+    int id = *(int *)arg;
+    char path[16];
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CHURN_FILES; i++) {
+            snprintf(path, sizeof(path), "/t%d_%d", id, i);
+            int fd = tfs_open(path, TFS_O_CREAT);
+            assert(fd != -1);
+            assert(tfs_close(fd) != -1);
+            if (round < CHURN_ROUNDS - 1 || i % 2 != 0) {
+                assert(tfs_unlink(path) != -1);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Wipe everything in the image but its header, as if no page had been
+// written back before the crash
+void lose_image_pages() {
+    int fd = open(image_path, O_RDWR);
+    assert(fd != -1);
+    struct stat st;
+    assert(fstat(fd, &st) != -1);
+
+    char zeros[4096];
+    memset(zeros, 0, sizeof(zeros));
+    off_t page = sysconf(_SC_PAGESIZE);
+    for (off_t pos = page; pos < st.st_size; pos += (off_t)sizeof(zeros)) {
+        assert(pwrite(fd, zeros, sizeof(zeros), pos) == sizeof(zeros));
+    }
+    assert(close(fd) != -1);
+}
+
+static int no_sync(void) { return 0; }
+
+// Many small records followed by a large one over the same bytes, enough of
+// them to be replayed in parallel: the large record must win everywhere
+void replay_overlapping(void) {
+    unlink(journal_path);
+    static char section[SECTION_SIZE];
+    assert(journal_open(journal_path, no_sync) != -1);
+    for (size_t i = 0; i < SMALL_RECORDS; i++) {
+        section[0] = (char)('a' + i % 26);
+        journal_log(0, i % SECTION_SIZE, section, 1);
+    }
+    memset(section, 'z', SECTION_SIZE);
+    journal_log(0, 0, section, SECTION_SIZE);
+    assert(journal_commit() != -1);
+    journal_close();
+
+    memset(section, 0, SECTION_SIZE);
+    void *const sections[] = {section};
+    size_t const sizes[] = {SECTION_SIZE};
+    assert(journal_open(journal_path, no_sync) != -1);
+    assert(journal_replay(sections, sizes, 1) == SMALL_RECORDS + 1);
+    journal_close();
+    for (size_t i = 0; i < SECTION_SIZE; i++) {
+        assert(section[i] == 'z');
+    }
+    unlink(journal_path);
+}
+
+int main() {
+    unlink(image_path);
+    unlink(journal_path);
+
+    replay_overlapping();
+
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+    params.journal = true;
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(&params) != -1);
+
+        pthread_t tids[THREADS];
+        int ids[THREADS];
+        for (int i = 0; i < THREADS; i++) {
+            ids[i] = i;
+            assert(pthread_create(&tids[i], NULL, th_create, &ids[i]) == 0);
+        }
+        for (int i = 0; i < THREADS; i++) {
+            assert(pthread_join(tids[i], NULL) == 0);
+        }
+        assert(tfs_link("/f0", "/l0") != -1);
+        assert(tfs_unlink("/f1") != -1);
+
+        // Crash without destroying (or syncing) TécnicoFS
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    lose_image_pages();
+
+    // Replaying the journal brings back every committed metadata update
+    assert(tfs_init(&params) != -1);
+
+    // The replayed records were checkpointed into the image
+    struct stat st;
+    assert(stat(journal_path, &st) != -1);
+    assert(st.st_size == 0);
+
+    for (int i = 0; i < THREADS; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "/f%d", i);
+        int fd = tfs_open(path, 0);
+        if (i == 1) {
+            assert(fd == -1);
+            continue;
+        }
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+
+    // The hard link count was journaled too
+    assert(tfs_unlink("/f0") != -1);
+    int fd = tfs_open("/l0", 0);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    unlink(image_path);
+    unlink(journal_path);
+
+    // Checkpoints taken while other threads update the FS lose none of their
+    // records
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(&params) != -1);
+        pthread_t tids[THREADS];
+        int ids[THREADS];
+        for (int i = 0; i < THREADS; i++) {
+            ids[i] = i;
+            assert(pthread_create(&tids[i], NULL, th_churn, &ids[i]) == 0);
+        }
+        for (int i = 0; i < THREADS; i++) {
+            assert(pthread_join(tids[i], NULL) == 0);
+        }
+        // Several MiB were journaled, but checkpoints kept the journal small
+        struct stat journal;
+        assert(stat(journal_path, &journal) != -1);
+        assert(journal.st_size < (2 << 20));
+        _exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // The image was synced by the checkpoints, so its pages are kept; the
+    // records since the last one are replayed over it
+    assert(tfs_init(&params) != -1);
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < CHURN_FILES; i++) {
+            char path[16];
+            snprintf(path, sizeof(path), "/t%d_%d", t, i);
+            fd = tfs_open(path, 0);
+            assert((fd != -1) == (i % 2 == 0));
+            if (fd != -1) {
+                assert(tfs_close(fd) != -1);
+            }
+        }
+    }
+    assert(tfs_destroy() != -1);
+
+    unlink(image_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
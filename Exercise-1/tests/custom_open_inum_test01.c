@@ -0,0 +1,79 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+char const contents[] = "cached identity";
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 4;
+    assert(tfs_init(&params) != -1);
+
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(fd) != -1);
+    assert(tfs_sym_link("/f1", "/l1") != -1);
+
+    // Through a symlink, the file it points to is reported
+    tfs_stat_t st;
+    assert(tfs_stat("/l1", &st) != -1);
+    tfs_stat_t file;
+    assert(tfs_stat("/f1", &file) != -1);
+    assert(st.inumber == file.inumber && st.generation == file.generation);
+    assert(file.type == TFS_DT_FILE);
+    assert(file.size == sizeof(contents));
+    assert(file.links == 1);
+    assert(!file.sealed);
+    assert(tfs_stat("/missing", &st) == -1);
+    assert(tfs_stat("bad", &st) == -1);
+
+    // Reopening by identity, as tfs_open does
+    char buffer[sizeof(contents)];
+    fd = tfs_open_inum(file.inumber, file.generation, TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, "!", 1) == 1);
+    assert(tfs_close(fd) != -1);
+    fd = tfs_open_inum(file.inumber, file.generation, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, contents, sizeof(contents)) == 0);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_open_inum(file.inumber, file.generation, TFS_O_CREAT) == -1);
+
+    // Only files can be opened
+    assert(tfs_open_inum(0, 0, 0) == -1); // the root directory
+    assert(tfs_open_inum(-1, 0, 0) == -1);
+    assert(tfs_open_inum(100, 0, 0) == -1);
+
+    // Once the file is deleted, its identity is stale, even if its inumber is
+    // reused (all other inumbers are taken)
+    assert(tfs_unlink("/l1") != -1);
+    assert(tfs_unlink("/f1") != -1);
+    assert(tfs_open_inum(file.inumber, file.generation, 0) == -1);
+    fd = tfs_open("/f2", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    fd = tfs_open("/f3", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    tfs_stat_t reused;
+    assert(tfs_stat("/f2", &reused) != -1);
+    if (reused.inumber != file.inumber) {
+        assert(tfs_stat("/f3", &reused) != -1);
+    }
+    assert(reused.inumber == file.inumber);
+    assert(reused.generation != file.generation);
+    assert(tfs_open_inum(file.inumber, file.generation, 0) == -1);
+    fd = tfs_open_inum(reused.inumber, reused.generation, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
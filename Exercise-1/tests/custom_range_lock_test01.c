@@ -0,0 +1,103 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK (1024)
+#define WRITERS (4)
+#define REGION (BLOCK / WRITERS)
+#define ROUNDS (50)
+
+char const path[] = "/f1";
+
+// Each region holds a single character, written whole by its own thread
+void assert_regions(char const *contents) {
+    for (size_t r = 0; r < WRITERS; r++) {
+        for (size_t i = 1; i < REGION; i++) {
+            assert(contents[r * REGION + i] == contents[r * REGION]);
+        }
+    }
+}
+
+void read_file(char const *name, char *contents) {
+    int fd = tfs_open(name, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, contents, BLOCK) == BLOCK);
+    assert(tfs_close(fd) != -1);
+}
+
+void *th_write(void *arg) {
+    size_t region = *(size_t *)arg;
+    char data[REGION];
+    for (int i = 0; i < ROUNDS; i++) {
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+        for (size_t r = 0; r < region; r++) {
+            assert(tfs_read(fd, data, REGION) == REGION); // skip to the region
+        }
+        memset(data, 'a' + i % 26, REGION);
+        assert(tfs_write(fd, data, REGION) == REGION);
+        assert(tfs_close(fd) != -1);
+    }
+    return NULL;
+}
+
+void *th_read(void *arg) {
+    (void)arg;
+    char contents[BLOCK];
+    for (int i = 0; i < ROUNDS; i++) {
+        read_file(path, contents);
+        assert_regions(contents);
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = WRITERS + 4;
+    assert(tfs_init(&params) != -1);
+
+    char contents[BLOCK];
+    memset(contents, '-', BLOCK);
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, BLOCK) == BLOCK);
+    assert(tfs_close(fd) != -1);
+
+    // Writers of different regions of the file, readers of all of it, and a
+    // clone taken meanwhile: no one sees a region half written
+    pthread_t writers[WRITERS];
+    size_t regions[WRITERS];
+    for (size_t i = 0; i < WRITERS; i++) {
+        regions[i] = i;
+        assert(pthread_create(&writers[i], NULL, th_write, &regions[i]) == 0);
+    }
+    pthread_t reader;
+    assert(pthread_create(&reader, NULL, th_read, NULL) == 0);
+
+    assert(tfs_clone(path, "/clone") != -1);
+    char cloned[BLOCK];
+    read_file("/clone", cloned);
+    assert_regions(cloned);
+
+    for (size_t i = 0; i < WRITERS; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+    }
+    assert(pthread_join(reader, NULL) == 0);
+
+    // Every region ends with its last write, and the clone did not change
+    read_file(path, contents);
+    for (size_t r = 0; r < WRITERS; r++) {
+        assert(contents[r * REGION] == 'a' + (ROUNDS - 1) % 26);
+    }
+    assert_regions(contents);
+    read_file("/clone", contents);
+    assert(memcmp(contents, cloned, BLOCK) == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK (1024)
+#define CHUNK (16)
+
+char const path[] = "/f1";
+
+void fill(char *buffer, char c) {
+    for (size_t i = 0; i < BLOCK; i++) {
+        buffer[i] = (char)(c + (char)(i % 16));
+    }
+}
+
+int main() {
+    char contents[BLOCK];
+    fill(contents, 'a');
+    char chunk[CHUNK];
+
+    assert(tfs_init(NULL) != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, BLOCK) == BLOCK);
+    assert(tfs_close(fd) != -1);
+
+    // A file streamed in small chunks reads back whole
+    int reader = tfs_open(path, 0);
+    assert(reader != -1);
+    for (size_t off = 0; off < BLOCK / 2; off += CHUNK) {
+        assert(tfs_read(reader, chunk, CHUNK) == CHUNK);
+        assert(memcmp(chunk, contents + off, CHUNK) == 0);
+    }
+
+    // Writes through other handles are seen by the next read, even where
+    // the reader already read ahead
+    int writer = tfs_open(path, 0);
+    assert(writer != -1);
+    fill(contents, 'A');
+    assert(tfs_write(writer, contents, BLOCK) == BLOCK);
+    assert(tfs_close(writer) != -1);
+    for (size_t off = BLOCK / 2; off < BLOCK; off += CHUNK) {
+        assert(tfs_read(reader, chunk, CHUNK) == CHUNK);
+        assert(memcmp(chunk, contents + off, CHUNK) == 0);
+    }
+    assert(tfs_read(reader, chunk, CHUNK) == 0);
+    assert(tfs_close(reader) != -1);
+
+    // So are writes that move the file to a new block (shared with a clone)
+    reader = tfs_open(path, 0);
+    assert(reader != -1);
+    assert(tfs_read(reader, chunk, CHUNK) == CHUNK);
+    assert(tfs_clone(path, "/clone") != -1);
+    writer = tfs_open(path, 0);
+    assert(writer != -1);
+    fill(contents, '0');
+    assert(tfs_write(writer, contents, BLOCK) == BLOCK);
+    assert(tfs_close(writer) != -1);
+    assert(tfs_read(reader, chunk, CHUNK) == CHUNK);
+    assert(memcmp(chunk, contents + CHUNK, CHUNK) == 0);
+    assert(tfs_close(reader) != -1);
+
+    // A file that grows is read up to its new end
+    fd = tfs_open("/grows", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, CHUNK) == CHUNK);
+    reader = tfs_open("/grows", 0);
+    assert(reader != -1);
+    assert(tfs_read(reader, chunk, CHUNK / 2) == CHUNK / 2);
+    assert(tfs_write(fd, contents + CHUNK, CHUNK) == CHUNK);
+    char rest[2 * CHUNK];
+    assert(tfs_read(reader, rest, sizeof(rest)) == CHUNK + CHUNK / 2);
+    assert(memcmp(rest, contents + CHUNK / 2, CHUNK + CHUNK / 2) == 0);
+    assert(tfs_close(reader) != -1);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define STABLE_FILES (40)
+#define CHURN_FILES (20)
+#define BATCH (7)
+
+void path_of(char *path, size_t size, char const *prefix, int id) {
+    snprintf(path, size, "/%s%d", prefix, id);
+}
+
+void create_file(char const *path, char const *contents) {
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, strlen(contents)) ==
+           (ssize_t)strlen(contents));
+    assert(tfs_close(fd) != -1);
+}
+
+// Count how many times each stable file is listed
+void list_stable(tfs_dir_t *dir, int *seen) {
+    memset(seen, 0, STABLE_FILES * sizeof(int));
+    tfs_dirent_t entries[BATCH];
+    ssize_t n;
+    while ((n = tfs_readdir(dir, entries, BATCH)) > 0) {
+        assert(n <= BATCH);
+        for (ssize_t i = 0; i < n; i++) {
+            int id;
+            if (sscanf(entries[i].name, "s%d", &id) == 1) {
+                assert(id >= 0 && id < STABLE_FILES);
+                assert(entries[i].type == TFS_DT_FILE);
+                assert(entries[i].size == strlen(entries[i].name));
+                seen[id]++;
+            }
+        }
+    }
+    assert(n == 0);
+}
+
+void *th_churn(void *arg) {
+    (void)arg;
+    char path[16];
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < CHURN_FILES; i++) {
+            path_of(path, sizeof(path), "c", i);
+            create_file(path, "churn");
+        }
+        for (int i = 0; i < CHURN_FILES; i++) {
+            path_of(path, sizeof(path), "c", i);
+            assert(tfs_unlink(path) != -1);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 128;
+    params.max_block_count = 128;
+    params.block_size = 4096; // room for every file in the root directory
+    assert(tfs_init(&params) != -1);
+
+    char path[16];
+    for (int i = 0; i < STABLE_FILES; i++) {
+        path_of(path, sizeof(path), "s", i);
+        create_file(path, path + 1); // contents: the name, and its size
+    }
+    assert(tfs_sym_link("/s0", "/link") != -1);
+
+    // Types and sizes are reported along with the names
+    tfs_dir_t dir;
+    assert(tfs_opendir("/nodir", &dir) == -1);
+    assert(tfs_opendir("/", &dir) != -1);
+    tfs_dirent_t entries[STABLE_FILES + 1];
+    assert(tfs_readdir(&dir, entries, STABLE_FILES + 1) == STABLE_FILES + 1);
+    assert(strcmp(entries[STABLE_FILES].name, "link") == 0);
+    assert(entries[STABLE_FILES].type == TFS_DT_SYMLINK);
+
+    // Entries identify files as tfs_stat does, to reopen them by inumber
+    for (int i = 0; i < STABLE_FILES; i++) {
+        tfs_stat_t stat;
+        path_of(path, sizeof(path), "s", i);
+        assert(strcmp(entries[i].name, path + 1) == 0);
+        assert(tfs_stat(path, &stat) != -1);
+        assert(entries[i].inumber == stat.inumber);
+        assert(entries[i].generation == stat.generation);
+        int fd = tfs_open_inum(entries[i].inumber, entries[i].generation, 0);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+    assert(tfs_readdir(&dir, entries, STABLE_FILES + 1) == 0);
+
+    // Files that stay put are listed exactly once, despite concurrent
+    // creates and unlinks
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, th_churn, NULL) == 0);
+    int seen[STABLE_FILES];
+    for (int round = 0; round < 20; round++) {
+        assert(tfs_opendir("/", &dir) != -1);
+        list_stable(&dir, seen);
+        for (int i = 0; i < STABLE_FILES; i++) {
+            assert(seen[i] == 1);
+        }
+    }
+    assert(pthread_join(tid, NULL) == 0);
+
+    // Snapshots can be listed too, until they are deleted
+    int snapshot = tfs_snapshot();
+    assert(snapshot != -1);
+    assert(tfs_unlink("/s1") != -1);
+    assert(tfs_snapshot_opendir(snapshot, &dir) != -1);
+    list_stable(&dir, seen);
+    assert(seen[1] == 1);
+    assert(tfs_snapshot_opendir(snapshot, &dir) != -1);
+    assert(tfs_snapshot_delete(snapshot) != -1);
+    assert(tfs_readdir(&dir, entries, 1) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK (1024)
+
+char contents[BLOCK];
+
+// Receive data written to a pipe into a file
+ssize_t receive(int fhandle, char const *data, size_t len, size_t max) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], data, len) == (ssize_t)len);
+    assert(close(fds[1]) == 0);
+    ssize_t received = tfs_recvfile(fds[0], fhandle, max);
+    assert(close(fds[0]) == 0);
+    return received;
+}
+
+typedef struct {
+    int in;
+    int fhandle;
+    ssize_t received;
+} receiver_t;
+
+void *th_receive(void *arg) {
+    receiver_t *receiver = arg;
+    receiver->received = tfs_recvfile(receiver->in, receiver->fhandle, BLOCK);
+    return NULL;
+}
+
+void assert_file(char const *name, char const *expected, size_t len) {
+    char buffer[BLOCK];
+    int fd = tfs_open(name, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, BLOCK) == (ssize_t)len);
+    assert(memcmp(buffer, expected, len) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+void run(tfs_params params) {
+    assert(tfs_init(&params) != -1);
+
+    // The input ends before an empty file gets any data
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(receive(fd, "", 0, BLOCK) == 0);
+    assert_file("/f1", "", 0);
+
+    // Received data lands at the offset, after what was written before
+    assert(tfs_write(fd, contents, 100) == 100);
+    assert(receive(fd, contents + 100, 200, BLOCK) == 200);
+    assert(receive(fd, contents + 300, 200, 50) == 50);
+    assert_file("/f1", contents, 350);
+
+    // Up to the end of the block
+    assert(receive(fd, contents + 350, BLOCK, BLOCK) == BLOCK - 350);
+    assert_file("/f1", contents, BLOCK);
+    assert(receive(fd, contents, 10, 10) == 0);
+    assert(tfs_close(fd) != -1);
+
+    // Writes buffered before come first, and clones keep their contents
+    assert(tfs_clone("/f1", "/clone") != -1);
+    fd = tfs_open("/f1", TFS_O_TRUNC | TFS_O_BUFFERED);
+    assert(fd != -1);
+    assert(tfs_write(fd, "head:", 5) == 5);
+    assert(receive(fd, "tail", 4, BLOCK) == 4);
+    assert(tfs_close(fd) != -1);
+    assert_file("/f1", "head:tail", 9);
+    assert_file("/clone", contents, BLOCK);
+
+    // Bad descriptors and file handles
+    fd = tfs_open("/f1", TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_recvfile(-1, fd, BLOCK) == -1);
+    assert(receive(fd, "!", 1, BLOCK) == 1);
+    assert(tfs_close(fd) != -1);
+    assert_file("/f1", "head:tail!", 10);
+    assert(receive(fd, "x", 1, BLOCK) == -1);
+
+    // A descriptor that blocks holds off no other user of the file
+    int fds[2];
+    assert(pipe(fds) == 0);
+    receiver_t receiver = {.in = fds[0]};
+    receiver.fhandle = tfs_open("/f2", TFS_O_CREAT);
+    assert(receiver.fhandle != -1);
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, th_receive, &receiver) == 0);
+    fd = tfs_open("/f2", 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, "xy", 2) == 2);
+    assert(tfs_close(fd) != -1);
+    assert_file("/f2", "xy", 2);
+    assert(write(fds[1], "abc", 3) == 3);
+    assert(close(fds[1]) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(receiver.received == 3);
+    assert(close(fds[0]) == 0);
+    assert(tfs_close(receiver.fhandle) != -1);
+    assert_file("/f2", "abc", 3);
+
+    // Data that no longer fits once the receiver wakes up is not counted
+    assert(pipe(fds) == 0);
+    receiver.in = fds[0];
+    receiver.fhandle = tfs_open("/f3", TFS_O_CREAT | TFS_O_APPEND);
+    assert(receiver.fhandle != -1);
+    assert(pthread_create(&tid, NULL, th_receive, &receiver) == 0);
+    struct timespec wait = {.tv_nsec = 50000000}; // for the receiver to block
+    nanosleep(&wait, NULL);
+    fd = tfs_open("/f3", TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, BLOCK - 2) == BLOCK - 2);
+    assert(tfs_close(fd) != -1);
+    assert(write(fds[1], "0123456789", 10) == 10);
+    assert(close(fds[1]) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(receiver.received == 2);
+    assert(close(fds[0]) == 0);
+    assert(tfs_close(receiver.fhandle) != -1);
+    char expected[BLOCK];
+    memcpy(expected, contents, BLOCK - 2);
+    memcpy(expected + BLOCK - 2, "01", 2);
+    assert_file("/f3", expected, BLOCK);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < BLOCK; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    run(params);
+    params.checksums = true;
+    run(params);
+    params.checksums = false;
+    params.compression = true;
+    run(params);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK (64 * 1024)
+#define FILES (200)
+
+// Resident memory of this process, in bytes
+size_t resident_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    assert(statm != NULL);
+    size_t size, resident;
+    assert(fscanf(statm, "%zu %zu", &size, &resident) == 2);
+    fclose(statm);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void path_of(char *path, size_t size, int id) {
+    snprintf(path, size, "/f%d", id);
+}
+
+void write_file(int id, char const *contents) {
+    char path[16];
+    path_of(path, sizeof(path), id);
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, BLOCK) == BLOCK);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    static char contents[BLOCK];
+    static char buffer[BLOCK];
+    memset(contents, 'x', BLOCK);
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = FILES + 1;
+    params.max_block_count = FILES + 1;
+    params.block_size = BLOCK;
+    assert(tfs_init(&params) != -1);
+
+    size_t empty = resident_bytes();
+    for (int i = 0; i < FILES; i++) {
+        write_file(i, contents);
+    }
+    size_t full = resident_bytes();
+    assert(full - empty >= FILES / 2 * BLOCK);
+
+    // The memory of deleted files goes back to the OS
+    for (int i = 0; i < FILES; i++) {
+        char path[16];
+        path_of(path, sizeof(path), i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(resident_bytes() < full - FILES / 2 * BLOCK);
+
+    // Released blocks are reused as usual
+    memset(contents, 'y', BLOCK);
+    for (int i = 0; i < FILES; i++) {
+        write_file(i, contents);
+    }
+    int fd = tfs_open("/f7", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, BLOCK) == BLOCK);
+    assert(memcmp(buffer, contents, BLOCK) == 0);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define VERSIONS (200)
+#define VERSION_SIZE (32)
+#define RACES (2000)
+
+void write_file(char const *path, char const *contents, size_t len) {
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, len) == len);
+    assert(tfs_close(fd) != -1);
+}
+
+ssize_t read_file(char const *path, char *buffer, size_t len) {
+    int fd = tfs_open(path, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t r = tfs_read(fd, buffer, len);
+    assert(tfs_close(fd) != -1);
+    return r;
+}
+
+// Build each version under a temporary name, then publish it
+void *th_publish(void *arg) {
+    (void)arg;
+    char version[VERSION_SIZE];
+    for (int i = 1; i <= VERSIONS; i++) {
+        memset(version, 0, sizeof(version));
+        snprintf(version, sizeof(version), "version %d", i);
+        write_file("/current.tmp", version, sizeof(version));
+        assert(tfs_rename("/current.tmp", "/current", 0) != -1);
+    }
+    return NULL;
+}
+
+bool replaced_all;
+
+// Keep replacing /y with a new file
+void *th_replace(void *arg) {
+    (void)arg;
+    for (int i = 0; i < RACES; i++) {
+        write_file("/x", "X", 2);
+        assert(tfs_rename("/x", "/y", 0) != -1);
+    }
+    __atomic_store_n(&replaced_all, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Keep unlinking /y, whichever file it links to
+void *th_unlink(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&replaced_all, __ATOMIC_ACQUIRE)) {
+        tfs_unlink("/y");
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+    char buffer[VERSION_SIZE];
+
+    // Rename in place
+    write_file("/a", "A", 2);
+    assert(tfs_rename("/a", "/b", 0) != -1);
+    assert(tfs_open("/a", 0) == -1);
+    assert(read_file("/b", buffer, sizeof(buffer)) == 2);
+    assert(strcmp(buffer, "A") == 0);
+
+    // Replace an existing file, unless asked not to
+    write_file("/c", "C", 2);
+    assert(tfs_rename("/b", "/c", TFS_RENAME_NOREPLACE) == -1);
+    assert(read_file("/b", buffer, sizeof(buffer)) == 2);
+    assert(tfs_rename("/b", "/c", 0) != -1);
+    assert(tfs_open("/b", 0) == -1);
+    assert(read_file("/c", buffer, sizeof(buffer)) == 2);
+    assert(strcmp(buffer, "A") == 0);
+
+    // Replacing a hard link only drops that link
+    write_file("/d", "D", 2);
+    assert(tfs_link("/d", "/e") != -1);
+    assert(tfs_rename("/c", "/e", 0) != -1);
+    assert(read_file("/d", buffer, sizeof(buffer)) == 2);
+    assert(strcmp(buffer, "D") == 0);
+    assert(read_file("/e", buffer, sizeof(buffer)) == 2);
+    assert(strcmp(buffer, "A") == 0);
+
+    // Two links to the same file are left alone
+    assert(tfs_link("/d", "/f") != -1);
+    assert(tfs_rename("/d", "/f", 0) != -1);
+    assert(read_file("/d", buffer, sizeof(buffer)) == 2);
+    assert(read_file("/f", buffer, sizeof(buffer)) == 2);
+
+    // Errors
+    assert(tfs_rename("/missing", "/g", 0) == -1);
+    assert(tfs_rename("/d", "", 0) == -1);
+    char long_name[MAX_FILE_NAME + 2] = "/";
+    memset(long_name + 1, 'x', MAX_FILE_NAME);
+    assert(tfs_rename("/d", long_name, 0) == -1);
+
+    // The final name never goes missing, nor shows up twice, while new
+    // versions are swapped in
+    write_file("/current", "version 0", sizeof("version 0"));
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, th_publish, NULL) == 0);
+    for (int round = 0; round < VERSIONS; round++) {
+        tfs_dir_t dir;
+        assert(tfs_opendir("/", &dir) != -1);
+        tfs_dirent_t entries[16];
+        ssize_t n = tfs_readdir(&dir, entries, 16);
+        int found = 0;
+        for (ssize_t i = 0; i < n; i++) {
+            found += strcmp(entries[i].name, "current") == 0;
+        }
+        assert(found <= 1);
+
+        int fd = tfs_open("/current", 0);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+    assert(pthread_join(tid, NULL) == 0);
+    assert(read_file("/current", buffer, sizeof(buffer)) == VERSION_SIZE);
+    assert(strcmp(buffer, "version 200") == 0);
+    assert(tfs_open("/current.tmp", 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    // The renamed entry keeps its slot, so a listing in progress still
+    // visits it after it replaced an entry the listing already went past
+    assert(tfs_init(NULL) != -1);
+    write_file("/p", "P", 2);
+    write_file("/q", "Q", 2);
+    tfs_dir_t dir;
+    assert(tfs_opendir("/", &dir) != -1);
+    tfs_dirent_t entry;
+    assert(tfs_readdir(&dir, &entry, 1) == 1);
+    assert(strcmp(entry.name, "p") == 0);
+    assert(tfs_rename("/q", "/p", 0) != -1);
+    assert(tfs_readdir(&dir, &entry, 1) == 1);
+    assert(strcmp(entry.name, "p") == 0);
+    assert(tfs_readdir(&dir, &entry, 1) == 0);
+    assert(read_file("/p", buffer, sizeof(buffer)) == 2);
+    assert(strcmp(buffer, "Q") == 0);
+
+    assert(tfs_destroy() != -1);
+
+    // Replacing a file that is being unlinked drops each link once: files
+    // neither leak (which would run out of inodes) nor are deleted twice
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 8;
+    assert(tfs_init(&params) != -1);
+    pthread_t replacer, unlinker;
+    assert(pthread_create(&replacer, NULL, th_replace, NULL) == 0);
+    assert(pthread_create(&unlinker, NULL, th_unlink, NULL) == 0);
+    assert(pthread_join(replacer, NULL) == 0);
+    assert(pthread_join(unlinker, NULL) == 0);
+    tfs_unlink("/y");
+    // Every inode but the root directory's is free again
+    for (size_t i = 1; i < params.max_inode_count; i++) {
+        snprintf(buffer, sizeof(buffer), "/%zu", i);
+        write_file(buffer, "N", 2);
+    }
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK (1024)
+#define READERS (4)
+
+char contents[BLOCK];
+
+void *th_read(void *arg) {
+    (void)arg;
+    char buffer[BLOCK];
+    for (int i = 0; i < 100; i++) {
+        int fd = tfs_open("/full", 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, buffer, 100) == 100);
+        assert(tfs_read(fd, buffer + 100, BLOCK) == BLOCK - 100);
+        assert(memcmp(buffer, contents, BLOCK) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    for (size_t i = 0; i < BLOCK; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    assert(tfs_init(&params) != -1);
+
+    // Buffered writes are flushed before sealing
+    int fd = tfs_open("/sealed", TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, BLOCK / 2) == BLOCK / 2);
+    assert(tfs_write(fd, contents + BLOCK / 2, BLOCK / 4) == BLOCK / 4);
+    void const *view;
+    assert(tfs_view(fd, &view) == -1); // not sealed yet
+    assert(tfs_seal(fd) != -1);
+    assert(tfs_seal(fd) != -1);
+    assert(tfs_write(fd, contents + 3 * BLOCK / 4, BLOCK / 4) == -1);
+    assert(tfs_close(fd) != -1);
+
+    // No handle can change it anymore
+    fd = tfs_open("/sealed", TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, "x", 1) == -1);
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], "x", 1) == 1);
+    assert(tfs_recvfile(fds[0], fd, 1) == -1);
+    assert(close(fds[0]) == 0 && close(fds[1]) == 0);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_open("/sealed", TFS_O_TRUNC) == -1);
+    assert(tfs_unlink("/sealed") == -1);
+    fd = tfs_open("/other", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_rename("/other", "/sealed", 0) == -1);
+
+    // ...but its clones can be changed, and it can be moved and linked
+    assert(tfs_clone("/sealed", "/clone") != -1);
+    fd = tfs_open("/clone", TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents + 3 * BLOCK / 4, BLOCK / 4) == BLOCK / 4);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_rename("/sealed", "/moved", 0) != -1);
+    assert(tfs_link("/moved", "/sealed") != -1);
+
+    // Its contents can be viewed in place, and sent out
+    fd = tfs_open("/sealed", 0);
+    assert(fd != -1);
+    assert(tfs_view(fd, &view) == 3 * BLOCK / 4);
+    assert(memcmp(view, contents, 3 * BLOCK / 4) == 0);
+    assert(pipe(fds) == 0);
+    assert(tfs_sendfile(fd, fds[1], 10, BLOCK) == 3 * BLOCK / 4 - 10);
+    char buffer[BLOCK];
+    assert(read(fds[0], buffer, BLOCK) == 3 * BLOCK / 4 - 10);
+    assert(memcmp(buffer, contents + 10, 3 * BLOCK / 4 - 10) == 0);
+    assert(close(fds[0]) == 0 && close(fds[1]) == 0);
+    assert(tfs_close(fd) != -1);
+
+    // Concurrent readers of a full sealed file
+    fd = tfs_open("/clone", 0);
+    assert(fd != -1);
+    assert(tfs_seal(fd) != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_rename("/clone", "/full", 0) != -1);
+    assert(tfs_unlink("/sealed") == -1);
+    assert(tfs_link("/full", "/sealed2") != -1);
+    pthread_t tid[READERS];
+    for (size_t i = 0; i < READERS; i++) {
+        assert(pthread_create(&tid[i], NULL, th_read, NULL) == 0);
+    }
+    for (size_t i = 0; i < READERS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
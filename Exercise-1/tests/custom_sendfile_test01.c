@@ -0,0 +1,149 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK (1024)
+#define SUBSCRIBERS (4)
+
+char contents[BLOCK];
+int fhandle;
+
+// Send a part of the file through a pipe, and check what comes out
+void assert_sent(size_t offset, size_t len, size_t expected) {
+    char buffer[BLOCK];
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(tfs_sendfile(fhandle, fds[1], offset, len) == (ssize_t)expected);
+    assert(close(fds[1]) == 0);
+    size_t got = 0;
+    ssize_t r;
+    while ((r = read(fds[0], buffer + got, BLOCK - got)) > 0) {
+        got += (size_t)r;
+    }
+    assert(r == 0);
+    assert(close(fds[0]) == 0);
+    assert(got == expected);
+    assert(memcmp(buffer, contents + offset, expected) == 0);
+}
+
+// Each subscriber gets its own slices of the file, through the same handle
+void *th_subscriber(void *arg) {
+    size_t slice = BLOCK / SUBSCRIBERS;
+    size_t offset = *(size_t *)arg * slice;
+    for (int i = 0; i < 50; i++) {
+        assert_sent(offset, slice, slice);
+    }
+    return NULL;
+}
+
+// Send the whole file into a pipe that is full, which blocks
+void *th_blocked(void *arg) {
+    int out = *(int *)arg;
+    assert(tfs_sendfile(fhandle, out, 0, BLOCK) == BLOCK);
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    assert(tfs_init(&params) != -1);
+
+    for (size_t i = 0; i < BLOCK; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+    fhandle = tfs_open("/f1", TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(fhandle != -1);
+
+    // Buffered writes not yet flushed are sent too
+    assert(tfs_write(fhandle, contents, BLOCK / 2) == BLOCK / 2);
+    assert_sent(0, BLOCK, BLOCK / 2);
+    assert(tfs_write(fhandle, contents + BLOCK / 2, BLOCK / 2) == BLOCK / 2);
+    assert_sent(0, BLOCK, BLOCK);
+
+    // Parts of the file, clamped to its end
+    assert_sent(10, 20, 20);
+    assert_sent(BLOCK - 5, 100, 5);
+    assert_sent(BLOCK, 100, 0);
+    assert_sent(2 * BLOCK, 100, 0);
+
+    // Many subscribers at once
+    pthread_t tid[SUBSCRIBERS];
+    size_t slices[SUBSCRIBERS];
+    for (size_t i = 0; i < SUBSCRIBERS; i++) {
+        slices[i] = i;
+        assert(pthread_create(&tid[i], NULL, th_subscriber, &slices[i]) == 0);
+    }
+    for (size_t i = 0; i < SUBSCRIBERS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    // The offset of the handle did not move
+    char buffer[BLOCK];
+    assert(tfs_read(fhandle, buffer, BLOCK) == 0);
+    assert(tfs_close(fhandle) != -1);
+    fhandle = tfs_open("/f1", 0);
+    assert(fhandle != -1);
+    assert(tfs_read(fhandle, buffer, 10) == 10);
+    assert_sent(0, 10, 10);
+    assert(tfs_read(fhandle, buffer, 10) == 10);
+    assert(memcmp(buffer, contents + 10, 10) == 0);
+
+    // A descriptor that blocks holds off no writer of the file
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+    size_t filler = 0;
+    ssize_t w;
+    while ((w = write(fds[1], buffer, sizeof(buffer))) > 0) {
+        filler += (size_t)w;
+    }
+    assert(errno == EAGAIN);
+    assert(fcntl(fds[1], F_SETFL, 0) == 0);
+    pthread_t blocked;
+    assert(pthread_create(&blocked, NULL, th_blocked, &fds[1]) == 0);
+    struct timespec wait = {.tv_nsec = 50000000}; // for the sender to block
+    nanosleep(&wait, NULL);
+    int writer = tfs_open("/f1", 0);
+    assert(writer != -1);
+    char changed[BLOCK / 2];
+    memset(changed, 'Z', sizeof(changed));
+    assert(tfs_write(writer, changed, sizeof(changed)) == sizeof(changed));
+    for (size_t left = filler; left > 0;) {
+        ssize_t got = read(fds[0], buffer,
+                           left < sizeof(buffer) ? left : sizeof(buffer));
+        assert(got > 0);
+        left -= (size_t)got;
+    }
+    // What was sent is the file from before the write
+    for (size_t got = 0; got < BLOCK;) {
+        ssize_t r = read(fds[0], buffer + got, BLOCK - got);
+        assert(r > 0);
+        got += (size_t)r;
+    }
+    assert(memcmp(buffer, contents, BLOCK) == 0);
+    assert(pthread_join(blocked, NULL) == 0);
+    assert(tfs_sendfile(writer, fds[1], 0, sizeof(changed)) ==
+           sizeof(changed));
+    assert(read(fds[0], buffer, sizeof(buffer)) == sizeof(changed));
+    assert(memcmp(buffer, changed, sizeof(changed)) == 0);
+    assert(tfs_close(writer) != -1);
+    assert(close(fds[0]) == 0);
+    assert(close(fds[1]) == 0);
+
+    // Bad file handles and descriptors
+    assert(tfs_sendfile(fhandle, -1, 0, BLOCK) == -1);
+    assert(tfs_close(fhandle) != -1);
+    assert(tfs_sendfile(fhandle, STDOUT_FILENO, 0, BLOCK) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
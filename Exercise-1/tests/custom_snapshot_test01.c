@@ -0,0 +1,66 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+char const file_contents[] = "SO PROJECT!!!";
+char const new_contents[] = "CHANGED";
+char f1[] = "/f1";
+char f2[] = "/f2";
+char l1[] = "/l1";
+
+void write_contents(char const *path, char const *contents, size_t len,
+                    tfs_file_mode_t mode) {
+    int fd = tfs_open(path, mode);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, len) == len);
+    assert(tfs_close(fd) != -1);
+}
+
+void assert_contents(int fd, char const *contents, size_t len) {
+    assert(fd != -1);
+    char buffer[64];
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 5;
+    assert(tfs_init(&params) != -1);
+
+    write_contents(f1, file_contents, sizeof(file_contents), TFS_O_CREAT);
+    assert(tfs_link(f1, l1) != -1);
+
+    int snapshot = tfs_snapshot();
+    assert(snapshot != -1);
+
+    // Change the live FS
+    write_contents(f1, new_contents, sizeof(new_contents), TFS_O_TRUNC);
+    write_contents(f2, new_contents, sizeof(new_contents), TFS_O_CREAT);
+
+    // The snapshot still sees the old contents, under every name
+    assert_contents(tfs_snapshot_open(snapshot, f1, 0), file_contents,
+                    sizeof(file_contents));
+    assert_contents(tfs_snapshot_open(snapshot, l1, 0), file_contents,
+                    sizeof(file_contents));
+    assert(tfs_snapshot_open(snapshot, f2, 0) == -1);
+    assert(tfs_snapshot_open(snapshot, f2, TFS_O_CREAT) == -1);
+    assert(tfs_snapshot_open(12345, f1, 0) == -1);
+
+    // The live FS sees the new ones
+    assert_contents(tfs_open(l1, 0), new_contents, sizeof(new_contents));
+
+    // Deleting the snapshot releases the block only it used
+    assert(tfs_snapshot_delete(snapshot) != -1);
+    assert(tfs_snapshot_delete(snapshot) == -1);
+    write_contents("/f3", file_contents, sizeof(file_contents),
+                   TFS_O_CREAT);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
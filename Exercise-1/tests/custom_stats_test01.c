@@ -0,0 +1,96 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS (4)
+#define WRITES (10)
+
+void *th_write(void *arg) {
+    char const *name = arg;
+    int fd = tfs_open(name, TFS_O_CREAT);
+    assert(fd != -1);
+    for (int i = 0; i < WRITES; i++) {
+        assert(tfs_write(fd, "0123456789", 10) == 10);
+    }
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 16;
+    params.max_block_count = 16;
+    params.max_open_files_count = 8;
+    assert(tfs_init(&params) != -1);
+
+    tfs_stats_t before;
+    assert(tfs_get_stats(&before) != -1);
+    assert(tfs_get_stats(NULL) == -1);
+    assert(before.inodes_used == 1 && before.inodes_total == 16);
+    assert(before.blocks_used == 1 && before.blocks_total == 16);
+    assert(before.open_files_used == 0 && before.open_files_total == 8);
+
+    // Counts from threads that are gone are kept
+    char names[THREADS][8];
+    pthread_t tid[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        snprintf(names[i], sizeof(names[i]), "/f%d", i);
+        assert(pthread_create(&tid[i], NULL, th_write, names[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    int fd = tfs_open("/f0", 0);
+    assert(fd != -1);
+    char buffer[40];
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_link("/f0", "/h0") != -1);
+    assert(tfs_sym_link("/f0", "/s0") != -1);
+    assert(tfs_unlink("/h0") != -1);
+    assert(tfs_unlink("/missing") == -1);
+
+    tfs_stats_t after;
+    assert(tfs_get_stats(&after) != -1);
+    assert(after.op_calls[TFS_OP_OPEN] - before.op_calls[TFS_OP_OPEN] ==
+           THREADS + 1);
+    assert(after.op_calls[TFS_OP_WRITE] - before.op_calls[TFS_OP_WRITE] ==
+           THREADS * WRITES);
+    assert(after.op_bytes[TFS_OP_WRITE] - before.op_bytes[TFS_OP_WRITE] ==
+           THREADS * WRITES * 10);
+    assert(after.op_calls[TFS_OP_READ] - before.op_calls[TFS_OP_READ] == 2);
+    assert(after.op_bytes[TFS_OP_READ] - before.op_bytes[TFS_OP_READ] ==
+           2 * sizeof(buffer));
+    assert(after.op_calls[TFS_OP_LINK] - before.op_calls[TFS_OP_LINK] == 2);
+    assert(after.op_calls[TFS_OP_UNLINK] - before.op_calls[TFS_OP_UNLINK] ==
+           2);
+    assert(after.op_calls[TFS_OP_LOOKUP] > before.op_calls[TFS_OP_LOOKUP]);
+    assert(after.lookup_scanned > before.lookup_scanned);
+
+    // Files and the symlink, each with an inode and a block
+    assert(after.inodes_used == 1 + THREADS + 1);
+    assert(after.blocks_used == 1 + THREADS + 1);
+    assert(after.open_files_used == 1);
+    assert(after.inode_allocs - before.inode_allocs == THREADS + 1);
+    assert(after.inode_alloc_scanned > before.inode_alloc_scanned);
+    assert(after.block_allocs - before.block_allocs == THREADS + 1);
+    assert(after.block_alloc_scanned > before.block_alloc_scanned);
+    assert(after.delay_ns > before.delay_ns);
+
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    // Counting starts over with the FS
+    assert(tfs_init(&params) != -1);
+    assert(tfs_get_stats(&after) != -1);
+    assert(after.op_calls[TFS_OP_WRITE] == 0);
+    assert(after.op_calls[TFS_OP_OPEN] == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define THREADS (4)
+#define WRITES (100)
+#define EVENTS (64)
+
+char const trace_path[] = "/tmp/tfs_custom_trace_test01.json";
+
+void *th_write(void *arg) {
+    char const *name = arg;
+    int fd = tfs_open(name, TFS_O_CREAT);
+    assert(fd != -1);
+    for (int i = 0; i < WRITES; i++) {
+        assert(tfs_write(fd, "0123456789", 10) == 10);
+    }
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+size_t count(char const *trace, char const *what) {
+    size_t n = 0;
+    for (char const *p = trace; (p = strstr(p, what)) != NULL; p++) {
+        n++;
+    }
+    return n;
+}
+
+int main() {
+    // Tracing is off by default
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_trace_dump(trace_path) == -1);
+    assert(tfs_destroy() != -1);
+
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = THREADS;
+    params.trace_events = EVENTS;
+    assert(tfs_init(&params) != -1);
+
+    char names[THREADS][8];
+    pthread_t tid[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        snprintf(names[i], sizeof(names[i]), "/f%d", i);
+        assert(pthread_create(&tid[i], NULL, th_write, names[i]) == 0);
+    }
+    // Spans of threads that are gone are kept
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    assert(tfs_open("/missing", 0) == -1);
+    assert(tfs_trace_dump("/tmp/tfs_custom_trace_test01_missing/t") == -1);
+    assert(tfs_trace_dump(trace_path) != -1);
+
+    static char trace[1 << 20];
+    FILE *in = fopen(trace_path, "r");
+    assert(in != NULL);
+    size_t len = fread(trace, 1, sizeof(trace) - 1, in);
+    assert(len > 0 && len < sizeof(trace) - 1);
+    assert(fclose(in) == 0);
+    trace[len] = '\0';
+
+    assert(strncmp(trace, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 39) ==
+           0);
+    assert(strcmp(trace + len - 4, "\n]}\n") == 0);
+    assert(count(trace, "\"name\":\"tfs_open\"") >= 1);
+    assert(count(trace, "\"name\":\"tfs_write\"") >= 1);
+    assert(count(trace, "\"name\":\"insert_delay\"") >= 1);
+
+    // Each thread keeps its latest EVENTS spans: the main thread and the
+    // writers, which did more than that
+    size_t spans = count(trace, "\"ph\":\"X\"");
+    assert(spans > THREADS * EVENTS && spans <= (THREADS + 1) * EVENTS);
+    assert(count(trace, "\"tid\":") == spans);
+    for (int t = 1; t <= THREADS + 1; t++) {
+        char tid_field[32];
+        snprintf(tid_field, sizeof(tid_field), "\"tid\":%d,", t);
+        assert(count(trace, tid_field) > 0);
+        assert(count(trace, tid_field) <= EVENTS);
+    }
+
+    assert(tfs_destroy() != -1);
+    unlink(trace_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
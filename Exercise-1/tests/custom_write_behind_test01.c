@@ -0,0 +1,112 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK (1024)
+#define CHUNK (10)
+#define TIMEOUT_MS (20)
+
+char const path[] = "/f1";
+
+ssize_t file_size(char const *name) {
+    char buffer[BLOCK];
+    int fd = tfs_open(name, 0);
+    assert(fd != -1);
+    ssize_t r = tfs_read(fd, buffer, sizeof(buffer));
+    assert(tfs_close(fd) != -1);
+    return r;
+}
+
+int main() {
+    char contents[BLOCK];
+    for (size_t i = 0; i < BLOCK; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.write_behind_ms = 0; // only flush on demand at first
+    assert(tfs_init(&params) != -1);
+
+    // Small writes are gathered until flushed
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(fd != -1);
+    for (size_t off = 0; off < 10 * CHUNK; off += CHUNK) {
+        assert(tfs_write(fd, contents + off, CHUNK) == CHUNK);
+    }
+    assert(file_size(path) == 0);
+    assert(tfs_flush(fd) != -1);
+    assert(file_size(path) == 10 * CHUNK);
+
+    // Reading through the handle sees its own writes
+    assert(tfs_write(fd, contents + 10 * CHUNK, CHUNK) == CHUNK);
+    char buffer[BLOCK];
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == 0); // at the end
+    assert(file_size(path) == 11 * CHUNK);
+
+    // Writes are cut at the end of the block, as unbuffered ones, and a
+    // full block is written out right away
+    size_t rest = BLOCK - 11 * CHUNK;
+    while (rest > 0) {
+        size_t len = rest < CHUNK ? rest : CHUNK;
+        assert(tfs_write(fd, contents + BLOCK - rest, CHUNK) == (ssize_t)len);
+        rest -= len;
+    }
+    assert(tfs_write(fd, contents, CHUNK) == 0);
+    assert(file_size(path) == BLOCK);
+    assert(tfs_close(fd) != -1);
+
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == BLOCK);
+    assert(memcmp(buffer, contents, BLOCK) == 0);
+    assert(tfs_close(fd) != -1);
+
+    // Appends are cut at the end of the block too, counting what is
+    // buffered
+    static char large[3 * BLOCK];
+    memset(large, 'x', sizeof(large));
+    fd = tfs_open("/f3", TFS_O_CREAT | TFS_O_BUFFERED | TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, large, sizeof(large)) == BLOCK);
+    assert(tfs_write(fd, large, CHUNK) == 0);
+    assert(tfs_close(fd) != -1);
+    assert(file_size("/f3") == BLOCK);
+    fd = tfs_open("/f4", TFS_O_CREAT | TFS_O_BUFFERED | TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, CHUNK) == CHUNK);
+    assert(tfs_write(fd, large, sizeof(large)) == BLOCK - CHUNK);
+    assert(tfs_write(fd, large, CHUNK) == 0);
+    assert(tfs_close(fd) != -1);
+    assert(file_size("/f4") == BLOCK);
+
+    // Closing flushes, and so does tfs_destroy for files left open
+    fd = tfs_open("/f2", TFS_O_CREAT | TFS_O_BUFFERED | TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, CHUNK) == CHUNK);
+    assert(tfs_close(fd) != -1);
+    assert(file_size("/f2") == CHUNK);
+    fd = tfs_open("/f2", TFS_O_BUFFERED | TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, CHUNK) == CHUNK);
+    assert(tfs_destroy() != -1);
+
+    // Buffered writes are flushed in the background after a while
+    params.write_behind_ms = TIMEOUT_MS;
+    assert(tfs_init(&params) != -1);
+    fd = tfs_open(path, TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, CHUNK) == CHUNK);
+    while (file_size(path) == 0) {
+        struct timespec wait = {.tv_nsec = TIMEOUT_MS * 1000000};
+        nanosleep(&wait, NULL);
+    }
+    assert(file_size(path) == CHUNK);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+#include "../fs/operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Seed a TécnicoFS image with a directory tree of the OS' file system (see
+ * tfs_import_tree).
+ *
+ * Usage: tools/tfs_import <source dir> <image path> [threads]
+ */
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "usage: %s <source dir> <image path> [threads]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t threads = argc == 4 ? strtoul(argv[3], NULL, 10) : 0;
+
+    tfs_params params = tfs_default_params();
+    params.image_path = argv[2];
+    if (tfs_init(&params) == -1) {
+        fprintf(stderr, "%s: cannot open image %s\n", argv[0], argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    ssize_t imported = tfs_import_tree(argv[1], threads);
+    if (imported == -1) {
+        fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[1]);
+    } else {
+        printf("Imported %zd files.\n", imported);
+    }
+
+    if (tfs_sync() == -1 || tfs_destroy() == -1) {
+        fprintf(stderr, "%s: cannot write image %s\n", argv[0], argv[2]);
+        return EXIT_FAILURE;
+    }
+    return imported == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Large block arenas, mapped straight from the OS so that their unused parts
+ * can be handed back, and backed by transparent huge pages when big enough.
+ */
+
+void *arena_alloc(size_t size);
+void arena_free(void *arena, size_t size);
+void arena_release(void *arena, size_t offset, size_t len);
+
+#endif // ARENA_H
@@ -1,6 +1,7 @@
 #include "operations.h"
 #include "config.h"
 #include "state.h"
+#include "trace.h"
 #include <errno.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -50,6 +51,35 @@ int tfs_destroy() {
     return 0;
 }
 
+/**
+ * Lock the library mutex. When tracing, a wait for it is recorded.
+ *
+ * Returns 0 if successful, an error number otherwise.
+ */
+static int library_lock(void) {
+    if (trace_enabled() && pthread_mutex_trylock(&g_library_mutex) == 0) {
+        return 0;
+    }
+    uint64_t start = trace_now();
+    int ret = pthread_mutex_lock(&g_library_mutex);
+    trace_span("mutex wait", "lock", start, trace_now());
+    return ret;
+}
+
+/**
+ * Record the span of a TFS call in the trace (see tfs_params.trace_events).
+ *
+ * Input:
+ *   - name: the call
+ *   - start: when it started (trace_now)
+ *   - ret: its return value
+ * Returns ret.
+ */
+static ssize_t traced(char const *name, uint64_t start, ssize_t ret) {
+    trace_span(name, "tfs", start, trace_now());
+    return ret;
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
@@ -76,8 +106,8 @@ static int tfs_lookup(char const *name, inode_t const *root_inode) {
     return find_in_dir(root_inode, name);
 }
 
-int tfs_open(char const *name, tfs_file_mode_t mode) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+static int file_open(char const *name, tfs_file_mode_t mode) {
+    if (library_lock() == -1) {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
     }
@@ -162,8 +192,13 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
     // opened but it remains created
 }
 
-int tfs_close(int fhandle) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+int tfs_open(char const *name, tfs_file_mode_t mode) {
+    uint64_t start = trace_now();
+    return (int)traced("tfs_open", start, file_open(name, mode));
+}
+
+static int file_close(int fhandle) {
+    if (library_lock() == -1) {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
     }
@@ -185,8 +220,14 @@ int tfs_close(int fhandle) {
     return 0;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+int tfs_close(int fhandle) {
+    uint64_t start = trace_now();
+    return (int)traced("tfs_close", start, file_close(fhandle));
+}
+
+static ssize_t file_write(int fhandle, void const *buffer,
+                          size_t to_write) {
+    if (library_lock() == -1) {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
     }
@@ -242,8 +283,13 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     return (ssize_t)to_write;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    uint64_t start = trace_now();
+    return traced("tfs_write", start, file_write(fhandle, buffer, to_write));
+}
+
+static ssize_t file_read(int fhandle, void *buffer, size_t len) {
+    if (library_lock() == -1) {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
     }
@@ -291,8 +337,13 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     return (ssize_t)to_read;
 }
 
-int tfs_unlink(char const *target) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    uint64_t start = trace_now();
+    return traced("tfs_read", start, file_read(fhandle, buffer, len));
+}
+
+static int unlink_file(char const *target) {
+    if (library_lock() == -1) {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
     }
@@ -334,3 +385,23 @@ int tfs_unlink(char const *target) {
 
     return 0;
 }
+
+int tfs_unlink(char const *target) {
+    uint64_t start = trace_now();
+    return (int)traced("tfs_unlink", start, unlink_file(target));
+}
+
+int tfs_trace_dump(char const *path) {
+    if (!trace_enabled()) {
+        return -1;
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    int ret = trace_dump(out);
+    if (fclose(out) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
@@ -13,6 +13,10 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+    // Record the latest this many spans of each thread (such as the
+    // mbroker's publish and deliver steps), for tfs_trace_dump; 0 turns
+    // tracing off
+    size_t trace_events;
 } tfs_params;
 
 /**
@@ -137,4 +141,17 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Write the spans recorded by all threads (see tfs_params.trace_events) to a
+ * file of the OS' file system, as Chrome trace events (JSON), to be viewed in
+ * Perfetto or chrome://tracing.
+ * Threads may keep running meanwhile; the spans are kept.
+ *
+ * Input:
+ *   - path: path name of the trace file (from the OS' file system)
+ *
+ * Returns 0 if successful, -1 otherwise (e.g. tracing is off).
+ */
+int tfs_trace_dump(char const *path);
+
 #endif // OPERATIONS_H
@@ -1,5 +1,7 @@
 #include "state.h"
+#include "arena.h"
 #include "betterassert.h"
+#include "trace.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -21,6 +23,7 @@ static allocation_state_t *freeinode_ts;
 // Data blocks
 static char *fs_data; // # blocks * block size
 static allocation_state_t *free_blocks;
+static size_t unreleased_blocks; // freed since their memory was last released
 
 /*
  * Volatile FS state
@@ -31,6 +34,8 @@ static allocation_state_t *free_open_file_entries;
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
+// Freed blocks have their memory given back to the OS in batches of this size
+#define RELEASE_BATCH_BLOCKS (64)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
@@ -75,9 +80,11 @@ static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
  * latencies as if such data structures were really stored in secondary memory.
  */
 static void insert_delay(void) {
+    uint64_t start = trace_now();
     for (int i = 0; i < DELAY; i++) {
         touch_all_memory();
     }
+    trace_span("insert_delay", "storage", start, trace_now());
 }
 
 /**
@@ -98,10 +105,11 @@ int state_init(tfs_params params) {
     if (inode_table != NULL) {
         return -1; // already initialized
     }
+    trace_init(params.trace_events);
 
     inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
     freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
+    fs_data = arena_alloc(DATA_BLOCKS * BLOCK_SIZE);
     free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
     open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
     free_open_file_entries =
@@ -133,9 +141,10 @@ int state_init(tfs_params params) {
  * Returns 0 if succesful, -1 otherwise.
  */
 int state_destroy(void) {
+    trace_destroy();
     free(inode_table);
     free(freeinode_ts);
-    free(fs_data);
+    arena_free(fs_data, DATA_BLOCKS * BLOCK_SIZE);
     free(free_blocks);
     free(open_file_table);
     free(free_open_file_entries);
@@ -143,6 +152,7 @@ int state_destroy(void) {
     inode_table = NULL;
     freeinode_ts = NULL;
     fs_data = NULL;
+    unreleased_blocks = 0;
     free_blocks = NULL;
     open_file_table = NULL;
     free_open_file_entries = NULL;
@@ -422,6 +432,26 @@ int data_block_alloc(void) {
     return -1;
 }
 
+/**
+ * Give the memory of every run of free data blocks back to the OS, so that
+ * the footprint of the FS follows the data it holds. Released blocks read as
+ * zeros, and take memory again when they are next written.
+ */
+static void release_free_blocks(void) {
+    size_t run_start = 0;
+    for (size_t i = 0; i <= DATA_BLOCKS; i++) {
+        if (i < DATA_BLOCKS && free_blocks[i] == FREE) {
+            continue;
+        }
+        if (i > run_start) {
+            arena_release(fs_data, run_start * BLOCK_SIZE,
+                          (i - run_start) * BLOCK_SIZE);
+        }
+        run_start = i + 1;
+    }
+    unreleased_blocks = 0;
+}
+
 /**
  * Free a data block.
  *
@@ -435,6 +465,10 @@ void data_block_free(int block_number) {
     insert_delay(); // simulate storage access delay to free_blocks
 
     free_blocks[block_number] = FREE;
+    if (++unreleased_blocks >= RELEASE_BATCH_BLOCKS) {
+        // Batched, as a release splits huge pages and costs a syscall
+        release_free_blocks();
+    }
 }
 
 /**
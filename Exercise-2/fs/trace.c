@@ -0,0 +1,208 @@
+#include "trace.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * A recorded span.
+ * Its thread may overwrite it while it is being dumped: the n-th span of a
+ * thread has seq 2n + 2 once written, and 2n + 1 while being written.
+ */
+typedef struct {
+    uint64_t seq;
+    char const *name;
+    char const *category;
+    uint64_t start; // ns
+    uint64_t end;
+} trace_event_t;
+
+/**
+ * Ring buffer of a thread, in the list of all threads' rings.
+ */
+typedef struct trace_ring {
+    struct trace_ring *next;
+    uint64_t tid;     // numbered in order of the threads' first span
+    uint64_t written; // spans written so far (the newest capacity are kept)
+    trace_event_t events[];
+} trace_ring_t;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;
+static uint64_t ring_count;
+
+static size_t capacity; // spans per thread, 0 if tracing is off
+static uint64_t origin; // when tracing started (ts 0 of the dump)
+static uint64_t session; // bumped by every trace_init, to drop stale rings
+
+static _Thread_local trace_ring_t *mine;
+static _Thread_local uint64_t mine_session;
+
+static uint64_t clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Start tracing, dropping the spans of a previous session.
+ *
+ * Input:
+ *   - events: spans kept per thread (0 leaves tracing off)
+ */
+void trace_init(size_t events) {
+    trace_destroy();
+    pthread_mutex_lock(&registry_lock);
+    origin = clock_ns();
+    __atomic_add_fetch(&session, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&capacity, events, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * Stop tracing, freeing the rings of all threads.
+ * Must not be called while other threads may record spans.
+ */
+void trace_destroy(void) {
+    pthread_mutex_lock(&registry_lock);
+    __atomic_store_n(&capacity, 0, __ATOMIC_RELEASE);
+    while (rings != NULL) {
+        trace_ring_t *ring = rings;
+        rings = ring->next;
+        free(ring);
+    }
+    ring_count = 0;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+bool trace_enabled(void) {
+    return __atomic_load_n(&capacity, __ATOMIC_RELAXED) != 0;
+}
+
+/**
+ * Returns the current time for trace_span, or 0 if tracing is off (so that
+ * untraced calls do not read the clock).
+ */
+uint64_t trace_now(void) { return trace_enabled() ? clock_ns() : 0; }
+
+/**
+ * Register a ring for the calling thread, in the current session.
+ *
+ * Returns it, or NULL if out of memory (nothing is traced then).
+ */
+static trace_ring_t *thread_register(size_t events) {
+    trace_ring_t *ring =
+        calloc(1, sizeof(trace_ring_t) + events * sizeof(trace_event_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&registry_lock);
+    ring->tid = ++ring_count;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&registry_lock);
+    return ring;
+}
+
+/**
+ * Record a span of the calling thread.
+ * Does nothing if tracing is off, or if it was off when the span started.
+ *
+ * Input:
+ *   - name: what the thread did (a string literal)
+ *   - category: the kind of span (a string literal)
+ *   - start: when it started (trace_now)
+ *   - end: when it ended (trace_now)
+ */
+void trace_span(char const *name, char const *category, uint64_t start,
+                uint64_t end) {
+    size_t events = __atomic_load_n(&capacity, __ATOMIC_ACQUIRE);
+    if (events == 0 || start == 0) {
+        return;
+    }
+    uint64_t current = __atomic_load_n(&session, __ATOMIC_ACQUIRE);
+    if (mine_session != current) {
+        mine = thread_register(events);
+        mine_session = current;
+    }
+    trace_ring_t *ring = mine;
+    if (ring == NULL) {
+        return;
+    }
+
+    // Only this thread writes the ring, but trace_dump reads it
+    uint64_t n = __atomic_load_n(&ring->written, __ATOMIC_RELAXED);
+    trace_event_t *event = &ring->events[n % events];
+    // A reader that sees any of the new fields also sees the odd seq
+    __atomic_store_n(&event->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->name, name, __ATOMIC_RELEASE);
+    __atomic_store_n(&event->category, category, __ATOMIC_RELEASE);
+    __atomic_store_n(&event->start, start, __ATOMIC_RELEASE);
+    __atomic_store_n(&event->end, end, __ATOMIC_RELEASE);
+    __atomic_store_n(&event->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->written, n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Read the n-th span of a thread, which the thread may be overwriting.
+ *
+ * Returns true if the whole span was read, false if it was overwritten.
+ */
+static bool event_read(trace_event_t const *event, uint64_t n,
+                       trace_event_t *copy) {
+    uint64_t seq = 2 * n + 2;
+    if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != seq) {
+        return false;
+    }
+    copy->name = __atomic_load_n(&event->name, __ATOMIC_ACQUIRE);
+    copy->category = __atomic_load_n(&event->category, __ATOMIC_ACQUIRE);
+    copy->start = __atomic_load_n(&event->start, __ATOMIC_ACQUIRE);
+    copy->end = __atomic_load_n(&event->end, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/**
+ * Write the spans kept by all threads as a Chrome trace (JSON object format,
+ * with timestamps in microseconds since tracing started).
+ * Threads may keep tracing meanwhile; spans they overwrite are left out.
+ *
+ * Input:
+ *   - out: where to write the trace
+ *
+ * Returns 0 if successful, -1 if tracing is off or the trace could not be
+ * written.
+ */
+int trace_dump(FILE *out) {
+    pthread_mutex_lock(&registry_lock);
+    size_t events = __atomic_load_n(&capacity, __ATOMIC_ACQUIRE);
+    if (events == 0) {
+        pthread_mutex_unlock(&registry_lock);
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    char const *separator = "\n";
+    for (trace_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+        uint64_t first = written > events ? written - events : 0;
+        for (uint64_t n = first; n < written; n++) {
+            trace_event_t event;
+            if (!event_read(&ring->events[n % events], n, &event) ||
+                event.start < origin || event.end < event.start) {
+                continue;
+            }
+            uint64_t ts = event.start - origin;
+            uint64_t dur = event.end - event.start;
+            fprintf(out,
+                    "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                    "\"pid\":1,\"tid\":%" PRIu64 ",\"ts\":%" PRIu64
+                    ".%03" PRIu64 ",\"dur\":%" PRIu64 ".%03" PRIu64 "}",
+                    separator, event.name, event.category, ring->tid,
+                    ts / 1000, ts % 1000, dur / 1000, dur % 1000);
+            separator = ",\n";
+        }
+    }
+    fprintf(out, "\n]}\n");
+    pthread_mutex_unlock(&registry_lock);
+    return ferror(out) ? -1 : 0;
+}
@@ -1,5 +1,9 @@
+#include "../fs/trace.h"
 #include "../utils/utils.h"
 
+// Spans kept per thread when tracing
+#define TRACE_EVENTS (4096)
+
 // Producer-consumer queue
 pc_queue_t request_queue;
 
@@ -9,6 +13,10 @@ pthread_t *worker_threads;
 // Register Pipe, exclusive to the main thread
 char *register_pipename;
 
+// Where to write the trace of the publish and deliver steps on exit, from
+// the MBROKER_TRACE environment variable (NULL if not tracing)
+char *trace_path;
+
 /**
  * Handles SIGPIPE signal
  */
@@ -25,36 +33,45 @@ void sigpipe_handler(int signo) {
 }
 
 /**
- * Handles SIGINT signal.
+ * Handles SIGINT signal, in a thread of its own that waits for it (all other
+ * threads block it), so that shutting down may lock and write files, which a
+ * signal handler may not (it could interrupt a thread holding the same lock).
  * Exits the program, destroying pcq, boxes, and unlinking all pipes.
  */
-void sig_handler(int signo) {
-    // SIGINT handler
-    if (signo == SIGINT) {
-        // Unlink the register pipe
-        unlink(register_pipename);
-
-        // Destroy the worker threads, and delete the pipes
-        for (int i = 0; i < max_sessions; i++) {
-            pthread_cancel(worker_threads[i]);
-            close(worker_struct_array[i].pipe_fd);
-            unlink(worker_struct_array[i].pipe_name);
-        }
-        // Destroy the request queue
-        if (pcq_destroy(&request_queue) == -1) {
-            exit(1);
-        }
-        // Destroy all boxes
-        if (destroy_box_system(box_struct_array) == -1) {
-            exit(1);
-        }
-        // Destroy TFS
-        if (tfs_destroy() == -1) {
-            exit(1);
-        }
-        exit(0);
+void *sigint_thread(void *arg) {
+    sigset_t const *sigint_set = arg;
+    int signo;
+    if (sigwait(sigint_set, &signo) != 0) {
+        exit(1);
+    }
+
+    // Write the trace out first, whatever happens to the rest
+    if (trace_path != NULL && tfs_trace_dump(trace_path) == -1) {
+        WARN("failed to write the trace to %s\n", trace_path)
+    }
+
+    // Unlink the register pipe
+    unlink(register_pipename);
+
+    // Destroy the worker threads, and delete the pipes
+    for (int i = 0; i < max_sessions; i++) {
+        pthread_cancel(worker_threads[i]);
+        close(worker_struct_array[i].pipe_fd);
+        unlink(worker_struct_array[i].pipe_name);
+    }
+    // Destroy the request queue
+    if (pcq_destroy(&request_queue) == -1) {
+        exit(1);
+    }
+    // Destroy all boxes
+    if (destroy_box_system(box_struct_array) == -1) {
+        exit(1);
+    }
+    // Destroy TFS
+    if (tfs_destroy() == -1) {
+        exit(1);
     }
-    exit(1);
+    exit(0);
 }
 
 /**
@@ -76,6 +93,14 @@ int do_publisher_work(worker_struct *worker) {
     worker->pipe_fd = pipe_fd;
     box_struct_array[worker->box_index]->publisher = pipe_fd;
 
+    // Open box for writing, for the whole session: a box cannot be removed
+    // while it has a publisher (see remove_box), so its name is looked up
+    // once rather than for every message
+    int fd = open_box(worker->box_name, TFS_O_APPEND);
+    if (fd == -1) {
+        return -1;
+    }
+
     while (1) {
 
         char buffer[MAX_MESSAGE_REQUEST];
@@ -85,51 +110,54 @@ int do_publisher_work(worker_struct *worker) {
 
         // Read from pipe
         ssize_t r = read(pipe_fd, buffer, MAX_MESSAGE_REQUEST);
+        uint64_t start = trace_now(); // the publish span leaves out the wait
         if (mutex_lock(&box_struct_array[worker->box_index]->mutex) == -1) {
+            tfs_close(fd);
             return -1;
         }
         if (r == -1) { // If read fails
+            tfs_close(fd);
             mutex_unlock(&box_struct_array[worker->box_index]->mutex);
             return -1;
         }
         if (r == 0) { // If pipe is closed
+            if (tfs_close(fd) == -1) {
+                mutex_unlock(&box_struct_array[worker->box_index]->mutex);
+                return -1;
+            }
             return mutex_unlock(&box_struct_array[worker->box_index]->mutex);
         }
 
-        // Decode message send by client
+        // Decode message send by client. Only the message, up to its
+        // terminator, goes into the box, without the request's code and
+        // padding, so the pipe cannot be read straight into the box (as
+        // tfs_recvfile does in Exercise-1)
         decode_message(message, buffer);
 
-        // Open box for writing
-        int fd = open_box(worker->box_name, TFS_O_APPEND);
-        if (fd == -1) {
-            mutex_unlock(&box_struct_array[worker->box_index]->mutex);
-            return -1;
-        }
-
-        // Write to the box
+        // Write to the box, straight through: the subscribers read it as soon
+        // as they are woken below, so buffering the write (as TFS_O_BUFFERED
+        // does in Exercise-1) would only add a flush before every broadcast
         ssize_t bytes;
         if ((bytes = tfs_write(fd, message, strlen(message) + 1)) == -1) {
+            tfs_close(fd);
             mutex_unlock(&box_struct_array[worker->box_index]->mutex);
             return -1;
         }
         // Increment box size accordingly
         box_struct_array[get_box(worker->box_name)]->size += (uint64_t)bytes;
 
-        // Close box
-        if (tfs_close(fd) == -1) {
-            mutex_unlock(&box_struct_array[worker->box_index]->mutex);
-            return -1;
-        }
-
         if (mutex_unlock(&box_struct_array[worker->box_index]->mutex) == -1) {
+            tfs_close(fd);
             return -1;
         }
 
         // Broadcast write to all Subscribers of that box
         if (pthread_cond_broadcast(
                 &box_struct_array[worker->box_index]->cond) == -1) {
+            tfs_close(fd);
             return -1;
         }
+        trace_span("publish", "mbroker", start, trace_now());
     }
 }
 
@@ -188,6 +216,7 @@ int do_subscriber_work(worker_struct *worker) {
             mutex_unlock(&box_struct_array[worker->box_index]->mutex);
             return -1;
         }
+        uint64_t start = trace_now(); // the deliver span leaves out the wait
 
         // If something was read, create protocol message
         worker->request = create_message(MESSAGE_SUBSCRIBER, buffer);
@@ -196,7 +225,9 @@ int do_subscriber_work(worker_struct *worker) {
             return -1;
         }
 
-        // Write message to pipe
+        // Write message to pipe. Each message is framed with its code and
+        // padded to MAX_MESSAGE_REQUEST, so the box's bytes cannot be streamed
+        // to the pipe as they are (as tfs_sendfile does in Exercise-1)
         ssize_t w = write(pipe_fd, worker->request, MAX_MESSAGE_REQUEST);
         if (w == -1) {
             return mutex_unlock(&box_struct_array[worker->box_index]->mutex);
@@ -206,6 +237,7 @@ int do_subscriber_work(worker_struct *worker) {
         if (mutex_unlock(&box_struct_array[worker->box_index]->mutex) == -1) {
             return -1;
         }
+        trace_span("deliver", "mbroker", start, trace_now());
     }
 }
 
@@ -287,11 +319,23 @@ void *worker_thread_loop(void *worker_index) {
  */
 int initialize_mbroker() {
 
-    signal(SIGINT, sig_handler);
+    // Hold SIGINT off in every thread, until the thread that handles it is
+    // started, once there is something to shut down
+    static sigset_t sigint_set;
+    sigemptyset(&sigint_set);
+    sigaddset(&sigint_set, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &sigint_set, NULL) != 0) {
+        return -1;
+    }
     signal(SIGPIPE, sigpipe_handler);
 
-    // Initialize tfs
-    if (tfs_init(NULL) == -1) {
+    // Initialize tfs, tracing if asked to
+    tfs_params params = tfs_default_params();
+    trace_path = getenv("MBROKER_TRACE");
+    if (trace_path != NULL) {
+        params.trace_events = TRACE_EVENTS;
+    }
+    if (tfs_init(&params) == -1) {
         return -1;
     }
 
@@ -362,6 +406,11 @@ int initialize_mbroker() {
         }
     }
 
+    pthread_t sigint_tid;
+    if (pthread_create(&sigint_tid, NULL, &sigint_thread, &sigint_set) != 0) {
+        PANIC("pthread_create failed, %s\n", strerror(errno))
+    }
+
     return 0;
 }
 